@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,14 +16,178 @@
 #include <regex.h>
 #include <pwd.h>
 #include <grp.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <math.h>
+#include <sys/utsname.h>
+#include <sys/sysmacros.h>
+#include <dlfcn.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
 
 #define MAX_PATH 2048
 #define RESULT_DIR "results"
 #define MOUNT_POINT "/mnt/output_disk"
+#define FANOUT_MOUNT_POINT "/mnt/output_disk2"
+#define IO_ALIGNMENT 4096
+#define PAGE_CACHE_WINDOW (32 * 1024 * 1024)
+#define BENCH_CACHE_FILE "/var/cache/dddarth/benchmark.cache"
+#define COMPRESS_SAMPLE (16 * 1024 * 1024)
+#define ZSTD_FRAME_MAGIC 0xFD2FB528
+#define LZ4_FRAME_MAGIC 0x184D2204
+#define SEEK_TABLE_MAGIC 0x184D2A5E
+#define SEEKABLE_MAGIC 0x8F92EAB1
+#define DELTA_MAGIC "DDDELTA1"
+#define RESCUE_MIN_SKIP (64 * 1024)
+#define RESCUE_MAX_SKIP (1024ULL * 1024 * 1024)
+#define RESCUE_COMMIT_SECONDS 5.0
+#define ALLOCATION_MIN_GAP (1024 * 1024)
+#define THROTTLE_BURST_NS 100000000ULL
+#define THROTTLE_ADJUST_SECONDS 0.25
+#define DEFAULT_METRICS_SOCKET "/run/dddarth.sock"
+#define DEFAULT_METRICS_TEXTFILE_DIR "/var/lib/node_exporter/textfile_collector"
+#define METRICS_TEXT_SIZE 32768
+#define METRICS_LABEL_SIZE 512
+#define LATENCY_SUB_BITS 4
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+enum copy_engine_type
+{
+    ENGINE_DD,
+    ENGINE_NATIVE,
+    ENGINE_URING,
+    ENGINE_STRIPED,
+    ENGINE_PIPELINE,
+    ENGINE_ZEROCOPY
+};
+
+const char *copy_engine_names[] = {"dd", "native", "uring", "striped", "pipeline", "zerocopy"};
+const size_t num_copy_engines = sizeof(copy_engine_names) / sizeof(copy_engine_names[0]);
+
+enum compressor_type
+{
+    COMPRESS_NONE,
+    COMPRESS_ZSTD,
+    COMPRESS_LZ4
+};
+
+const char *compressor_names[] = {"none", "zstd", "lz4"};
+const char *compressor_suffixes[] = {"", ".zst", ".lz4"};
+
+/**
+ * @brief Byte count and monotonic-clock phase timings of one copy.
+ *
+ * elapsed_seconds runs until the last write returned (what the page cache absorbed);
+ * flush_seconds is the fdatasync() after it, so elapsed + flush is the durable copy time.
+ * read/write are summed over threads and stay 0 for engines where the kernel overlaps them.
+ */
+struct copy_stats
+{
+    uint64_t bytes_copied;
+    double elapsed_seconds;
+    double reader_stall_seconds;
+    double writer_stall_seconds;
+    double open_seconds;
+    double read_seconds;
+    double write_seconds;
+    double flush_seconds;
+    uint64_t bytes_skipped;
+    uint64_t bytes_unreadable;
+    uint64_t bytes_unallocated;
+    uint64_t reader_stalls;
+    uint64_t writer_stalls;
+};
+
+/**
+ * @brief State of one in-process copy from a source file/device into a target file.
+ *
+ * The source and target are opened once; the copy loop works on absolute offsets with
+ * pread/pwrite so the same session can be driven over arbitrary ranges.
+ */
+struct copy_session
+{
+    const char *source_path;
+    const char *target_path;
+    int source_fd;
+    int target_fd;
+    size_t block_size;
+    unsigned queue_depth;
+    uint64_t source_size;
+    int show_progress;
+    int zerocopy_splice;
+    int sparse;
+    struct image_hasher *hasher;
+    struct io_metrics *metrics;
+    double last_progress;
+    struct copy_stats stats;
+};
+
+/**
+ * @brief One point of the benchmark search space.
+ */
+struct bench_config
+{
+    enum copy_engine_type engine;
+    char block_size[10];
+    unsigned queue_depth;
+    unsigned threads;
+    int direct;
+};
+
+/**
+ * @brief What sysfs says about the disk behind a path; the benchmark cache is keyed on it.
+ */
+struct device_identity
+{
+    char name[64];
+    char model[64];
+    char serial[128];
+    char firmware[32];
+    unsigned logical_block_size;
+    unsigned physical_block_size;
+};
 
 void change_permissions(const char *path);
 void parse_copy_size(const char *optarg);
 void parse_block_sizes(const char *optarg);
+void parse_engine(const char *optarg);
+void parse_queue_depth(const char *optarg);
+void parse_threads(const char *optarg);
+void parse_chunk_size(const char *optarg);
+void parse_adapt_window(const char *optarg);
+unsigned parse_count(const char *optarg, const char *what, unsigned min, unsigned max);
+void parse_search(const char *optarg);
+void parse_rank_by(const char *optarg);
+void parse_compress(const char *optarg);
+void parse_frame_size(const char *optarg);
+void parse_journal_interval(const char *optarg);
+void parse_max_rate(const char *optarg);
+void get_device_identity(const char *path, struct device_identity *identity);
+unsigned *parse_count_list(const char *optarg, const char *what, unsigned min, unsigned max, size_t *count);
+void parse_direct_modes(const char *optarg);
+void copy_to_image(const char *output_file_path);
+void copy_to_images(const char *optarg);
+void run_batch(const char *job_file);
+void append_command(char *command, size_t command_size, const char *format, ...);
+int engine_uses_queue_depth(enum copy_engine_type engine);
+void ensure_mount_point_exists(const char *mount_point);
+int is_valid_block_size(const char *size);
+void choose_copy_settings();
 
 const char *default_block_sizes[] = {"32k", "64k", "128k", "256k", "512k", "1M", "4M", "16M"};
 const size_t num_default_block_sizes = sizeof(default_block_sizes) / sizeof(default_block_sizes[0]);
@@ -34,6 +200,65 @@ char *output_disk = "/dev/sdb";
 
 char best_block_size[10] = "";
 double best_transfer_rate = 0;
+enum copy_engine_type best_engine = ENGINE_NATIVE;
+struct bench_config best_config = {ENGINE_NATIVE, "", 32, 4, 0};
+
+enum copy_engine_type copy_engine = ENGINE_NATIVE;
+enum copy_engine_type *selected_engines = NULL;
+size_t num_selected_engines = 0;
+int use_direct_io = 0;
+unsigned queue_depth = 32;
+unsigned copy_threads = 4;
+int adaptive_tuning = 0;
+int page_cache_control = 1;
+int sparse_output = 0;
+int hash_image = 0;
+int verify_output = 0;
+unsigned hash_threads = 2;
+enum compressor_type compress_output = COMPRESS_NONE;
+int compress_level = 0; // 0 = chosen from measured CPU and target throughput
+uint64_t frame_size_bytes = 4ULL * 1024 * 1024;
+unsigned compress_threads = 0; // 0 = one per online CPU
+char *incremental_base = NULL;
+int patch_base = 0;
+int resume_copy = 0;
+uint64_t journal_interval_bytes = 1024ULL * 1024 * 1024;
+int rescue_mode = 0;
+int allocated_only = 0;
+unsigned rescue_retries = 2;
+unsigned batch_jobs_per_controller = 1;
+unsigned batch_max_jobs = 0; // 0 = as many as the controllers allow
+double stats_window_seconds = 1.0;
+char *metrics_file = NULL;
+char *metrics_socket = NULL;
+double metrics_interval_seconds = 1.0;
+uint64_t max_rate_bytes = 0;
+unsigned max_iops = 0;
+unsigned latency_target_us = 0;
+char *io_priority = NULL;
+char *io_cgroup = NULL;
+struct io_metrics *last_io_metrics = NULL;
+int bench_rank_buffered = 0;
+struct copy_stats last_bench_stats;
+unsigned bench_repetitions = 1;
+unsigned bench_warmup = 0;
+enum bench_search_type
+{
+    SEARCH_EXHAUSTIVE,
+    SEARCH_HALVING
+} bench_search = SEARCH_EXHAUSTIVE;
+double bench_time_budget = 0;
+unsigned *bench_queue_depths = NULL;
+size_t num_bench_queue_depths = 0;
+unsigned *bench_thread_counts = NULL;
+size_t num_bench_thread_counts = 0;
+int *bench_direct_modes = NULL;
+size_t num_bench_direct_modes = 0;
+uint64_t adapt_window_bytes = 1024ULL * 1024 * 1024;
+uint64_t chunk_size_bytes = 64ULL * 1024 * 1024;
+char *bench_cache_file = BENCH_CACHE_FILE;
+unsigned bench_cache_ttl_hours = 168;
+int bench_cache_refresh = 0;
 
 void print_colored(const char *color_code, const char *format, ...)
 {
@@ -148,7 +373,10 @@ void unmount_existing_partitions(const char *disk)
     pclose(fp);
 }
 
-void prepare_disk(const char *disk)
+/**
+ * @brief Partitions and formats disk and mounts it at mount_point.
+ */
+void prepare_disk_at(const char *disk, const char *mount_point)
 {
     char command[MAX_PATH];
     struct stat st;
@@ -176,20 +404,36 @@ void prepare_disk(const char *disk)
     snprintf(command, sizeof(command), "sudo mkfs.ext4 -F %s > /dev/null 2>&1", partition_path);
     execute_command(command);
 
-    ensure_mount_point_exists(); // Ensure the mount point exists
+    ensure_mount_point_exists(mount_point); // Ensure the mount point exists
 
-    snprintf(command, sizeof(command), "sudo mount %s %s", partition_path, MOUNT_POINT);
+    snprintf(command, sizeof(command), "sudo mount %s %s", partition_path, mount_point);
     execute_command(command);
 
-    snprintf(command, sizeof(command), "sudo chmod 777 %s", MOUNT_POINT);
+    snprintf(command, sizeof(command), "sudo chmod 777 %s", mount_point);
     execute_command(command);
 }
 
+void prepare_disk(const char *disk)
+{
+    prepare_disk_at(disk, MOUNT_POINT);
+}
+
 
-void drop_caches()
+/**
+ * @brief Evicts the first length bytes (0 = all) of one file or device from the page cache.
+ *
+ * Used instead of a global drop_caches so benchmarks start cold without touching the cache of
+ * anything else running on the host. Dirty pages are left alone; only clean ones are dropped.
+ */
+void evict_page_cache(const char *path, uint64_t length)
 {
-    execute_command("echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null");
-    sync();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+    posix_fadvise(fd, 0, length, POSIX_FADV_DONTNEED);
+    close(fd);
 }
 
 size_t parse_size(const char *size_str)
@@ -246,13 +490,19 @@ void change_file_ownership_to_non_root(const char *file_path)
     // print_debug("Changed ownership of %s to %s:%s", file_path, pw->pw_name, gr->gr_name);
 }
 
+/**
+ * @brief Reads the transfer rate in MB/s from the last summary line dd printed.
+ *
+ * The exact byte count and seconds of "N bytes (...) copied, S s, R UNIT/s" are preferred over
+ * dd's rounded rate; the rate is only used (with its SI unit) when the byte count is missing.
+ * Returns 0 and warns when the output has no summary line, e.g. because dd failed.
+ */
 double parse_transfer_rate(const char *dd_output)
 {
     regex_t regex;
-    regmatch_t matches[3];
+    regmatch_t matches[6];
     double transfer_rate_value = 0.0;
-    char rate_str[16];
-    const char *pattern = "([0-9]+\\.[0-9]+) (GB/s|MB/s)";
+    const char *pattern = "([0-9]+) bytes[^\r\n]* copied, ([0-9.e+-]+) s, ([0-9.e+-]+) (B|kB|MB|GB|TB)/s";
 
     if (regcomp(&regex, pattern, REG_EXTENDED) != 0)
     {
@@ -260,279 +510,9105 @@ double parse_transfer_rate(const char *dd_output)
         exit(EXIT_FAILURE);
     }
 
+    // status=progress keeps rewriting its line, so the final summary is the last match.
     const char *cursor = dd_output;
-    while (regexec(&regex, cursor, 3, matches, 0) == 0)
+    int found = 0;
+    while (regexec(&regex, cursor, 6, matches, 0) == 0)
     {
-        snprintf(rate_str, matches[1].rm_eo - matches[1].rm_so + 1, "%.*s", (int)(matches[1].rm_eo - matches[1].rm_so), cursor + matches[1].rm_so);
-        transfer_rate_value = atof(rate_str);
-        if (strncmp(cursor + matches[2].rm_so, "GB/s", 4) == 0)
+        double bytes = strtod(cursor + matches[1].rm_so, NULL);
+        double seconds = strtod(cursor + matches[2].rm_so, NULL);
+        double rate = strtod(cursor + matches[3].rm_so, NULL);
+        const char *units[] = {"B", "kB", "MB", "GB", "TB"};
+        const double scale[] = {1e-6, 1e-3, 1, 1e3, 1e6};
+        for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); ++i)
         {
-            transfer_rate_value *= 1024;
+            if ((size_t)(matches[4].rm_eo - matches[4].rm_so) == strlen(units[i]) && strncmp(cursor + matches[4].rm_so, units[i], strlen(units[i])) == 0)
+            {
+                rate *= scale[i];
+            }
         }
+        transfer_rate_value = bytes > 0 && seconds > 0 ? bytes / seconds / 1e6 : rate;
+        found = 1;
         cursor += matches[0].rm_eo;
     }
 
     regfree(&regex);
+    if (!found)
+    {
+        print_colored("\033[1;33m", "Warning: no transfer summary in the dd output; timing the dd process instead.\n");
+    }
     return transfer_rate_value;
 }
 
-/**
- * @brief Runs the `dd` command to perform a data transfer and measures the transfer rate.
- *
- * This function constructs and executes a `dd` command to copy data from the input file to an output file
- * with the specified block size. It measures the transfer rate and updates the best block size and transfer rate
- * if the current transfer rate is higher.
- *
- * @param block_size The block size to be used for the `dd` command. It should be a string representing the size (e.g., "4M").
- */
-void run_dd(const char *block_size)
+double monotonic_seconds()
 {
-    char timestamp[32];
-    time_t now = time(NULL);
-
-    // Get human-readable date and time
-    char time_str[64];
-    struct tm *time_info = localtime(&now);
-    strftime(time_str, sizeof(time_str), "%Y%m%d_%H%M%S", time_info);
-
-    // Append date and time to the file name
-    char output_file_path[MAX_PATH];
-    snprintf(output_file_path, sizeof(output_file_path), "%s/%s_%s_%s_%s.dd", MOUNT_POINT, copy_size, block_size, time_str, timestamp);
-
-    ensure_mount_point_exists(); // Ensure the mount point exists
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    struct stat st;
-    if (stat(MOUNT_POINT, &st) == -1)
+void *allocate_io_buffer(size_t size)
+{
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, IO_ALIGNMENT, size) != 0)
     {
-        fprintf(stderr, "Error: Mount point %s does not exist.\n", MOUNT_POINT);
+        perror("posix_memalign");
         exit(EXIT_FAILURE);
     }
+    return buffer;
+}
 
-    size_t block_size_bytes = parse_size(block_size);
-    size_t copy_size_bytes = parse_size(copy_size);
-    size_t count = copy_size_bytes / block_size_bytes;
-
-    char dd_command[MAX_PATH * 2];
-    snprintf(dd_command, sizeof(dd_command), "sudo dd if=%s of=%s bs=%s count=%zu status=progress 2>&1", input_file, output_file_path, block_size, count);
-
-    print_colored("\033[1;33m", "Running dd with block size %s...\n", block_size);
-    print_colored("\033[1;34m", "Executing: %s\n", dd_command);
-
-    drop_caches();
-    FILE *fp = popen(dd_command, "r");
-    if (fp == NULL)
+uint64_t get_device_size(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
     {
-        perror("popen");
+        perror("fstat");
         exit(EXIT_FAILURE);
     }
 
-    char dd_output[20480];
-    FILE *result_file = NULL;
-    char result_file_path[MAX_PATH];
-    snprintf(result_file_path, sizeof(result_file_path), "%s/dd_output_%s_%s.txt", RESULT_DIR, block_size, time_str);
-
-    if (stat(RESULT_DIR, &st) == -1)
+    if (S_ISBLK(st.st_mode))
     {
-        if (mkdir(RESULT_DIR, 0777) != 0)
-        { // Ensuring directory is accessible by everyone
-            perror("mkdir");
+        uint64_t size = 0;
+        if (ioctl(fd, BLKGETSIZE64, &size) != 0)
+        {
+            perror("ioctl BLKGETSIZE64");
             exit(EXIT_FAILURE);
         }
+        return size;
     }
+    return (uint64_t)st.st_size;
+}
 
-    result_file = fopen(result_file_path, "w");
-    if (result_file == NULL)
-    {
-        perror("fopen");
-        exit(EXIT_FAILURE);
-    }
-
-    size_t dd_output_size;
-    while ((dd_output_size = fread(dd_output, sizeof(char), sizeof(dd_output) - 1, fp)) > 0)
+/**
+ * @brief Opens a file for the copy engine, honouring --direct when the filesystem allows it.
+ *
+ * O_DIRECT is rejected by some filesystems (tmpfs, overlay); in that case the file is reopened
+ * buffered and a warning is printed instead of failing the whole job.
+ */
+int open_for_copy(const char *path, int flags, mode_t mode)
+{
+    int fd = -1;
+    if (use_direct_io)
     {
-        dd_output[dd_output_size] = '\0';
-        fprintf(result_file, "%s", dd_output);
+        fd = open(path, flags | O_DIRECT, mode);
+        if (fd < 0 && errno == EINVAL)
+        {
+            print_colored("\033[1;33m", "Warning: O_DIRECT not supported for %s, using buffered I/O.\n", path);
+        }
     }
-
-    fclose(result_file);
-    pclose(fp);
-
-    change_permissions(result_file_path);
-
-    result_file = fopen(result_file_path, "r");
-    if (result_file == NULL)
+    if (fd < 0)
     {
-        perror("fopen");
-        exit(EXIT_FAILURE);
+        fd = open(path, flags, mode);
     }
-
-    fseek(result_file, 0, SEEK_END);
-    long file_size = ftell(result_file);
-    fseek(result_file, 0, SEEK_SET);
-
-    char *file_contents = (char *)malloc(file_size + 1);
-    if (file_contents == NULL)
+    if (fd < 0)
     {
-        perror("malloc");
+        fprintf(stderr, "Error: Could not open %s: %s\n", path, strerror(errno));
         exit(EXIT_FAILURE);
     }
+    return fd;
+}
 
-    fread(file_contents, 1, file_size, result_file);
-    file_contents[file_size] = '\0';
-    fclose(result_file);
-
-    double transfer_rate_value = parse_transfer_rate(file_contents);
-    free(file_contents);
-
-    print_colored("\033[1;37m", "Transfer rate with block size %s: \033[1;35m%.2f MB/s\033[1;37m\n", block_size, transfer_rate_value);
-
-    if (transfer_rate_value > best_transfer_rate)
+/**
+ * @brief Drops O_DIRECT from an open descriptor; returns 1 if it was set.
+ *
+ * Used when the unaligned tail of an image cannot be transferred with O_DIRECT.
+ */
+int clear_direct_io(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || !(flags & O_DIRECT))
     {
-        strcpy(best_block_size, block_size);
-        best_transfer_rate = transfer_rate_value;
+        return 0;
     }
+    return fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
 }
 
+/**
+ * @brief Drops O_DIRECT after a transfer of length bytes failed with EINVAL; returns 1 if it did.
+ *
+ * Only an unaligned length (the tail of an image) qualifies. The descriptor is shared by every
+ * worker, and an EINVAL on an aligned transfer is a bug that buffered I/O would hide.
+ */
+int clear_direct_io_for_tail(int fd, size_t length)
+{
+    return length % IO_ALIGNMENT != 0 && clear_direct_io(fd);
+}
 
-void change_file_permissions(const char *file_path)
+ssize_t read_fully(int fd, void *buffer, size_t length, uint64_t offset)
 {
-    if (chmod(file_path, 0666) != 0)
+    size_t done = 0;
+    while (done < length)
     {
-        perror("chmod");
-        exit(EXIT_FAILURE);
+        ssize_t ret = pread(fd, (char *)buffer + done, length - done, offset + done);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0)
+        {
+            break;
+        }
+        done += ret;
     }
-
-    // print_debug("Changed permissions of %s to 0666", file_path);
+    return done;
 }
 
-void change_permissions(const char *path)
+ssize_t write_fully(int fd, const void *buffer, size_t length, uint64_t offset)
 {
-    if (chmod(path, 0777) != 0)
+    size_t done = 0;
+    while (done < length)
     {
-        perror("chmod");
-        exit(EXIT_FAILURE);
+        ssize_t ret = pwrite(fd, (const char *)buffer + done, length - done, offset + done);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // The unaligned tail of an image cannot be written with O_DIRECT; finish it buffered.
+            if (errno == EINVAL && clear_direct_io_for_tail(fd, length - done))
+            {
+                continue;
+            }
+            return -1;
+        }
+        done += ret;
     }
-
-    // print_debug("Changed permissions of %s to 0777", path);
+    return done;
 }
 
-void benchmark_and_get_best_block_size()
+/**
+ * @brief Zero-block detectors. Each one returns 1 if length bytes at buffer are all zero and
+ * stops at the first non-zero vector; the widest one the CPU supports is picked at startup.
+ */
+int is_zero_block_scalar(const void *buffer, size_t length)
 {
-    best_transfer_rate = 0.0;
-    best_block_size[0] = '\0';
-
-    if (block_sizes == NULL)
+    const unsigned char *p = buffer;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
     {
-        block_sizes = (char **)default_block_sizes;
-        num_block_sizes = num_default_block_sizes;
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        if (word)
+        {
+            return 0;
+        }
     }
-
-    for (size_t i = 0; i < num_block_sizes; ++i)
+    for (; i < length; ++i)
     {
-        run_dd(block_sizes[i]);
+        if (p[i])
+        {
+            return 0;
+        }
     }
-
-    print_colored("\033[1;35m", "Best block size: %s\n", best_block_size);
-    print_colored("\033[1;35m", "Best transfer rate: %.2f MB/s\n", best_transfer_rate);
+    return 1;
 }
 
-void nvme_to_sdb_auto_rip()
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) int is_zero_block_sse2(const void *buffer, size_t length)
 {
-    prepare_disk("/dev/sdb");
-    benchmark_and_get_best_block_size();
-
-    if (strlen(best_block_size) == 0)
+    const char *p = buffer;
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64)
     {
-        print_colored("\033[1;31m", "Error: No valid block size found. Aborting copy.\n");
-        exit(EXIT_FAILURE);
+        __m128i acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)), _mm_loadu_si128((const __m128i *)(p + i + 16))),
+                                   _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)), _mm_loadu_si128((const __m128i *)(p + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+        {
+            return 0;
+        }
     }
-
-    char timestamp[32];
-    time_t now = time(NULL);
-    snprintf(timestamp, sizeof(timestamp), "%ld", now);
-
-    char dd_command[MAX_PATH * 2];
-    snprintf(dd_command, sizeof(dd_command), "dd if=/dev/nvme0n1 of=/mnt/output_disk/nvme0n1_sdb1_%ld.dd bs=%s status=progress", now, best_block_size);
-
-    print_colored("\033[1;33m", "Running final dd command to copy from nvme0n1 to sdb...\n");
-    print_colored("\033[1;32m", "Executing: %s\n", dd_command);
-    execute_command(dd_command);
+    return is_zero_block_scalar(p + i, length - i);
 }
 
-void nvme_to_sda_auto_rip()
+__attribute__((target("avx2"))) int is_zero_block_avx2(const void *buffer, size_t length)
 {
-    prepare_disk("/dev/sda");
-    benchmark_and_get_best_block_size();
-
-    if (strlen(best_block_size) == 0)
+    const char *p = buffer;
+    size_t i = 0;
+    for (; i + 128 <= length; i += 128)
     {
-        print_colored("\033[1;31m", "Error: No valid block size found. Aborting copy.\n");
-        exit(EXIT_FAILURE);
+        __m256i acc = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + i)), _mm256_loadu_si256((const __m256i *)(p + i + 32))),
+                                      _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + i + 64)), _mm256_loadu_si256((const __m256i *)(p + i + 96))));
+        if (!_mm256_testz_si256(acc, acc))
+        {
+            return 0;
+        }
     }
-
-    char timestamp[32];
-    time_t now = time(NULL);
-    snprintf(timestamp, sizeof(timestamp), "%ld", now);
-
-    char dd_command[MAX_PATH * 2];
-    snprintf(dd_command, sizeof(dd_command), "dd if=/dev/nvme0n1 of=/mnt/output_disk/nvme0n1_sda1_%ld.dd bs=%s status=progress", now, best_block_size);
-
-    print_colored("\033[1;33m", "Running final dd command to copy from nvme0n1 to sda...\n");
-    print_colored("\033[1;32m", "Executing: %s\n", dd_command);
-    execute_command(dd_command);
+    return is_zero_block_scalar(p + i, length - i);
 }
 
-void ensure_mount_point_exists()
+__attribute__((target("avx512f"))) int is_zero_block_avx512(const void *buffer, size_t length)
 {
-    struct stat st;
-    if (stat(MOUNT_POINT, &st) == -1)
+    const char *p = buffer;
+    size_t i = 0;
+    for (; i + 256 <= length; i += 256)
     {
-        if (mkdir(MOUNT_POINT, 0700) != 0)
+        __m512i acc = _mm512_or_si512(_mm512_or_si512(_mm512_loadu_si512(p + i), _mm512_loadu_si512(p + i + 64)),
+                                      _mm512_or_si512(_mm512_loadu_si512(p + i + 128), _mm512_loadu_si512(p + i + 192)));
+        if (_mm512_test_epi64_mask(acc, acc))
         {
-            perror("mkdir");
-            exit(EXIT_FAILURE);
+            return 0;
         }
     }
+    return is_zero_block_scalar(p + i, length - i);
 }
+#endif
 
-void install_program()
+int (*is_zero_block)(const void *buffer, size_t length) = is_zero_block_scalar;
+const char *zero_block_kernel = "scalar";
+
+void select_zero_block_kernel()
 {
-    char command[MAX_PATH];
-    snprintf(command, sizeof(command), "sudo cp ./dddarth /usr/local/bin/dddarth");
-    execute_command(command);
-    print_colored("\033[1;32m", "Program installed to /usr/local/bin/dddarth\n");
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        is_zero_block = is_zero_block_avx512;
+        zero_block_kernel = "avx512";
+    }
+    else if (__builtin_cpu_supports("avx2"))
+    {
+        is_zero_block = is_zero_block_avx2;
+        zero_block_kernel = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        is_zero_block = is_zero_block_sse2;
+        zero_block_kernel = "sse2";
+    }
+#endif
 }
 
 /**
- * @brief Creates a systemd service for automated data transfer.
- *
- * This function benchmarks the input and output drives to determine the best block size
- * for data transfer. It then creates a systemd service file that will perform the data
- * transfer from the input drive to the output drive using the best block size.
- *
- * @param input_drive The path to the input drive (e.g., /dev/nvme0n1).
- * @param output_drive The path to the output drive (e.g., /dev/sdb).
+ * @brief In sparse mode, returns 1 for an all-zero block that should not be written; the hole
+ * left in the image reads back as zeros. Counts the skipped bytes in the session stats.
  */
-void create_systemd_service(const char *input_drive, const char *output_drive)
+int skip_zero_block(struct copy_session *session, const void *buffer, size_t length)
 {
-    // print_debug("Entered create_systemd_service function");
-
-    input_file = strdup(input_drive);
-    output_disk = strdup(output_drive);
-    // print_debug("Input drive: %s, Output drive: %s", input_file, output_disk);
-
-    benchmark_and_get_best_block_size();
-    // print_debug("Best block size: %s, Best transfer rate: %.2f MB/s", best_block_size, best_transfer_rate);
-
-    if (strlen(best_block_size) == 0)
+    if (!session->sparse || !is_zero_block(buffer, length))
     {
-        print_colored("\033[1;31m", "Error: No valid block size found. Aborting creation of systemd service.\n");
-        exit(EXIT_FAILURE);
+        return 0;
     }
+    session->stats.bytes_skipped += length;
+    return 1;
+}
 
-    char command[MAX_PATH];
-    char partuuid_output[MAX_PATH];
-    char partuuid_input[MAX_PATH] = "";
+/**
+ * @brief Streaming SHA-256. Compression runs through sha256_blocks, which is the SHA-NI version
+ * when the CPU has it and the portable one otherwise.
+ */
+struct sha256_ctx
+{
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char buffer[64];
+    size_t buffered;
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be,
+    0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa,
+    0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85,
+    0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+    0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_blocks_scalar(uint32_t state[8], const unsigned char *data, size_t blocks)
+{
+    while (blocks--)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+        {
+            w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 | (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; ++i)
+        {
+            uint32_t s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i)
+        {
+            uint32_t t1 = h + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        data += 64;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sha,sse4.1"))) void sha256_blocks_shani(uint32_t state[8], const unsigned char *data, size_t blocks)
+{
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // The SHA instructions keep the state as ABEF/CDGH.
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    while (blocks--)
+    {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i msg[4];
+        for (int g = 0; g < 16; ++g)
+        {
+            __m128i w;
+            if (g < 4)
+            {
+                w = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + g * 16)), byte_swap);
+            }
+            else
+            {
+                w = _mm_sha256msg1_epu32(msg[g & 3], msg[(g - 3) & 3]);
+                w = _mm_add_epi32(w, _mm_alignr_epi8(msg[(g - 1) & 3], msg[(g - 2) & 3], 4));
+                w = _mm_sha256msg2_epu32(w, msg[(g - 1) & 3]);
+            }
+            msg[g & 3] = w;
+
+            __m128i k = _mm_add_epi32(w, _mm_loadu_si128((const __m128i *)&sha256_k[g * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, k);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(k, 0x0E));
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+void (*sha256_blocks)(uint32_t state[8], const unsigned char *data, size_t blocks) = sha256_blocks_scalar;
+const char *sha256_kernel = "scalar";
+
+void select_sha256_kernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned eax, ebx, ecx, edx;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1") && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29)))
+    {
+        sha256_blocks = sha256_blocks_shani;
+        sha256_kernel = "sha-ni";
+    }
+#endif
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->buffered = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t length)
+{
+    const unsigned char *p = data;
+    ctx->length += length;
+    if (ctx->buffered > 0)
+    {
+        size_t take = 64 - ctx->buffered < length ? 64 - ctx->buffered : length;
+        memcpy(ctx->buffer + ctx->buffered, p, take);
+        ctx->buffered += take;
+        p += take;
+        length -= take;
+        if (ctx->buffered < 64)
+        {
+            return;
+        }
+        sha256_blocks(ctx->state, ctx->buffer, 1);
+        ctx->buffered = 0;
+    }
+    if (length >= 64)
+    {
+        sha256_blocks(ctx->state, p, length / 64);
+        p += length / 64 * 64;
+        length %= 64;
+    }
+    memcpy(ctx->buffer, p, length);
+    ctx->buffered = length;
+}
+
+void sha256_final(struct sha256_ctx *ctx, unsigned char digest[32])
+{
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad[72] = {0x80};
+    size_t pad_length = (ctx->buffered < 56 ? 56 : 120) - ctx->buffered;
+    for (int i = 0; i < 8; ++i)
+    {
+        pad[pad_length + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    sha256_update(ctx, pad, pad_length + 8);
+    for (int i = 0; i < 8; ++i)
+    {
+        digest[i * 4] = ctx->state[i] >> 24;
+        digest[i * 4 + 1] = ctx->state[i] >> 16;
+        digest[i * 4 + 2] = ctx->state[i] >> 8;
+        digest[i * 4 + 3] = ctx->state[i];
+    }
+}
+
+/**
+ * @brief Streaming XXH64 (seed 0), the fast non-cryptographic checksum next to SHA-256.
+ */
+struct xxh64_ctx
+{
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char memory[32];
+    size_t buffered;
+};
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+#define XXH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t xxh64_read64(const unsigned char *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc = XXH_ROTL(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t value)
+{
+    acc ^= xxh64_round(0, value);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+void xxh64_init(struct xxh64_ctx *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->v[0] = XXH_P1 + XXH_P2;
+    ctx->v[1] = XXH_P2;
+    ctx->v[2] = 0;
+    ctx->v[3] = -XXH_P1;
+}
+
+void xxh64_update(struct xxh64_ctx *ctx, const void *data, size_t length)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = p + length;
+    ctx->total += length;
+
+    if (ctx->buffered + length < 32)
+    {
+        memcpy(ctx->memory + ctx->buffered, p, length);
+        ctx->buffered += length;
+        return;
+    }
+    if (ctx->buffered > 0)
+    {
+        memcpy(ctx->memory + ctx->buffered, p, 32 - ctx->buffered);
+        p += 32 - ctx->buffered;
+        for (int i = 0; i < 4; ++i)
+        {
+            ctx->v[i] = xxh64_round(ctx->v[i], xxh64_read64(ctx->memory + i * 8));
+        }
+        ctx->buffered = 0;
+    }
+    uint64_t v0 = ctx->v[0], v1 = ctx->v[1], v2 = ctx->v[2], v3 = ctx->v[3];
+    while (p + 32 <= end)
+    {
+        v0 = xxh64_round(v0, xxh64_read64(p));
+        v1 = xxh64_round(v1, xxh64_read64(p + 8));
+        v2 = xxh64_round(v2, xxh64_read64(p + 16));
+        v3 = xxh64_round(v3, xxh64_read64(p + 24));
+        p += 32;
+    }
+    ctx->v[0] = v0;
+    ctx->v[1] = v1;
+    ctx->v[2] = v2;
+    ctx->v[3] = v3;
+    memcpy(ctx->memory, p, end - p);
+    ctx->buffered = end - p;
+}
+
+uint64_t xxh64_digest(const struct xxh64_ctx *ctx)
+{
+    uint64_t h;
+    if (ctx->total >= 32)
+    {
+        h = XXH_ROTL(ctx->v[0], 1) + XXH_ROTL(ctx->v[1], 7) + XXH_ROTL(ctx->v[2], 12) + XXH_ROTL(ctx->v[3], 18);
+        for (int i = 0; i < 4; ++i)
+        {
+            h = xxh64_merge_round(h, ctx->v[i]);
+        }
+    }
+    else
+    {
+        h = XXH_P5;
+    }
+    h += ctx->total;
+
+    const unsigned char *p = ctx->memory;
+    size_t left = ctx->buffered;
+    for (; left >= 8; p += 8, left -= 8)
+    {
+        h ^= xxh64_round(0, xxh64_read64(p));
+        h = XXH_ROTL(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (left >= 4)
+    {
+        uint32_t word;
+        memcpy(&word, p, sizeof(word));
+        h ^= (uint64_t)word * XXH_P1;
+        h = XXH_ROTL(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; ++p, --left)
+    {
+        h ^= *p * XXH_P5;
+        h = XXH_ROTL(h, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+void format_hex(const unsigned char *bytes, size_t length, char *out)
+{
+    for (size_t i = 0; i < length; ++i)
+    {
+        sprintf(out + i * 2, "%02x", bytes[i]);
+    }
+}
+
+enum hash_chunk_state
+{
+    CHUNK_FILLING,
+    CHUNK_READY,
+    CHUNK_HASHING,
+    CHUNK_HASHED
+};
+
+/**
+ * @brief One manifest chunk of the image, buffered until both the per-chunk hash and the
+ * in-order whole-image hash have consumed it.
+ */
+struct hash_chunk
+{
+    uint64_t index;
+    size_t length;
+    size_t filled;
+    enum hash_chunk_state state;
+    char *data;
+    unsigned char sha256[32];
+    uint64_t xxh64;
+    struct hash_chunk *next;
+};
+
+/**
+ * @brief Inline hashing of everything a copy session moves.
+ *
+ * The engines copy each block into a chunk buffer (hasher_add) and keep going; a pool of
+ * hash_threads computes SHA-256 and XXH64 per chunk while one more thread feeds the chunks
+ * in order into the whole-image digests and writes the manifest. Copies only wait when
+ * max_chunks buffers are already queued, i.e. when hashing is the bottleneck.
+ */
+struct image_hasher
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct hash_chunk *chunks;
+    struct hash_chunk *free_chunks;
+    unsigned num_chunks;
+    unsigned max_chunks;
+    uint64_t chunk_size;
+    uint64_t end;
+    uint64_t next_index;
+    int finished;
+    int done;
+    pthread_t image_thread;
+    pthread_t *workers;
+    unsigned num_workers;
+    struct sha256_ctx image_sha256;
+    struct xxh64_ctx image_xxh64;
+    FILE *manifest;
+    char image_path[MAX_PATH];
+    double stall_seconds;
+};
+
+struct hash_chunk *hasher_find(struct image_hasher *hasher, uint64_t index)
+{
+    for (struct hash_chunk *chunk = hasher->chunks; chunk != NULL; chunk = chunk->next)
+    {
+        if (chunk->index == index)
+        {
+            return chunk;
+        }
+    }
+    return NULL;
+}
+
+uint64_t hasher_chunk_length(struct image_hasher *hasher, uint64_t index)
+{
+    uint64_t start = index * hasher->chunk_size;
+    return hasher->end - start < hasher->chunk_size ? hasher->end - start : hasher->chunk_size;
+}
+
+/**
+ * @brief Makes sure a queue of in-flight blocks spanning window bytes can never wait on a chunk
+ * that only it could complete (io_uring completes out of order within its queue).
+ */
+void hasher_reserve(struct image_hasher *hasher, uint64_t window)
+{
+    if (hasher == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&hasher->lock);
+    unsigned needed = (unsigned)(window / hasher->chunk_size) + 2;
+    if (needed > hasher->max_chunks)
+    {
+        hasher->max_chunks = needed;
+        pthread_cond_broadcast(&hasher->changed);
+    }
+    pthread_mutex_unlock(&hasher->lock);
+}
+
+/**
+ * @brief Hands a copied block to the hasher. Safe to call from several copy threads.
+ */
+void hasher_add(struct image_hasher *hasher, uint64_t offset, const void *data, size_t length)
+{
+    const char *p = data;
+    while (hasher != NULL && length > 0)
+    {
+        uint64_t index = offset / hasher->chunk_size;
+        size_t within = offset % hasher->chunk_size;
+        size_t take = hasher->chunk_size - within < length ? hasher->chunk_size - within : length;
+
+        pthread_mutex_lock(&hasher->lock);
+        struct hash_chunk *chunk = hasher_find(hasher, index);
+        if (chunk == NULL && index >= hasher->next_index + hasher->max_chunks)
+        {
+            double stall_start = monotonic_seconds();
+            while ((chunk = hasher_find(hasher, index)) == NULL && index >= hasher->next_index + hasher->max_chunks)
+            {
+                pthread_cond_wait(&hasher->changed, &hasher->lock);
+            }
+            hasher->stall_seconds += monotonic_seconds() - stall_start;
+        }
+        if (chunk == NULL)
+        {
+            chunk = hasher->free_chunks;
+            if (chunk != NULL)
+            {
+                hasher->free_chunks = chunk->next;
+            }
+            else
+            {
+                chunk = calloc(1, sizeof(*chunk));
+                if (chunk == NULL)
+                {
+                    perror("calloc");
+                    exit(EXIT_FAILURE);
+                }
+                chunk->data = allocate_io_buffer(hasher->chunk_size);
+            }
+            chunk->index = index;
+            chunk->length = hasher_chunk_length(hasher, index);
+            chunk->filled = 0;
+            chunk->state = CHUNK_FILLING;
+            chunk->next = hasher->chunks;
+            hasher->chunks = chunk;
+            hasher->num_chunks++;
+        }
+        pthread_mutex_unlock(&hasher->lock);
+
+        memcpy(chunk->data + within, p, take);
+
+        pthread_mutex_lock(&hasher->lock);
+        chunk->filled += take;
+        if (chunk->filled >= chunk->length)
+        {
+            chunk->state = CHUNK_READY;
+            pthread_cond_broadcast(&hasher->changed);
+        }
+        pthread_mutex_unlock(&hasher->lock);
+
+        offset += take;
+        p += take;
+        length -= take;
+    }
+}
+
+void *hasher_worker(void *arg)
+{
+    struct image_hasher *hasher = arg;
+    pthread_mutex_lock(&hasher->lock);
+    while (!hasher->done)
+    {
+        struct hash_chunk *chunk = hasher->chunks;
+        while (chunk != NULL && chunk->state != CHUNK_READY)
+        {
+            chunk = chunk->next;
+        }
+        if (chunk == NULL)
+        {
+            pthread_cond_wait(&hasher->changed, &hasher->lock);
+            continue;
+        }
+        chunk->state = CHUNK_HASHING;
+        pthread_mutex_unlock(&hasher->lock);
+
+        struct sha256_ctx sha;
+        struct xxh64_ctx xxh;
+        sha256_init(&sha);
+        sha256_update(&sha, chunk->data, chunk->length);
+        sha256_final(&sha, chunk->sha256);
+        xxh64_init(&xxh);
+        xxh64_update(&xxh, chunk->data, chunk->length);
+        chunk->xxh64 = xxh64_digest(&xxh);
+
+        pthread_mutex_lock(&hasher->lock);
+        chunk->state = CHUNK_HASHED;
+        pthread_cond_broadcast(&hasher->changed);
+    }
+    pthread_mutex_unlock(&hasher->lock);
+    return NULL;
+}
+
+/**
+ * @brief Consumes chunks strictly in order: whole-image digests first, then (once the pool has
+ * hashed it) the manifest line, then the buffer goes back to the free list.
+ */
+void *hasher_image_thread(void *arg)
+{
+    struct image_hasher *hasher = arg;
+    pthread_mutex_lock(&hasher->lock);
+    for (;;)
+    {
+        uint64_t index = hasher->next_index;
+        struct hash_chunk *chunk;
+        while ((chunk = hasher_find(hasher, index)) == NULL || chunk->state == CHUNK_FILLING)
+        {
+            if (hasher->finished && index * hasher->chunk_size >= hasher->end)
+            {
+                hasher->done = 1;
+                pthread_cond_broadcast(&hasher->changed);
+                pthread_mutex_unlock(&hasher->lock);
+                return NULL;
+            }
+            pthread_cond_wait(&hasher->changed, &hasher->lock);
+        }
+        pthread_mutex_unlock(&hasher->lock);
+
+        sha256_update(&hasher->image_sha256, chunk->data, chunk->length);
+        xxh64_update(&hasher->image_xxh64, chunk->data, chunk->length);
+
+        pthread_mutex_lock(&hasher->lock);
+        while (chunk->state != CHUNK_HASHED)
+        {
+            pthread_cond_wait(&hasher->changed, &hasher->lock);
+        }
+        char hex[65];
+        format_hex(chunk->sha256, 32, hex);
+        fprintf(hasher->manifest, "%llu %llu %zu %s %016llx\n", (unsigned long long)index, (unsigned long long)(index * hasher->chunk_size),
+                chunk->length, hex, (unsigned long long)chunk->xxh64);
+
+        struct hash_chunk **link = &hasher->chunks;
+        while (*link != chunk)
+        {
+            link = &(*link)->next;
+        }
+        *link = chunk->next;
+        chunk->next = hasher->free_chunks;
+        hasher->free_chunks = chunk;
+        hasher->num_chunks--;
+        hasher->next_index++;
+        pthread_cond_broadcast(&hasher->changed);
+    }
+}
+
+/**
+ * @brief Starts hashing a copy of expected_bytes into image_path; the manifest goes to
+ * <image>.hashes while the copy runs.
+ */
+struct image_hasher *start_image_hasher(const char *image_path, uint64_t expected_bytes)
+{
+    struct image_hasher *hasher = calloc(1, sizeof(*hasher));
+    if (hasher == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&hasher->lock, NULL);
+    pthread_cond_init(&hasher->changed, NULL);
+    hasher->chunk_size = chunk_size_bytes;
+    hasher->end = expected_bytes;
+    hasher->num_workers = hash_threads;
+    hasher->max_chunks = hash_threads + 2;
+    if (copy_engine == ENGINE_STRIPED)
+    {
+        hasher->max_chunks += copy_threads;
+    }
+    snprintf(hasher->image_path, sizeof(hasher->image_path), "%s", image_path);
+    sha256_init(&hasher->image_sha256);
+    xxh64_init(&hasher->image_xxh64);
+
+    char manifest_path[MAX_PATH + 8];
+    snprintf(manifest_path, sizeof(manifest_path), "%s.hashes", image_path);
+    hasher->manifest = fopen(manifest_path, "w");
+    if (hasher->manifest == NULL)
+    {
+        fprintf(stderr, "Error: Could not create %s: %s\n", manifest_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    char image_name[MAX_PATH];
+    snprintf(image_name, sizeof(image_name), "%s", image_path);
+    fprintf(hasher->manifest, "# dddarth hash manifest\n# image: %s\n# chunk_size: %llu\n# chunk offset length sha256 xxh64\n", basename(image_name),
+            (unsigned long long)hasher->chunk_size);
+
+    hasher->workers = calloc(hasher->num_workers, sizeof(pthread_t));
+    if (hasher->workers == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < hasher->num_workers; ++i)
+    {
+        if (pthread_create(&hasher->workers[i], NULL, hasher_worker, hasher) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (pthread_create(&hasher->image_thread, NULL, hasher_image_thread, hasher) != 0)
+    {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    return hasher;
+}
+
+/**
+ * @brief Tells the hasher the copy ended after copied_bytes, waits for the remaining chunks and
+ * writes the whole-image SHA-256 (also as <image>.sha256 for sha256sum -c) and XXH64.
+ */
+void finish_image_hasher(struct image_hasher *hasher, uint64_t copied_bytes)
+{
+    pthread_mutex_lock(&hasher->lock);
+    hasher->end = copied_bytes;
+    hasher->finished = 1;
+    // A source that ended early leaves a short last chunk.
+    for (struct hash_chunk *chunk = hasher->chunks; chunk != NULL; chunk = chunk->next)
+    {
+        if (chunk->state == CHUNK_FILLING && chunk->filled >= hasher_chunk_length(hasher, chunk->index))
+        {
+            chunk->length = chunk->filled;
+            chunk->state = CHUNK_READY;
+        }
+    }
+    pthread_cond_broadcast(&hasher->changed);
+    pthread_mutex_unlock(&hasher->lock);
+
+    pthread_join(hasher->image_thread, NULL);
+    for (unsigned i = 0; i < hasher->num_workers; ++i)
+    {
+        pthread_join(hasher->workers[i], NULL);
+    }
+
+    unsigned char digest[32];
+    char sha256_hex[65];
+    sha256_final(&hasher->image_sha256, digest);
+    format_hex(digest, sizeof(digest), sha256_hex);
+    uint64_t xxh64 = xxh64_digest(&hasher->image_xxh64);
+    fprintf(hasher->manifest, "# bytes: %llu\n# sha256: %s\n# xxh64: %016llx\n", (unsigned long long)copied_bytes, sha256_hex, (unsigned long long)xxh64);
+    fclose(hasher->manifest);
+
+    char image_name[MAX_PATH];
+    char sum_path[MAX_PATH + 8];
+    snprintf(image_name, sizeof(image_name), "%s", hasher->image_path);
+    snprintf(sum_path, sizeof(sum_path), "%s.sha256", hasher->image_path);
+    FILE *sum = fopen(sum_path, "w");
+    if (sum != NULL)
+    {
+        fprintf(sum, "%s  %s\n", sha256_hex, basename(image_name));
+        fclose(sum);
+    }
+
+    print_colored("\033[1;35m", "SHA-256 (%s): %s\n", sha256_kernel, sha256_hex);
+    print_colored("\033[1;35m", "XXH64: %016llx\n", (unsigned long long)xxh64);
+    print_colored("\033[1;35m", "Chunk manifest: %s.hashes, copy waited %.2f s on hashing\n", hasher->image_path, hasher->stall_seconds);
+
+    while (hasher->free_chunks != NULL)
+    {
+        struct hash_chunk *chunk = hasher->free_chunks;
+        hasher->free_chunks = chunk->next;
+        free(chunk->data);
+        free(chunk);
+    }
+    pthread_mutex_destroy(&hasher->lock);
+    pthread_cond_destroy(&hasher->changed);
+    free(hasher->workers);
+    free(hasher);
+}
+
+/**
+ * @brief Hashes everything the session copies from now on.
+ */
+void attach_image_hasher(struct copy_session *session, uint64_t expected_bytes)
+{
+    if (copy_engine == ENGINE_ZEROCOPY)
+    {
+        print_colored("\033[1;33m", "Warning: hashing has to look at the data, using the native engine instead of zerocopy.\n");
+    }
+    session->hasher = start_image_hasher(session->target_path, expected_bytes);
+}
+
+void open_copy_session(struct copy_session *session, const char *source_path, const char *target_path, size_t block_size, int truncate_target)
+{
+    memset(session, 0, sizeof(*session));
+    double start = monotonic_seconds();
+    session->source_path = source_path;
+    session->target_path = target_path;
+    session->block_size = block_size;
+    session->queue_depth = queue_depth;
+    session->source_fd = open_for_copy(source_path, O_RDONLY, 0);
+    session->target_fd = open_for_copy(target_path, O_WRONLY | O_CREAT | (truncate_target ? O_TRUNC : 0), 0666);
+    session->source_size = get_device_size(session->source_fd);
+    if (sparse_output)
+    {
+        // Holes only exist in regular files; a block device target gets every zero written.
+        struct stat st;
+        session->sparse = fstat(session->target_fd, &st) == 0 && S_ISREG(st.st_mode);
+        if (!session->sparse)
+        {
+            print_colored("\033[1;33m", "Warning: %s is not a regular file, writing zero blocks.\n", target_path);
+        }
+        else if (copy_engine == ENGINE_ZEROCOPY)
+        {
+            print_colored("\033[1;33m", "Warning: sparse mode has to look at the data, using the native engine instead of zerocopy.\n");
+        }
+    }
+    session->last_progress = monotonic_seconds();
+    session->stats.open_seconds = session->last_progress - start;
+}
+
+/**
+ * @brief Gives a sparse image its full size when it ends in skipped zero blocks.
+ */
+void finish_sparse_target(struct copy_session *session, uint64_t end)
+{
+    struct stat st;
+    if (session->sparse && fstat(session->target_fd, &st) == 0 && (uint64_t)st.st_size < end && ftruncate(session->target_fd, end) != 0)
+    {
+        fprintf(stderr, "Error: Could not extend %s to %llu bytes: %s\n", session->target_path, (unsigned long long)end, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Waits until everything written to the target is on stable storage and records how long it took.
+ */
+void flush_copy_session(struct copy_session *session)
+{
+    double start = monotonic_seconds();
+    if (fdatasync(session->target_fd) != 0 && errno != EINVAL)
+    {
+        fprintf(stderr, "Error: fdatasync on %s failed: %s\n", session->target_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    session->stats.flush_seconds += monotonic_seconds() - start;
+    if (page_cache_control)
+    {
+        posix_fadvise(session->target_fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+}
+
+double buffered_rate(const struct copy_stats *stats)
+{
+    return stats->elapsed_seconds > 0 ? stats->bytes_copied / stats->elapsed_seconds / 1e6 : 0;
+}
+
+double durable_rate(const struct copy_stats *stats)
+{
+    double seconds = stats->elapsed_seconds + stats->flush_seconds;
+    return seconds > 0 ? stats->bytes_copied / seconds / 1e6 : 0;
+}
+
+/**
+ * @brief Range of the copy whose page cache has not been released yet, plus the window before
+ * it whose writeback was started but not yet waited for.
+ */
+struct cache_window
+{
+    uint64_t start;
+    uint64_t end;
+    uint64_t written_start;
+    uint64_t written_end;
+};
+
+/**
+ * @brief Drops the source pages of the current window, starts writeback of its target pages,
+ * then waits for the previous window's writeback and drops those target pages.
+ *
+ * Lagging one window behind keeps the device busy while bounding the dirty/cached footprint of
+ * a copy to about two windows. Engines may complete out of order; pages that miss a window are
+ * simply released by the final fdatasync in flush_copy_session().
+ */
+void cache_window_flush(struct copy_session *session, struct cache_window *window)
+{
+    if (window->end <= window->start)
+    {
+        return;
+    }
+    posix_fadvise(session->source_fd, window->start, window->end - window->start, POSIX_FADV_DONTNEED);
+    sync_file_range(session->target_fd, window->start, window->end - window->start, SYNC_FILE_RANGE_WRITE);
+    if (window->written_end > window->written_start)
+    {
+        sync_file_range(session->target_fd, window->written_start, window->written_end - window->written_start,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(session->target_fd, window->written_start, window->written_end - window->written_start, POSIX_FADV_DONTNEED);
+    }
+    window->written_start = window->start;
+    window->written_end = window->end;
+    window->start = window->end;
+}
+
+/**
+ * @brief Records that [offset, offset + length) was copied and releases its page cache once a
+ * whole PAGE_CACHE_WINDOW has accumulated. A jump to an unrelated offset closes the window.
+ */
+void release_page_cache(struct copy_session *session, struct cache_window *window, uint64_t offset, uint64_t length)
+{
+    if (!page_cache_control)
+    {
+        return;
+    }
+    if (window->end > window->start && (offset + length < window->start || offset > window->end + PAGE_CACHE_WINDOW))
+    {
+        cache_window_flush(session, window);
+    }
+    if (window->end <= window->start)
+    {
+        window->start = window->end = offset;
+    }
+    if (offset + length > window->end)
+    {
+        window->end = offset + length;
+    }
+    if (window->end - window->start >= PAGE_CACHE_WINDOW)
+    {
+        cache_window_flush(session, window);
+    }
+}
+
+void finish_page_cache(struct copy_session *session, struct cache_window *window)
+{
+    if (page_cache_control)
+    {
+        cache_window_flush(session, window);
+    }
+}
+
+void close_copy_session(struct copy_session *session)
+{
+    close(session->source_fd);
+    if (close(session->target_fd) != 0)
+    {
+        perror("close");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void report_copy_progress(struct copy_session *session, double start, int final)
+{
+    double now = monotonic_seconds();
+    if (!session->show_progress || (!final && now - session->last_progress < 1.0))
+    {
+        return;
+    }
+    session->last_progress = now;
+
+    double elapsed = now - start;
+    double rate = elapsed > 0 ? session->stats.bytes_copied / elapsed / 1e6 : 0;
+    fprintf(stderr, "\r%llu bytes (%.1f MB) copied, %.0f s, %.1f MB/s%s",
+            (unsigned long long)session->stats.bytes_copied, session->stats.bytes_copied / 1e6, elapsed, rate,
+            final ? "\n" : "");
+}
+
+/**
+ * @brief Log-linear latency histogram in nanoseconds (HDR style): values below 32 ns get their
+ * own bucket and every power of two above is split into 16 buckets, so any percentile is off by
+ * at most 1/16 of its value. Recording is a few relaxed atomics, cheap next to one I/O request,
+ * so the worker threads of one copy can share a histogram.
+ */
+struct latency_histogram
+{
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+};
+
+struct throughput_sample
+{
+    double seconds;
+    uint64_t bytes;
+};
+
+/**
+ * @brief Per-request read/write latency and throughput over fixed windows of one copy.
+ *
+ * A sampler thread reads the session's byte counter every window_seconds, so the copy loops
+ * only pay for the histograms and a few relaxed counters the live exporter reads.
+ */
+struct io_metrics
+{
+    struct latency_histogram read;
+    struct latency_histogram write;
+    struct copy_session *session;
+    double start;
+    double window_seconds;
+    struct throughput_sample *samples;
+    size_t num_samples;
+    size_t sample_capacity;
+    int stop;
+    pthread_t sampler;
+    uint64_t expected_bytes;
+    unsigned queue_occupancy;
+    unsigned queue_limit;
+    uint64_t io_errors;
+    uint64_t retries;
+};
+
+unsigned latency_bucket(uint64_t ns)
+{
+    if (ns < (2u << LATENCY_SUB_BITS))
+    {
+        return (unsigned)ns;
+    }
+    unsigned shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+    return (shift << LATENCY_SUB_BITS) + (unsigned)(ns >> shift);
+}
+
+uint64_t latency_bucket_upper(unsigned bucket)
+{
+    if (bucket < (2u << LATENCY_SUB_BITS))
+    {
+        return bucket;
+    }
+    unsigned shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    uint64_t mantissa = bucket - ((uint64_t)shift << LATENCY_SUB_BITS);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void latency_record(struct latency_histogram *histogram, double start, double end)
+{
+    uint64_t ns = end > start ? (uint64_t)((end - start) * 1e9) : 0;
+    __atomic_fetch_add(&histogram->counts[latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total_ns, ns, __ATOMIC_RELAXED);
+    uint64_t seen = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (ns > seen && !__atomic_compare_exchange_n(&histogram->max_ns, &seen, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+    seen = __atomic_load_n(&histogram->min_ns, __ATOMIC_RELAXED);
+    while (ns < seen && !__atomic_compare_exchange_n(&histogram->min_ns, &seen, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+/**
+ * @brief Latency in microseconds below which the given fraction of requests completed (upper
+ * bucket bound, capped at the exact maximum).
+ */
+double latency_percentile(const struct latency_histogram *histogram, double fraction)
+{
+    if (histogram->count == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)ceil(fraction * histogram->count);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < LATENCY_BUCKETS; ++i)
+    {
+        seen += histogram->counts[i];
+        if (seen >= rank && seen > 0)
+        {
+            uint64_t upper = latency_bucket_upper(i);
+            return (upper < histogram->max_ns ? upper : histogram->max_ns) / 1e3;
+        }
+    }
+    return histogram->max_ns / 1e3;
+}
+
+/**
+ * @brief Records one read or write request of the session if it is instrumented.
+ */
+void record_latency(struct copy_session *session, int write, double start, double end)
+{
+    if (session->metrics != NULL)
+    {
+        latency_record(write ? &session->metrics->write : &session->metrics->read, start, end);
+    }
+}
+
+void add_throughput_sample(struct io_metrics *metrics)
+{
+    if (metrics->num_samples == metrics->sample_capacity)
+    {
+        metrics->sample_capacity = metrics->sample_capacity ? metrics->sample_capacity * 2 : 256;
+        metrics->samples = realloc(metrics->samples, metrics->sample_capacity * sizeof(*metrics->samples));
+        if (metrics->samples == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct throughput_sample *sample = &metrics->samples[metrics->num_samples++];
+    sample->seconds = monotonic_seconds() - metrics->start;
+    sample->bytes = __atomic_load_n(&metrics->session->stats.bytes_copied, __ATOMIC_RELAXED);
+}
+
+void *throughput_sampler(void *arg)
+{
+    struct io_metrics *metrics = arg;
+    for (size_t window = 1; !__atomic_load_n(&metrics->stop, __ATOMIC_ACQUIRE); ++window)
+    {
+        // Sleep towards absolute window ends so the windows do not drift.
+        double wait = metrics->start + window * metrics->window_seconds - monotonic_seconds();
+        while (wait > 0 && !__atomic_load_n(&metrics->stop, __ATOMIC_ACQUIRE))
+        {
+            usleep(wait > 0.05 ? 50000 : (useconds_t)(wait * 1e6));
+            wait = metrics->start + window * metrics->window_seconds - monotonic_seconds();
+        }
+        if (wait <= 0)
+        {
+            add_throughput_sample(metrics);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Process-wide --max-rate/--max-iops limiter: one GCRA virtual clock per limit, so a
+ * thread reserves its slot with a CAS and sleeps outside any lock.
+ *
+ * Requests may run up to THROTTLE_BURST_NS ahead of the schedule, which smooths the limit over
+ * 100 ms instead of spacing out every request. With --latency-target the byte rate follows the
+ * p99 read latency of each THROTTLE_ADJUST_SECONDS interval: 30% lower when it is above the
+ * target, 10% higher when it is below.
+ */
+struct rate_limiter
+{
+    uint64_t byte_clock_ns;
+    uint64_t op_clock_ns;
+    uint64_t bytes_per_second; // current limit, 0 = unlimited
+    uint64_t throttled_ns;
+    unsigned backoffs;
+    pthread_mutex_t adjust_lock;
+    uint64_t next_adjust_ns;
+    double seen_start;
+    uint64_t seen_reads[LATENCY_BUCKETS];
+} throttle = {.adjust_lock = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * @brief What the live metrics exporter last published. It is refreshed from the running copy
+ * once per metrics_interval_seconds and kept after the copy ends, so the final state stays
+ * visible.
+ */
+struct metrics_snapshot
+{
+    char source[MAX_PATH];
+    char target[MAX_PATH];
+    char engine[16];
+    int active;
+    uint64_t bytes_copied;
+    uint64_t bytes_expected;
+    double elapsed_seconds;
+    double current_rate;
+    double average_rate;
+    uint64_t reads;
+    uint64_t writes;
+    double read_seconds;
+    double write_seconds;
+    unsigned queue_occupancy;
+    unsigned queue_limit;
+    uint64_t io_errors;
+    uint64_t retries;
+    double throttled_seconds;
+    uint64_t rate_limit;
+};
+
+/**
+ * @brief Exporter thread state. The lock only guards the live pointer and the snapshot; the
+ * copy loops never take it and only touch the relaxed counters in struct io_metrics.
+ */
+struct metrics_exporter
+{
+    pthread_mutex_t lock;
+    struct io_metrics *live;
+    struct metrics_snapshot snapshot;
+    double last_sample_seconds;
+    uint64_t last_sample_bytes;
+    int listen_fd;
+    int started;
+    pthread_t thread;
+} exporter = {.lock = PTHREAD_MUTEX_INITIALIZER, .listen_fd = -1};
+
+void set_queue_occupancy(struct copy_session *session, unsigned occupancy)
+{
+    if (session->metrics != NULL)
+    {
+        __atomic_store_n(&session->metrics->queue_occupancy, occupancy, __ATOMIC_RELAXED);
+    }
+}
+
+void count_io_error(struct copy_session *session)
+{
+    if (session->metrics != NULL)
+    {
+        __atomic_fetch_add(&session->metrics->io_errors, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void count_io_retry(struct copy_session *session)
+{
+    if (session->metrics != NULL)
+    {
+        __atomic_fetch_add(&session->metrics->retries, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Refreshes the snapshot from the live copy. Called with exporter.lock held.
+ */
+void refresh_metrics_snapshot()
+{
+    struct io_metrics *metrics = exporter.live;
+    struct metrics_snapshot *snapshot = &exporter.snapshot;
+    if (metrics == NULL)
+    {
+        snapshot->active = 0;
+        snapshot->current_rate = 0;
+        return;
+    }
+    double now = monotonic_seconds();
+    uint64_t bytes = __atomic_load_n(&metrics->session->stats.bytes_copied, __ATOMIC_RELAXED);
+    if (!snapshot->active)
+    {
+        exporter.last_sample_seconds = metrics->start;
+        exporter.last_sample_bytes = 0;
+    }
+    snapshot->active = 1;
+    snprintf(snapshot->source, sizeof(snapshot->source), "%s", metrics->session->source_path);
+    snprintf(snapshot->target, sizeof(snapshot->target), "%s", metrics->session->target_path);
+    snprintf(snapshot->engine, sizeof(snapshot->engine), "%s", copy_engine_names[copy_engine]);
+    snapshot->bytes_copied = bytes;
+    snapshot->bytes_expected = metrics->expected_bytes;
+    snapshot->elapsed_seconds = now - metrics->start;
+    snapshot->average_rate = snapshot->elapsed_seconds > 0 ? bytes / snapshot->elapsed_seconds : 0;
+    if (now - exporter.last_sample_seconds >= 0.5 * metrics_interval_seconds)
+    {
+        snapshot->current_rate = (bytes - exporter.last_sample_bytes) / (now - exporter.last_sample_seconds);
+        exporter.last_sample_seconds = now;
+        exporter.last_sample_bytes = bytes;
+    }
+    snapshot->reads = __atomic_load_n(&metrics->read.count, __ATOMIC_RELAXED);
+    snapshot->writes = __atomic_load_n(&metrics->write.count, __ATOMIC_RELAXED);
+    snapshot->read_seconds = __atomic_load_n(&metrics->read.total_ns, __ATOMIC_RELAXED) / 1e9;
+    snapshot->write_seconds = __atomic_load_n(&metrics->write.total_ns, __ATOMIC_RELAXED) / 1e9;
+    snapshot->queue_occupancy = __atomic_load_n(&metrics->queue_occupancy, __ATOMIC_RELAXED);
+    snapshot->queue_limit = metrics->queue_limit;
+    snapshot->io_errors = __atomic_load_n(&metrics->io_errors, __ATOMIC_RELAXED);
+    snapshot->retries = __atomic_load_n(&metrics->retries, __ATOMIC_RELAXED);
+    snapshot->throttled_seconds = __atomic_load_n(&throttle.throttled_ns, __ATOMIC_RELAXED) / 1e9;
+    snapshot->rate_limit = __atomic_load_n(&throttle.bytes_per_second, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Copies a label value with the escapes the Prometheus text format requires.
+ *
+ * A value that might not fit once escaped keeps its tail (the image or device name) behind
+ * "...", so the label is always complete and valid UTF-8.
+ */
+void escape_label_value(const char *value, char *buffer, size_t buffer_size)
+{
+    size_t len = 0;
+    size_t keep = (buffer_size - 4) / 2;
+    if (strlen(value) > keep)
+    {
+        value += strlen(value) - keep;
+        while ((*value & 0xC0) == 0x80)
+        {
+            ++value;
+        }
+        len = snprintf(buffer, buffer_size, "...");
+    }
+    for (; *value != '\0' && len + 3 < buffer_size; ++value)
+    {
+        if (*value == '\\' || *value == '"' || *value == '\n')
+        {
+            buffer[len++] = '\\';
+            buffer[len++] = *value == '\n' ? 'n' : *value;
+        }
+        else
+        {
+            buffer[len++] = *value;
+        }
+    }
+    buffer[len] = '\0';
+}
+
+/**
+ * @brief Renders the snapshot in the Prometheus text exposition format. Called with exporter.lock held.
+ */
+size_t format_metrics(char *text, size_t text_size)
+{
+    const struct metrics_snapshot *s = &exporter.snapshot;
+    // Capped so that the labels of all 17 samples fit in METRICS_TEXT_SIZE.
+    char source[METRICS_LABEL_SIZE];
+    char target[METRICS_LABEL_SIZE];
+    escape_label_value(s->source, source, sizeof(source));
+    escape_label_value(s->target, target, sizeof(target));
+    char labels[METRICS_LABEL_SIZE * 2 + 64];
+    snprintf(labels, sizeof(labels), "source=\"%s\",target=\"%s\",engine=\"%s\"", source, target, s->engine);
+    double eta = s->active && s->bytes_expected > s->bytes_copied && s->average_rate > 0
+                     ? (s->bytes_expected - s->bytes_copied) / (s->current_rate > 0 ? s->current_rate : s->average_rate)
+                     : 0;
+
+    text[0] = '\0';
+    append_command(text, text_size, "# HELP dddarth_copy_active 1 while a copy is running, 0 once it finished.\n# TYPE dddarth_copy_active gauge\n");
+    append_command(text, text_size, "dddarth_copy_active{%s} %d\n", labels, s->active);
+    append_command(text, text_size, "# HELP dddarth_bytes_copied_total Bytes copied so far.\n# TYPE dddarth_bytes_copied_total counter\n");
+    append_command(text, text_size, "dddarth_bytes_copied_total{%s} %llu\n", labels, (unsigned long long)s->bytes_copied);
+    append_command(text, text_size, "# HELP dddarth_bytes_expected Bytes the copy will have copied when done.\n# TYPE dddarth_bytes_expected gauge\n");
+    append_command(text, text_size, "dddarth_bytes_expected{%s} %llu\n", labels, (unsigned long long)s->bytes_expected);
+    append_command(text, text_size, "# HELP dddarth_elapsed_seconds Time since the copy started.\n# TYPE dddarth_elapsed_seconds gauge\n");
+    append_command(text, text_size, "dddarth_elapsed_seconds{%s} %.3f\n", labels, s->elapsed_seconds);
+    append_command(text, text_size, "# HELP dddarth_rate_bytes_per_second Throughput over the last update interval (current) and since the start (average).\n"
+                                    "# TYPE dddarth_rate_bytes_per_second gauge\n");
+    append_command(text, text_size, "dddarth_rate_bytes_per_second{%s,window=\"current\"} %.0f\n", labels, s->current_rate);
+    append_command(text, text_size, "dddarth_rate_bytes_per_second{%s,window=\"average\"} %.0f\n", labels, s->average_rate);
+    append_command(text, text_size, "# HELP dddarth_eta_seconds Estimated time to completion at the current rate.\n# TYPE dddarth_eta_seconds gauge\n");
+    append_command(text, text_size, "dddarth_eta_seconds{%s} %.0f\n", labels, eta);
+    append_command(text, text_size, "# HELP dddarth_requests_total Read and write requests issued.\n# TYPE dddarth_requests_total counter\n");
+    append_command(text, text_size, "dddarth_requests_total{%s,op=\"read\"} %llu\n", labels, (unsigned long long)s->reads);
+    append_command(text, text_size, "dddarth_requests_total{%s,op=\"write\"} %llu\n", labels, (unsigned long long)s->writes);
+    append_command(text, text_size, "# HELP dddarth_request_seconds_total Time spent in read and write requests.\n# TYPE dddarth_request_seconds_total counter\n");
+    append_command(text, text_size, "dddarth_request_seconds_total{%s,op=\"read\"} %.6f\n", labels, s->read_seconds);
+    append_command(text, text_size, "dddarth_request_seconds_total{%s,op=\"write\"} %.6f\n", labels, s->write_seconds);
+    append_command(text, text_size, "# HELP dddarth_queue_occupancy Requests in flight (uring), filled ring buffers (pipeline) or busy workers (striped).\n"
+                                    "# TYPE dddarth_queue_occupancy gauge\n");
+    append_command(text, text_size, "dddarth_queue_occupancy{%s} %u\n", labels, s->queue_occupancy);
+    append_command(text, text_size, "# HELP dddarth_queue_limit Configured queue depth, ring size or worker count.\n# TYPE dddarth_queue_limit gauge\n");
+    append_command(text, text_size, "dddarth_queue_limit{%s} %u\n", labels, s->queue_limit);
+    append_command(text, text_size, "# HELP dddarth_errors_total Failed requests (io) and requests that had to be reissued (retry).\n# TYPE dddarth_errors_total counter\n");
+    append_command(text, text_size, "dddarth_errors_total{%s,kind=\"io\"} %llu\n", labels, (unsigned long long)s->io_errors);
+    append_command(text, text_size, "dddarth_errors_total{%s,kind=\"retry\"} %llu\n", labels, (unsigned long long)s->retries);
+    append_command(text, text_size, "# HELP dddarth_throttled_seconds_total Time requests waited for the rate limiter.\n# TYPE dddarth_throttled_seconds_total counter\n");
+    append_command(text, text_size, "dddarth_throttled_seconds_total{%s} %.3f\n", labels, s->throttled_seconds);
+    append_command(text, text_size, "# HELP dddarth_rate_limit_bytes_per_second Current byte rate limit, 0 when unlimited.\n# TYPE dddarth_rate_limit_bytes_per_second gauge\n");
+    append_command(text, text_size, "dddarth_rate_limit_bytes_per_second{%s} %llu\n", labels, (unsigned long long)s->rate_limit);
+    return strlen(text);
+}
+
+/**
+ * @brief Replaces the textfile in one rename so the node_exporter textfile collector never
+ * reads half a file. Called with exporter.lock held.
+ */
+void write_metrics_file(const char *text)
+{
+    char temp_path[MAX_PATH];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", metrics_file);
+    FILE *file = fopen(temp_path, "w");
+    if (file == NULL)
+    {
+        return;
+    }
+    fputs(text, file);
+    if (fclose(file) != 0 || rename(temp_path, metrics_file) != 0)
+    {
+        unlink(temp_path);
+    }
+}
+
+/**
+ * @brief Refreshes the snapshot and rewrites the textfile now, e.g. when a copy ends or fails.
+ */
+void publish_metrics()
+{
+    if (!exporter.started)
+    {
+        return;
+    }
+    static char text[METRICS_TEXT_SIZE];
+    pthread_mutex_lock(&exporter.lock);
+    refresh_metrics_snapshot();
+    if (metrics_file != NULL)
+    {
+        format_metrics(text, sizeof(text));
+        write_metrics_file(text);
+    }
+    pthread_mutex_unlock(&exporter.lock);
+}
+
+/**
+ * @brief Rewrites the textfile every metrics_interval_seconds and answers every connection to
+ * the Unix socket with the current metrics, then closes it.
+ */
+void *metrics_exporter_thread(void *arg)
+{
+    (void)arg;
+    char text[METRICS_TEXT_SIZE];
+    double next = monotonic_seconds();
+    for (;;)
+    {
+        double wait = next - monotonic_seconds();
+        struct pollfd pfd = {exporter.listen_fd, POLLIN, 0};
+        int ready = poll(&pfd, exporter.listen_fd >= 0 ? 1 : 0, wait > 0 ? (int)(wait * 1000) + 1 : 0);
+        int refresh = monotonic_seconds() >= next;
+        if (!refresh && ready <= 0)
+        {
+            continue;
+        }
+
+        pthread_mutex_lock(&exporter.lock);
+        refresh_metrics_snapshot();
+        size_t len = format_metrics(text, sizeof(text));
+        if (refresh && metrics_file != NULL)
+        {
+            write_metrics_file(text);
+        }
+        pthread_mutex_unlock(&exporter.lock);
+        if (refresh)
+        {
+            next += metrics_interval_seconds;
+        }
+
+        if (ready > 0 && (pfd.revents & POLLIN))
+        {
+            int client = accept4(exporter.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (client >= 0)
+            {
+                // The query client only reads, so a short timeout keeps a stuck one from blocking updates.
+                struct timeval timeout = {1, 0};
+                setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                for (size_t sent = 0; sent < len;)
+                {
+                    ssize_t n = send(client, text + sent, len - sent, MSG_NOSIGNAL);
+                    if (n <= 0)
+                    {
+                        break;
+                    }
+                    sent += n;
+                }
+                close(client);
+            }
+        }
+    }
+    return NULL;
+}
+
+void remove_metrics_socket()
+{
+    unlink(metrics_socket);
+}
+
+/**
+ * @brief Starts the exporter thread the first time a copy is instrumented with --metrics-file or
+ * --metrics-socket given.
+ */
+void start_metrics_exporter()
+{
+    if (exporter.started || (metrics_file == NULL && metrics_socket == NULL))
+    {
+        return;
+    }
+    if (metrics_socket != NULL)
+    {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (strlen(metrics_socket) >= sizeof(address.sun_path))
+        {
+            fprintf(stderr, "Error: Metrics socket path %s is too long\n", metrics_socket);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(address.sun_path, metrics_socket);
+        exporter.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(metrics_socket);
+        if (exporter.listen_fd < 0 || bind(exporter.listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(exporter.listen_fd, 8) != 0)
+        {
+            fprintf(stderr, "Error: Cannot listen on %s: %s\n", metrics_socket, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        atexit(remove_metrics_socket);
+    }
+    exporter.started = 1;
+    if (pthread_create(&exporter.thread, NULL, metrics_exporter_thread, NULL) != 0)
+    {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(exporter.thread);
+    print_colored("\033[1;34m", "Exporting live metrics%s%s%s%s\n", metrics_file ? " to " : "", metrics_file ? metrics_file : "",
+                  metrics_socket ? " on " : "", metrics_socket ? metrics_socket : "");
+}
+
+/**
+ * @brief Prints the metrics a running dddarth exports on its Unix socket (--metrics-query).
+ */
+void query_metrics(const char *socket_path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        fprintf(stderr, "Error: Cannot connect to %s: %s\n", socket_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        fwrite(buffer, 1, n, stdout);
+    }
+    close(fd);
+}
+
+/**
+ * @brief Instruments a session: every request it issues lands in the latency histograms and its
+ * byte counter is sampled every stats_window_seconds until stop_io_metrics().
+ */
+struct io_metrics *start_io_metrics(struct copy_session *session)
+{
+    struct io_metrics *metrics = calloc(1, sizeof(*metrics));
+    if (metrics == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    metrics->read.min_ns = UINT64_MAX;
+    metrics->write.min_ns = UINT64_MAX;
+    metrics->session = session;
+    metrics->window_seconds = stats_window_seconds;
+    metrics->start = monotonic_seconds();
+    metrics->expected_bytes = session->source_size;
+    metrics->queue_occupancy = 1;
+    metrics->queue_limit = engine_uses_queue_depth(copy_engine) ? session->queue_depth : copy_engine == ENGINE_STRIPED ? copy_threads : 1;
+    session->metrics = metrics;
+    throttle.throttled_ns = 0;
+    throttle.backoffs = 0;
+    if (pthread_create(&metrics->sampler, NULL, throughput_sampler, metrics) != 0)
+    {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&exporter.lock);
+    exporter.live = metrics;
+    pthread_mutex_unlock(&exporter.lock);
+    start_metrics_exporter();
+    return metrics;
+}
+
+/**
+ * @brief Stops the sampler, records the final partial window and detaches the metrics, which
+ * become last_io_metrics for the result writers.
+ */
+void stop_io_metrics(struct io_metrics *metrics)
+{
+    __atomic_store_n(&metrics->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(metrics->sampler, NULL);
+    add_throughput_sample(metrics);
+    // Publish the final counters before the exporter lets go of the session.
+    pthread_mutex_lock(&exporter.lock);
+    refresh_metrics_snapshot();
+    exporter.live = NULL;
+    pthread_mutex_unlock(&exporter.lock);
+    publish_metrics();
+    metrics->session->metrics = NULL;
+    metrics->session = NULL;
+    if (last_io_metrics != NULL)
+    {
+        free(last_io_metrics->samples);
+        free(last_io_metrics);
+    }
+    last_io_metrics = metrics;
+}
+
+int compare_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Number of full throughput windows below half the median window: the copy stalled or
+ * the device throttled there.
+ */
+size_t count_slow_windows(const struct io_metrics *metrics)
+{
+    if (metrics->num_samples < 3)
+    {
+        return 0;
+    }
+    size_t num_windows = metrics->num_samples - 1; // the last sample closes a partial window
+    uint64_t *deltas = malloc(num_windows * sizeof(*deltas));
+    if (deltas == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t previous = 0;
+    for (size_t i = 0; i < num_windows; ++i)
+    {
+        deltas[i] = metrics->samples[i].bytes - previous;
+        previous = metrics->samples[i].bytes;
+    }
+    uint64_t *sorted = malloc(num_windows * sizeof(*sorted));
+    if (sorted == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(sorted, deltas, num_windows * sizeof(*sorted));
+    qsort(sorted, num_windows, sizeof(*sorted), compare_uint64);
+    uint64_t median = sorted[num_windows / 2];
+    size_t slow = 0;
+    for (size_t i = 0; i < num_windows; ++i)
+    {
+        slow += deltas[i] < median / 2;
+    }
+    free(sorted);
+    free(deltas);
+    return slow;
+}
+
+void print_latency_summary(const struct io_metrics *metrics)
+{
+    const struct latency_histogram *histograms[] = {&metrics->read, &metrics->write};
+    const char *names[] = {"read", "write"};
+    for (int i = 0; i < 2; ++i)
+    {
+        const struct latency_histogram *h = histograms[i];
+        if (h->count > 0)
+        {
+            print_colored("\033[1;37m", "  %s latency: p50 %.0f us, p99 %.0f us, p99.9 %.0f us, max %.0f us over %llu requests\n", names[i],
+                          latency_percentile(h, 0.5), latency_percentile(h, 0.99), latency_percentile(h, 0.999), h->max_ns / 1e3,
+                          (unsigned long long)h->count);
+        }
+    }
+    size_t slow = count_slow_windows(metrics);
+    if (slow > 0)
+    {
+        print_colored("\033[1;33m", "  %zu of %zu %.1f s windows ran below half the median throughput\n", slow, metrics->num_samples - 1,
+                      metrics->window_seconds);
+    }
+}
+
+void write_latency_json(FILE *json, const char *name, const struct latency_histogram *h, int last)
+{
+    fprintf(json, "    \"%s\": {\"count\": %llu, \"mean\": %.1f, \"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99_9\": %.1f, \"max\": %.1f}%s\n",
+            name, (unsigned long long)h->count, h->count ? h->total_ns / 1e3 / h->count : 0, h->count ? h->min_ns / 1e3 : 0,
+            latency_percentile(h, 0.5), latency_percentile(h, 0.9), latency_percentile(h, 0.99), latency_percentile(h, 0.999), h->max_ns / 1e3,
+            last ? "" : ",");
+}
+
+/**
+ * @brief Writes one copy as a JSON document: configuration, byte count, phase timings, stall
+ * counters and, when the copy was instrumented, latency percentiles and the throughput timeline.
+ */
+void write_copy_result_json(const char *json_path, const char *source, const char *target, const char *block_size, const struct copy_stats *stats,
+                            const struct io_metrics *metrics)
+{
+    FILE *json = fopen(json_path, "w");
+    if (json == NULL)
+    {
+        perror(json_path);
+        return;
+    }
+    fprintf(json, "{\n  \"source\": \"%s\",\n  \"target\": \"%s\",\n  \"engine\": \"%s\",\n  \"block_size\": \"%s\",\n  \"queue_depth\": %u,\n  \"threads\": %u,\n"
+                  "  \"direct\": %s,\n  \"bytes\": %llu,\n  \"bytes_skipped\": %llu,\n  \"bytes_unreadable\": %llu,\n  \"bytes_unallocated\": %llu,\n"
+                  "  \"elapsed_seconds\": %.6f,\n  \"buffered_mbs\": %.2f,\n  \"durable_mbs\": %.2f,\n",
+            source, target, copy_engine_names[copy_engine], block_size, queue_depth, copy_threads, use_direct_io ? "true" : "false",
+            (unsigned long long)stats->bytes_copied, (unsigned long long)stats->bytes_skipped, (unsigned long long)stats->bytes_unreadable,
+            (unsigned long long)stats->bytes_unallocated, stats->elapsed_seconds, buffered_rate(stats), durable_rate(stats));
+    fprintf(json, "  \"phases_seconds\": {\"open\": %.6f, \"read\": %.6f, \"write\": %.6f, \"flush\": %.6f},\n", stats->open_seconds, stats->read_seconds,
+            stats->write_seconds, stats->flush_seconds);
+    if (metrics != NULL)
+    {
+        fprintf(json, "  \"throttle\": {\"seconds\": %.6f, \"limit_bytes_per_second\": %llu, \"max_iops\": %u, \"latency_backoffs\": %u},\n",
+                throttle.throttled_ns / 1e9, (unsigned long long)throttle.bytes_per_second, max_iops, throttle.backoffs);
+    }
+    fprintf(json, "  \"stalls\": {\"reader\": %llu, \"reader_seconds\": %.6f, \"writer\": %llu, \"writer_seconds\": %.6f, \"slow_windows\": %zu},\n",
+            (unsigned long long)stats->reader_stalls, stats->reader_stall_seconds, (unsigned long long)stats->writer_stalls, stats->writer_stall_seconds,
+            metrics ? count_slow_windows(metrics) : 0);
+    if (metrics == NULL)
+    {
+        fprintf(json, "  \"latency_us\": null,\n  \"throughput\": null\n}\n");
+    }
+    else
+    {
+        fprintf(json, "  \"latency_us\": {\n");
+        write_latency_json(json, "read", &metrics->read, 0);
+        write_latency_json(json, "write", &metrics->write, 1);
+        fprintf(json, "  },\n  \"throughput\": {\"window_seconds\": %.3f, \"windows\": [", metrics->window_seconds);
+        double previous_seconds = 0;
+        uint64_t previous_bytes = 0;
+        for (size_t i = 0; i < metrics->num_samples; ++i)
+        {
+            const struct throughput_sample *sample = &metrics->samples[i];
+            double seconds = sample->seconds - previous_seconds;
+            fprintf(json, "%s\n    {\"end_seconds\": %.3f, \"bytes\": %llu, \"mbs\": %.2f}", i ? "," : "", sample->seconds,
+                    (unsigned long long)(sample->bytes - previous_bytes), seconds > 0 ? (sample->bytes - previous_bytes) / seconds / 1e6 : 0);
+            previous_seconds = sample->seconds;
+            previous_bytes = sample->bytes;
+        }
+        fprintf(json, "\n  ]}\n}\n");
+    }
+    fclose(json);
+}
+
+uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t reserve_rate_slot(uint64_t *clock, uint64_t cost_ns, uint64_t now)
+{
+    uint64_t old = __atomic_load_n(clock, __ATOMIC_RELAXED);
+    uint64_t start;
+    do
+    {
+        start = old > now ? old : now;
+    } while (!__atomic_compare_exchange_n(clock, &old, start + cost_ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return start;
+}
+
+/**
+ * @brief Moves the byte limit after each interval by the p99 read latency the session saw in it.
+ */
+void adjust_rate_limit(struct copy_session *session)
+{
+    struct io_metrics *metrics = session->metrics;
+    uint64_t now = monotonic_ns();
+    if (metrics == NULL || now < __atomic_load_n(&throttle.next_adjust_ns, __ATOMIC_RELAXED) || pthread_mutex_trylock(&throttle.adjust_lock) != 0)
+    {
+        return;
+    }
+    double seconds = now / 1e9;
+    uint64_t bytes = __atomic_load_n(&metrics->session->stats.bytes_copied, __ATOMIC_RELAXED);
+    if (throttle.seen_start != metrics->start)
+    {
+        // A new copy: its histogram starts from zero.
+        memset(throttle.seen_reads, 0, sizeof(throttle.seen_reads));
+        throttle.seen_start = metrics->start;
+    }
+
+    struct latency_histogram *recent = calloc(1, sizeof(*recent));
+    if (recent == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < LATENCY_BUCKETS; ++i)
+    {
+        uint64_t count = __atomic_load_n(&metrics->read.counts[i], __ATOMIC_RELAXED);
+        recent->counts[i] = count - throttle.seen_reads[i];
+        recent->count += recent->counts[i];
+        throttle.seen_reads[i] = count;
+    }
+    recent->max_ns = UINT64_MAX;
+
+    // A handful of reads says nothing about the tail.
+    if (recent->count >= 16)
+    {
+        uint64_t limit = __atomic_load_n(&throttle.bytes_per_second, __ATOMIC_RELAXED);
+        uint64_t floor = 1024 * 1024;
+        if (latency_percentile(recent, 0.99) > latency_target_us && (limit || bytes > 0))
+        {
+            // Striped workers publish whole chunks, so the first backoff starts from the average rate.
+            double base = limit ? limit : bytes / (seconds - metrics->start);
+            limit = base * 0.7 > floor ? (uint64_t)(base * 0.7) : floor;
+            throttle.backoffs++;
+        }
+        else if (limit)
+        {
+            // Without --max-rate the limit keeps growing until it no longer binds.
+            limit = (uint64_t)(limit * 1.1);
+            if (max_rate_bytes && limit > max_rate_bytes)
+            {
+                limit = max_rate_bytes;
+            }
+        }
+        __atomic_store_n(&throttle.bytes_per_second, limit, __ATOMIC_RELAXED);
+    }
+    free(recent);
+    __atomic_store_n(&throttle.next_adjust_ns, now + (uint64_t)(THROTTLE_ADJUST_SECONDS * 1e9), __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&throttle.adjust_lock);
+}
+
+/**
+ * @brief Waits until a request of the given size fits the rate and IOPS limits. Engines call it
+ * before each source read, so the target writes follow the same pace.
+ */
+void throttle_io(struct copy_session *session, size_t bytes)
+{
+    if (!max_rate_bytes && !max_iops && !latency_target_us)
+    {
+        return;
+    }
+    if (latency_target_us)
+    {
+        adjust_rate_limit(session);
+    }
+    uint64_t now = monotonic_ns();
+    uint64_t start = now;
+    uint64_t limit = __atomic_load_n(&throttle.bytes_per_second, __ATOMIC_RELAXED);
+    if (limit)
+    {
+        uint64_t slot = reserve_rate_slot(&throttle.byte_clock_ns, (uint64_t)(bytes * 1e9 / limit), now);
+        start = slot > start ? slot : start;
+    }
+    if (max_iops)
+    {
+        uint64_t slot = reserve_rate_slot(&throttle.op_clock_ns, 1000000000ULL / max_iops, now);
+        start = slot > start ? slot : start;
+    }
+    if (start > now + THROTTLE_BURST_NS)
+    {
+        uint64_t wait = start - now - THROTTLE_BURST_NS;
+        struct timespec ts = {(time_t)(wait / 1000000000ULL), (long)(wait % 1000000000ULL)};
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        {
+        }
+        __atomic_fetch_add(&throttle.throttled_ns, wait, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Puts the process (and every thread it starts later) into an I/O scheduling class:
+ * idle, be[:0-7] or rt[:0-7]. Only the BFQ and mq-deadline schedulers act on it.
+ */
+void set_io_priority(const char *optarg)
+{
+    const char *classes[] = {"rt", "be", "idle"};
+    char name[8] = "";
+    unsigned level = 4;
+    int fields = sscanf(optarg, "%7[a-z]:%u", name, &level);
+    int io_class = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+        if (strcmp(name, classes[i]) == 0)
+        {
+            io_class = i + 1;
+        }
+    }
+    if (io_class == 0 || (fields == 2 && (io_class == 3 || level > 7)))
+    {
+        fprintf(stderr, "Invalid I/O priority: %s (expected idle, be[:0-7] or rt[:0-7])\n", optarg);
+        exit(EXIT_FAILURE);
+    }
+    // ioprio_set(IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(class, level))
+    if (syscall(SYS_ioprio_set, 1, 0, (io_class << 13) | (io_class == 3 ? 0 : level)) != 0)
+    {
+        fprintf(stderr, "Error: Cannot set I/O priority %s: %s\n", optarg, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Writes a value into a cgroup or sysfs control file in one write(), as the kernel expects.
+ */
+int write_control_file(const char *path, const char *value)
+{
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    ssize_t written = write(fd, value, strlen(value));
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return written == (ssize_t)strlen(value) ? 0 : -1;
+}
+
+/**
+ * @brief Moves the process into a cgroup v2 group (NAME under /sys/fs/cgroup, or an absolute path),
+ * creating it if needed, and optionally sets its io.weight: --cgroup NAME[:WEIGHT].
+ */
+void join_io_cgroup(const char *optarg)
+{
+    char group[MAX_PATH];
+    unsigned weight = 0;
+    snprintf(group, sizeof(group), "%s%s", optarg[0] == '/' ? "" : "/sys/fs/cgroup/", optarg);
+    char *colon = strrchr(group, ':');
+    if (colon != NULL)
+    {
+        *colon = '\0';
+        weight = parse_count(colon + 1, "io.weight", 1, 10000);
+    }
+    if (mkdir(group, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Error: Cannot create cgroup %s: %s\n", group, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    char path[MAX_PATH + 16];
+    char value[32];
+    if (weight)
+    {
+        snprintf(path, sizeof(path), "%s/io.weight", group);
+        snprintf(value, sizeof(value), "default %u\n", weight);
+        if (write_control_file(path, value) != 0)
+        {
+            // io.weight only exists once the parent enables the io controller for its children.
+            print_colored("\033[1;33m", "Warning: Cannot set %s (is the io controller enabled in the parent's cgroup.subtree_control?)\n", path);
+        }
+    }
+    snprintf(path, sizeof(path), "%s/cgroup.procs", group);
+    snprintf(value, sizeof(value), "%d\n", (int)getpid());
+    if (write_control_file(path, value) != 0)
+    {
+        fprintf(stderr, "Error: Cannot join cgroup %s: %s\n", group, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Copies a byte range of the session source into the same offset of the target.
+ *
+ * Reads and writes whole blocks through one aligned buffer. A length of 0 copies until the end
+ * of the source. Returns 0 on success and -1 on an I/O error (errno is preserved).
+ */
+int native_copy_range(struct copy_session *session, uint64_t offset, uint64_t length)
+{
+    char *buffer = allocate_io_buffer(session->block_size);
+    uint64_t end = length ? offset + length : UINT64_MAX;
+    struct cache_window window = {0};
+    double start = monotonic_seconds();
+    int ret = 0;
+
+    while (offset < end)
+    {
+        size_t chunk = session->block_size;
+        if (end - offset < chunk)
+        {
+            chunk = end - offset;
+        }
+
+        // O_DIRECT needs aligned lengths, so a short final piece is read rounded up and trimmed.
+        size_t request = (chunk + IO_ALIGNMENT - 1) / IO_ALIGNMENT * IO_ALIGNMENT;
+        if (request > session->block_size)
+        {
+            request = chunk;
+        }
+        throttle_io(session, request);
+        double io_start = monotonic_seconds();
+        ssize_t got = read_fully(session->source_fd, buffer, request, offset);
+        double io_end = monotonic_seconds();
+        session->stats.read_seconds += io_end - io_start;
+        if (got < 0)
+        {
+            count_io_error(session);
+            ret = -1;
+            break;
+        }
+        record_latency(session, 0, io_start, io_end);
+        if ((size_t)got > chunk)
+        {
+            got = chunk;
+        }
+        if (got == 0)
+        {
+            break;
+        }
+        hasher_add(session->hasher, offset, buffer, got);
+        int skipped = skip_zero_block(session, buffer, got);
+        double write_start = monotonic_seconds();
+        if (!skipped && write_fully(session->target_fd, buffer, got, offset) < 0)
+        {
+            count_io_error(session);
+            ret = -1;
+            break;
+        }
+        double write_end = monotonic_seconds();
+        session->stats.write_seconds += write_end - io_end;
+        if (!skipped)
+        {
+            record_latency(session, 1, write_start, write_end);
+        }
+        release_page_cache(session, &window, offset, got);
+
+        offset += got;
+        session->stats.bytes_copied += got;
+        report_copy_progress(session, start, 0);
+        if ((size_t)got < chunk)
+        {
+            break;
+        }
+    }
+
+    int saved_errno = errno;
+    finish_page_cache(session, &window);
+    free(buffer);
+    errno = saved_errno;
+    return ret;
+}
+
+/**
+ * @brief Minimal io_uring instance driven through the raw system calls (no liburing dependency).
+ */
+struct uring
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned to_submit;
+};
+
+int uring_setup(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        int saved_errno = errno;
+        close(ring->fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+void uring_teardown(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    unsigned tail = *ring->sq_tail + ring->to_submit;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->to_submit++;
+    return sqe;
+}
+
+/**
+ * @brief Publishes all prepared SQEs and waits until at least wait_nr completions are available.
+ *
+ * The kernel may consume fewer SQEs than offered (and then does not wait); the rest are offered
+ * again until all are taken. Returns -1 with errno set if submission fails; SQEs the kernel has
+ * not consumed stay in the ring for uring_drain().
+ */
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr)
+{
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->to_submit, __ATOMIC_RELEASE);
+    unsigned submit = ring->to_submit;
+    ring->to_submit = 0;
+
+    for (;;)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret < 0)
+        {
+            // -EINTR means nothing was submitted; a call that submits returns the count instead.
+            if (errno != EINTR)
+            {
+                return -1;
+            }
+            continue;
+        }
+        if ((unsigned)ret >= submit)
+        {
+            return 0;
+        }
+        if (ret == 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        submit -= ret;
+    }
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Waits for every request the kernel still owns, so their buffers can be freed.
+ *
+ * in_flight counts every prepared request; those whose SQEs the kernel never consumed are taken
+ * back from the ring instead of waited for. Returns -1 if waiting fails, in which case the
+ * buffers may still be in use and must not be freed.
+ */
+int uring_drain(struct uring *ring, unsigned in_flight)
+{
+    // Without SQPOLL the kernel only consumes SQEs inside io_uring_enter(), so the tail can be rolled back.
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned unconsumed = *ring->sq_tail + ring->to_submit - head;
+    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+    ring->to_submit = 0;
+
+    unsigned pending = in_flight > unconsumed ? in_flight - unconsumed : 0;
+    while (pending > 0)
+    {
+        if (uring_peek_cqe(ring) != NULL)
+        {
+            uring_cqe_seen(ring);
+            pending--;
+            continue;
+        }
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+enum uring_slot_state
+{
+    SLOT_IDLE,
+    SLOT_READING,
+    SLOT_WRITING
+};
+
+struct uring_slot
+{
+    enum uring_slot_state state;
+    char *buffer;
+    uint64_t offset;
+    size_t length;
+    size_t filled;
+    size_t written;
+    double issued;
+};
+
+void uring_prep_slot(struct uring *ring, struct uring_slot *slot, unsigned index, size_t block_size, int fixed_buffers, int fixed_files, int source_fd, int target_fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    int reading = slot->state == SLOT_READING;
+    slot->issued = monotonic_seconds();
+    size_t done = reading ? slot->filled : slot->written;
+    size_t todo = reading ? slot->length - slot->filled : slot->filled - slot->written;
+
+    if (fixed_buffers)
+    {
+        sqe->opcode = reading ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = index;
+    }
+    else
+    {
+        sqe->opcode = reading ? IORING_OP_READ : IORING_OP_WRITE;
+    }
+    if (fixed_files)
+    {
+        sqe->fd = reading ? 0 : 1;
+        sqe->flags = IOSQE_FIXED_FILE;
+    }
+    else
+    {
+        sqe->fd = reading ? source_fd : target_fd;
+    }
+    if (reading && todo % IO_ALIGNMENT != 0 && done + todo < block_size)
+    {
+        // O_DIRECT needs aligned lengths; the read just stops at end of file.
+        todo = (todo + IO_ALIGNMENT - 1) / IO_ALIGNMENT * IO_ALIGNMENT;
+        if (done + todo > block_size)
+        {
+            todo = block_size - done;
+        }
+    }
+
+    sqe->addr = (uint64_t)(uintptr_t)(slot->buffer + done);
+    sqe->len = todo;
+    sqe->off = slot->offset + done;
+    sqe->user_data = index;
+}
+
+/**
+ * @brief Copies a byte range with io_uring, keeping up to queue_depth blocks in flight.
+ *
+ * Every slot owns one registered buffer and cycles read -> write -> read, so reads of later
+ * blocks overlap with writes of earlier ones. Source and target are registered as fixed files.
+ * Falls back to the native engine when io_uring is unavailable (old kernel, disabled by sysctl,
+ * seccomp). Returns 0 on success and -1 on an I/O error (errno is set).
+ */
+int uring_copy_range(struct copy_session *session, uint64_t offset, uint64_t length)
+{
+    unsigned queue_depth = session->queue_depth ? session->queue_depth : 1;
+    uint64_t end = length ? offset + length : session->source_size;
+    if (end > session->source_size)
+    {
+        end = session->source_size;
+    }
+
+    struct uring ring;
+    if (uring_setup(&ring, queue_depth) != 0)
+    {
+        print_colored("\033[1;33m", "Warning: io_uring unavailable (%s), using the native engine.\n", strerror(errno));
+        return native_copy_range(session, offset, length);
+    }
+
+    struct uring_slot *slots = calloc(queue_depth, sizeof(*slots));
+    struct iovec *iovecs = calloc(queue_depth, sizeof(*iovecs));
+    char *buffers = allocate_io_buffer((size_t)queue_depth * session->block_size);
+    if (slots == NULL || iovecs == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < queue_depth; ++i)
+    {
+        slots[i].buffer = buffers + (size_t)i * session->block_size;
+        iovecs[i].iov_base = slots[i].buffer;
+        iovecs[i].iov_len = session->block_size;
+    }
+
+    // Registration can fail on small RLIMIT_MEMLOCK (kernels before 5.12); plain reads/writes still work.
+    int fixed_buffers = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iovecs, queue_depth) == 0;
+    int files[2] = {session->source_fd, session->target_fd};
+    int fixed_files = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, files, 2) == 0;
+
+    hasher_reserve(session->hasher, (uint64_t)queue_depth * session->block_size);
+    double start = monotonic_seconds();
+    uint64_t next_offset = offset;
+    unsigned in_flight = 0;
+    struct cache_window window = {0};
+    int error = 0;
+
+    for (unsigned i = 0; i < queue_depth && next_offset < end; ++i)
+    {
+        throttle_io(session, end - next_offset < session->block_size ? end - next_offset : session->block_size);
+        slots[i].state = SLOT_READING;
+        slots[i].offset = next_offset;
+        slots[i].length = end - next_offset < session->block_size ? end - next_offset : session->block_size;
+        slots[i].filled = 0;
+        next_offset += slots[i].length;
+        uring_prep_slot(&ring, &slots[i], i, session->block_size, fixed_buffers, fixed_files, session->source_fd, session->target_fd);
+        in_flight++;
+    }
+
+    while (in_flight > 0)
+    {
+        if (uring_submit_and_wait(&ring, 1) != 0)
+        {
+            error = errno;
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&ring)) != NULL)
+        {
+            unsigned index = (unsigned)cqe->user_data;
+            int res = cqe->res;
+            uring_cqe_seen(&ring);
+            struct uring_slot *slot = &slots[index];
+
+            if (res == -EINTR || res == -EAGAIN)
+            {
+                count_io_retry(session);
+                uring_prep_slot(&ring, slot, index, session->block_size, fixed_buffers, fixed_files, session->source_fd, session->target_fd);
+                continue;
+            }
+            // The unaligned tail of an image cannot be written with O_DIRECT; finish it buffered.
+            if (res == -EINVAL && slot->state == SLOT_WRITING && clear_direct_io_for_tail(session->target_fd, slot->filled - slot->written))
+            {
+                count_io_retry(session);
+                uring_prep_slot(&ring, slot, index, session->block_size, fixed_buffers, fixed_files, session->source_fd, session->target_fd);
+                continue;
+            }
+            if (res < 0 || error)
+            {
+                if (res < 0)
+                {
+                    count_io_error(session);
+                }
+                if (res < 0 && !error)
+                {
+                    error = -res;
+                }
+                slot->state = SLOT_IDLE;
+                in_flight--;
+                continue;
+            }
+            record_latency(session, slot->state == SLOT_WRITING, slot->issued, monotonic_seconds());
+
+            if (slot->state == SLOT_READING)
+            {
+                slot->filled += res;
+                if (slot->filled > slot->length)
+                {
+                    slot->filled = slot->length;
+                }
+                if (res > 0 && slot->filled < slot->length)
+                {
+                    uring_prep_slot(&ring, slot, index, session->block_size, fixed_buffers, fixed_files, session->source_fd, session->target_fd);
+                    continue;
+                }
+                if (res == 0)
+                {
+                    // Source ended early (file truncated underneath us); stop issuing reads past it.
+                    end = slot->offset + slot->filled;
+                }
+                if (slot->filled == 0)
+                {
+                    slot->state = SLOT_IDLE;
+                    in_flight--;
+                    continue;
+                }
+                slot->state = SLOT_WRITING;
+                slot->written = 0;
+                hasher_add(session->hasher, slot->offset, slot->buffer, slot->filled);
+                if (!skip_zero_block(session, slot->buffer, slot->filled))
+                {
+                    uring_prep_slot(&ring, slot, index, session->block_size, fixed_buffers, fixed_files, session->source_fd, session->target_fd);
+                    continue;
+                }
+                // A skipped zero block completes as if its write had returned everything.
+                res = slot->filled;
+            }
+
+            slot->written += res;
+            if (slot->written < slot->filled)
+            {
+                uring_prep_slot(&ring, slot, index, session->block_size, fixed_buffers, fixed_files, session->source_fd, session->target_fd);
+                continue;
+            }
+
+            session->stats.bytes_copied += slot->filled;
+            release_page_cache(session, &window, slot->offset, slot->filled);
+            report_copy_progress(session, start, 0);
+
+            if (next_offset < end)
+            {
+                throttle_io(session, end - next_offset < session->block_size ? end - next_offset : session->block_size);
+                slot->state = SLOT_READING;
+                slot->offset = next_offset;
+                slot->length = end - next_offset < session->block_size ? end - next_offset : session->block_size;
+                slot->filled = 0;
+                next_offset += slot->length;
+                uring_prep_slot(&ring, slot, index, session->block_size, fixed_buffers, fixed_files, session->source_fd, session->target_fd);
+            }
+            else
+            {
+                slot->state = SLOT_IDLE;
+                in_flight--;
+            }
+        }
+        set_queue_occupancy(session, in_flight);
+    }
+
+    finish_page_cache(session, &window);
+    if (in_flight > 0 && uring_drain(&ring, in_flight) != 0)
+    {
+        // The kernel may still read into or write from the buffers; leak them rather than free them.
+        print_colored("\033[1;31m", "Error: could not wait for %u outstanding io_uring request(s): %s\n", in_flight, strerror(errno));
+        uring_teardown(&ring);
+        errno = error;
+        return -1;
+    }
+    uring_teardown(&ring);
+    free(buffers);
+    free(iovecs);
+    free(slots);
+
+    if (error)
+    {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief One worker's share of a striped copy: a contiguous run of chunks [next_chunk, end_chunk).
+ *
+ * The owner takes chunks from the front; idle workers steal single chunks from the back, so a
+ * slow region of the device never leaves the other threads without work.
+ */
+struct stripe
+{
+    pthread_mutex_t lock;
+    uint64_t next_chunk;
+    uint64_t end_chunk;
+};
+
+struct striped_copy
+{
+    struct copy_session *session;
+    struct stripe *stripes;
+    unsigned num_stripes;
+    unsigned num_workers;
+    uint64_t offset;
+    uint64_t end;
+    uint64_t chunk_size;
+    int error;
+    unsigned active_workers;
+    uint64_t stolen_chunks;
+};
+
+struct striped_worker
+{
+    struct striped_copy *copy;
+    unsigned index;
+    double read_seconds;
+    double write_seconds;
+};
+
+int take_chunk(struct stripe *stripe, int steal, uint64_t *chunk)
+{
+    int found = 0;
+    pthread_mutex_lock(&stripe->lock);
+    if (stripe->next_chunk < stripe->end_chunk)
+    {
+        *chunk = steal ? --stripe->end_chunk : stripe->next_chunk++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return found;
+}
+
+void *striped_copy_worker(void *arg)
+{
+    struct striped_worker *worker = arg;
+    struct striped_copy *copy = worker->copy;
+    struct copy_session session = *copy->session;
+    session.show_progress = 0;
+    session.stats.read_seconds = 0;
+    session.stats.write_seconds = 0;
+
+    for (;;)
+    {
+        uint64_t chunk;
+        int found = take_chunk(&copy->stripes[worker->index % copy->num_stripes], 0, &chunk);
+        for (unsigned i = 1; !found && i < copy->num_stripes; ++i)
+        {
+            found = take_chunk(&copy->stripes[(worker->index + i) % copy->num_stripes], 1, &chunk);
+            if (found)
+            {
+                __atomic_fetch_add(&copy->stolen_chunks, 1, __ATOMIC_RELAXED);
+            }
+        }
+        if (!found || __atomic_load_n(&copy->error, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+
+        uint64_t start = copy->offset + chunk * copy->chunk_size;
+        uint64_t length = copy->end - start < copy->chunk_size ? copy->end - start : copy->chunk_size;
+        session.stats.bytes_copied = 0;
+        session.stats.bytes_skipped = 0;
+        int ret = native_copy_range(&session, start, length);
+        __atomic_fetch_add(&copy->session->stats.bytes_copied, session.stats.bytes_copied, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&copy->session->stats.bytes_skipped, session.stats.bytes_skipped, __ATOMIC_RELAXED);
+        if (ret != 0)
+        {
+            int expected = 0;
+            __atomic_compare_exchange_n(&copy->error, &expected, errno, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    worker->read_seconds = session.stats.read_seconds;
+    worker->write_seconds = session.stats.write_seconds;
+    __atomic_fetch_sub(&copy->active_workers, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * @brief Copies a byte range with copy_threads worker threads working on disjoint stripes.
+ *
+ * The range is cut into chunk_size chunks and split into one contiguous stripe per thread; each
+ * thread copies its chunks into the same offsets of the target and then steals from the others.
+ * Returns 0 on success and -1 on an I/O error (errno is set).
+ */
+int striped_copy_range(struct copy_session *session, uint64_t offset, uint64_t length)
+{
+    struct striped_copy copy;
+    memset(&copy, 0, sizeof(copy));
+    copy.session = session;
+    copy.offset = offset;
+    copy.end = length ? offset + length : session->source_size;
+    if (copy.end > session->source_size)
+    {
+        copy.end = session->source_size;
+    }
+    if (copy.end <= offset)
+    {
+        return 0;
+    }
+
+    copy.chunk_size = chunk_size_bytes < session->block_size ? session->block_size : chunk_size_bytes;
+    copy.chunk_size = copy.chunk_size / session->block_size * session->block_size;
+    uint64_t num_chunks = (copy.end - offset + copy.chunk_size - 1) / copy.chunk_size;
+    copy.num_workers = copy_threads < num_chunks ? copy_threads : (unsigned)num_chunks;
+    // Inline hashing consumes the image in order, so all workers then share one stripe and
+    // take consecutive chunks instead of copying distant parts of the source.
+    copy.num_stripes = session->hasher != NULL ? 1 : copy.num_workers;
+    copy.active_workers = copy.num_workers;
+
+    // Reserve the image up front so parallel writers do not fragment it (unless it should stay sparse).
+    struct stat st;
+    if (!session->sparse && fstat(session->target_fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        posix_fallocate(session->target_fd, offset, copy.end - offset);
+    }
+
+    copy.stripes = calloc(copy.num_stripes, sizeof(*copy.stripes));
+    struct striped_worker *workers = calloc(copy.num_workers, sizeof(*workers));
+    pthread_t *threads = calloc(copy.num_workers, sizeof(*threads));
+    if (copy.stripes == NULL || workers == NULL || threads == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned i = 0; i < copy.num_stripes; ++i)
+    {
+        pthread_mutex_init(&copy.stripes[i].lock, NULL);
+        copy.stripes[i].next_chunk = num_chunks * i / copy.num_stripes;
+        copy.stripes[i].end_chunk = num_chunks * (i + 1) / copy.num_stripes;
+    }
+    for (unsigned i = 0; i < copy.num_workers; ++i)
+    {
+        workers[i].copy = &copy;
+        workers[i].index = i;
+        if (pthread_create(&threads[i], NULL, striped_copy_worker, &workers[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    double start = monotonic_seconds();
+    while (__atomic_load_n(&copy.active_workers, __ATOMIC_ACQUIRE) > 0)
+    {
+        usleep(100000);
+        set_queue_occupancy(session, __atomic_load_n(&copy.active_workers, __ATOMIC_ACQUIRE));
+        report_copy_progress(session, start, 0);
+    }
+    for (unsigned i = 0; i < copy.num_workers; ++i)
+    {
+        pthread_join(threads[i], NULL);
+        session->stats.read_seconds += workers[i].read_seconds;
+        session->stats.write_seconds += workers[i].write_seconds;
+    }
+    for (unsigned i = 0; i < copy.num_stripes; ++i)
+    {
+        pthread_mutex_destroy(&copy.stripes[i].lock);
+    }
+
+    if (session->show_progress && copy.stolen_chunks > 0)
+    {
+        fprintf(stderr, "\n%llu of %llu chunks were stolen by idle workers", (unsigned long long)copy.stolen_chunks, (unsigned long long)num_chunks);
+    }
+
+    free(threads);
+    free(workers);
+    free(copy.stripes);
+
+    if (copy.error)
+    {
+        errno = copy.error;
+        return -1;
+    }
+    return 0;
+}
+
+struct pipeline_slot
+{
+    char *buffer;
+    uint64_t offset;
+    size_t length;
+};
+
+/**
+ * @brief Single-producer/single-consumer ring of filled buffers between the reader and writer threads.
+ *
+ * head is only written by the reader and tail only by the writer, each on its own cache line;
+ * a slot is owned by the reader while head - tail < capacity and by the writer otherwise.
+ */
+struct spsc_ring
+{
+    struct pipeline_slot *slots;
+    unsigned capacity;
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    int done __attribute__((aligned(64)));
+    int error;
+};
+
+struct pipeline_copy
+{
+    struct copy_session *session;
+    struct spsc_ring ring;
+    uint64_t offset;
+    uint64_t end;
+    double reader_stall_seconds;
+    double writer_stall_seconds;
+    uint64_t reader_stalls;
+    uint64_t writer_stalls;
+    double read_seconds;
+    double write_seconds;
+};
+
+void pipeline_backoff(unsigned *spins)
+{
+    if (++*spins < 64)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    else if (*spins < 128)
+    {
+        sched_yield();
+    }
+    else
+    {
+        usleep(50);
+    }
+}
+
+void pipeline_fail(struct spsc_ring *ring, int error)
+{
+    int expected = 0;
+    __atomic_compare_exchange_n(&ring->error, &expected, error, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->done, 1, __ATOMIC_RELEASE);
+}
+
+void *pipeline_reader(void *arg)
+{
+    struct pipeline_copy *copy = arg;
+    struct spsc_ring *ring = &copy->ring;
+    struct copy_session *session = copy->session;
+    uint64_t offset = copy->offset;
+
+    while (offset < copy->end && !__atomic_load_n(&ring->error, __ATOMIC_RELAXED))
+    {
+        uint64_t head = ring->head;
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->capacity)
+        {
+            double stall_start = monotonic_seconds();
+            unsigned spins = 0;
+            while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->capacity && !__atomic_load_n(&ring->error, __ATOMIC_RELAXED))
+            {
+                pipeline_backoff(&spins);
+            }
+            copy->reader_stall_seconds += monotonic_seconds() - stall_start;
+            copy->reader_stalls++;
+            continue;
+        }
+
+        struct pipeline_slot *slot = &ring->slots[head % ring->capacity];
+        size_t chunk = copy->end - offset < session->block_size ? copy->end - offset : session->block_size;
+        size_t request = (chunk + IO_ALIGNMENT - 1) / IO_ALIGNMENT * IO_ALIGNMENT;
+        if (request > session->block_size)
+        {
+            request = chunk;
+        }
+        throttle_io(session, request);
+        double read_start = monotonic_seconds();
+        ssize_t got = read_fully(session->source_fd, slot->buffer, request, offset);
+        double read_end = monotonic_seconds();
+        copy->read_seconds += read_end - read_start;
+        if (got < 0)
+        {
+            count_io_error(session);
+            pipeline_fail(ring, errno);
+            return NULL;
+        }
+        record_latency(session, 0, read_start, read_end);
+        if ((size_t)got > chunk)
+        {
+            got = chunk;
+        }
+        if (got == 0)
+        {
+            break;
+        }
+
+        slot->offset = offset;
+        slot->length = got;
+        offset += got;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        if ((size_t)got < chunk)
+        {
+            break;
+        }
+    }
+
+    __atomic_store_n(&ring->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void *pipeline_writer(void *arg)
+{
+    struct pipeline_copy *copy = arg;
+    struct spsc_ring *ring = &copy->ring;
+    struct copy_session *session = copy->session;
+    struct cache_window window = {0};
+    double start = monotonic_seconds();
+
+    for (;;)
+    {
+        uint64_t tail = ring->tail;
+        if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        {
+            // Check done before re-reading head so the last published slot is never missed.
+            if (__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE) && tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+            {
+                break;
+            }
+            double stall_start = monotonic_seconds();
+            unsigned spins = 0;
+            while (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) && !__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE))
+            {
+                pipeline_backoff(&spins);
+            }
+            copy->writer_stall_seconds += monotonic_seconds() - stall_start;
+            copy->writer_stalls++;
+            continue;
+        }
+
+        struct pipeline_slot *slot = &ring->slots[tail % ring->capacity];
+        hasher_add(session->hasher, slot->offset, slot->buffer, slot->length);
+        int skipped = skip_zero_block(session, slot->buffer, slot->length);
+        double write_start = monotonic_seconds();
+        if (!skipped && write_fully(session->target_fd, slot->buffer, slot->length, slot->offset) < 0)
+        {
+            count_io_error(session);
+            pipeline_fail(ring, errno);
+            break;
+        }
+        double write_end = monotonic_seconds();
+        copy->write_seconds += write_end - write_start;
+        if (!skipped)
+        {
+            record_latency(session, 1, write_start, write_end);
+        }
+        __atomic_fetch_add(&session->stats.bytes_copied, slot->length, __ATOMIC_RELAXED);
+        release_page_cache(session, &window, slot->offset, slot->length);
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        set_queue_occupancy(session, (unsigned)(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail - 1));
+        report_copy_progress(session, start, 0);
+    }
+    finish_page_cache(session, &window);
+    return NULL;
+}
+
+/**
+ * @brief Copies a byte range with a reader thread and a writer thread connected by a lock-free ring.
+ *
+ * The reader keeps filling queue_depth aligned buffers while the writer drains them, so source
+ * reads and target writes proceed at the same time. Time each side spends waiting on the other
+ * is recorded in the session stats. Returns 0 on success and -1 on an I/O error (errno is set).
+ */
+int pipeline_copy_range(struct copy_session *session, uint64_t offset, uint64_t length)
+{
+    struct pipeline_copy copy;
+    memset(&copy, 0, sizeof(copy));
+    copy.session = session;
+    copy.offset = offset;
+    copy.end = length ? offset + length : session->source_size;
+
+    unsigned capacity = session->queue_depth < 2 ? 2 : session->queue_depth;
+    char *buffers = allocate_io_buffer((size_t)capacity * session->block_size);
+    copy.ring.capacity = capacity;
+    copy.ring.slots = calloc(capacity, sizeof(*copy.ring.slots));
+    if (copy.ring.slots == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < capacity; ++i)
+    {
+        copy.ring.slots[i].buffer = buffers + (size_t)i * session->block_size;
+    }
+
+    pthread_t reader, writer;
+    if (pthread_create(&reader, NULL, pipeline_reader, &copy) != 0 || pthread_create(&writer, NULL, pipeline_writer, &copy) != 0)
+    {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+
+    session->stats.reader_stall_seconds += copy.reader_stall_seconds;
+    session->stats.writer_stall_seconds += copy.writer_stall_seconds;
+    session->stats.reader_stalls += copy.reader_stalls;
+    session->stats.writer_stalls += copy.writer_stalls;
+    session->stats.read_seconds += copy.read_seconds;
+    session->stats.write_seconds += copy.write_seconds;
+    free(copy.ring.slots);
+    free(buffers);
+
+    if (copy.ring.error)
+    {
+        errno = copy.ring.error;
+        return -1;
+    }
+    return 0;
+}
+
+int zerocopy_splice(struct copy_session *session, int pipe_fds[2], loff_t *in_offset, loff_t *out_offset, size_t chunk, ssize_t *copied)
+{
+    ssize_t got = splice(session->source_fd, in_offset, pipe_fds[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (got < 0 && errno == EINVAL && clear_direct_io_for_tail(session->source_fd, chunk))
+    {
+        got = splice(session->source_fd, in_offset, pipe_fds[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+    }
+    if (got <= 0)
+    {
+        *copied = got;
+        return got < 0 ? -1 : 0;
+    }
+
+    ssize_t left = got;
+    while (left > 0)
+    {
+        ssize_t put = splice(pipe_fds[0], NULL, session->target_fd, out_offset, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (put < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // The unaligned tail of an image cannot be written with O_DIRECT; finish it buffered.
+            if (errno == EINVAL && clear_direct_io_for_tail(session->target_fd, left))
+            {
+                continue;
+            }
+            *copied = -1;
+            return -1;
+        }
+        left -= put;
+    }
+    *copied = got;
+    return 0;
+}
+
+/**
+ * @brief Copies a byte range inside the kernel without user-space buffers.
+ *
+ * Uses copy_file_range() and, when the kernel refuses it (block device source, cross-filesystem
+ * copy, old kernel), splice() through a pipe sized to the block size. Each call moves at most one
+ * block so progress stays visible. Returns 0 on success and -1 on an I/O error (errno is set).
+ */
+int zerocopy_copy_range(struct copy_session *session, uint64_t offset, uint64_t length)
+{
+    uint64_t end = length ? offset + length : session->source_size;
+    loff_t in_offset = offset;
+    loff_t out_offset = offset;
+    int pipe_fds[2] = {-1, -1};
+    struct cache_window window = {0};
+    double start = monotonic_seconds();
+    int ret = 0;
+
+    while ((uint64_t)in_offset < end)
+    {
+        size_t chunk = end - in_offset < session->block_size ? end - in_offset : session->block_size;
+        ssize_t copied = -1;
+        throttle_io(session, chunk);
+        double io_start = monotonic_seconds();
+
+        if (!session->zerocopy_splice)
+        {
+            copied = copy_file_range(session->source_fd, &in_offset, session->target_fd, &out_offset, chunk, 0);
+            if (copied < 0 && errno == EINVAL && (clear_direct_io_for_tail(session->source_fd, chunk) | clear_direct_io_for_tail(session->target_fd, chunk)))
+            {
+                count_io_retry(session);
+                continue;
+            }
+            if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS))
+            {
+                session->zerocopy_splice = 1;
+                continue;
+            }
+            if (copied < 0 && errno == EINTR)
+            {
+                count_io_retry(session);
+                continue;
+            }
+        }
+        else
+        {
+            if (pipe_fds[0] < 0)
+            {
+                if (pipe(pipe_fds) != 0)
+                {
+                    perror("pipe");
+                    exit(EXIT_FAILURE);
+                }
+                // A pipe as large as one block lets each splice move a whole block; the default is 64k.
+                fcntl(pipe_fds[1], F_SETPIPE_SZ, session->block_size);
+                int pipe_size = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+                if (pipe_size > 0 && (size_t)pipe_size < session->block_size)
+                {
+                    session->block_size = pipe_size;
+                }
+                continue;
+            }
+            if (zerocopy_splice(session, pipe_fds, &in_offset, &out_offset, chunk, &copied) != 0 && errno == EINTR)
+            {
+                count_io_retry(session);
+                continue;
+            }
+        }
+
+        if (copied < 0)
+        {
+            count_io_error(session);
+            ret = -1;
+            break;
+        }
+        if (copied == 0)
+        {
+            break;
+        }
+        // One call moves the block through the kernel; it counts as a write request.
+        record_latency(session, 1, io_start, monotonic_seconds());
+        session->stats.bytes_copied += copied;
+        release_page_cache(session, &window, in_offset - copied, copied);
+        report_copy_progress(session, start, 0);
+    }
+
+    int saved_errno = errno;
+    finish_page_cache(session, &window);
+    if (pipe_fds[0] >= 0)
+    {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    errno = saved_errno;
+    return ret;
+}
+
+/**
+ * @brief Copies a byte range of the session with the currently selected in-process engine.
+ */
+int copy_session_range(struct copy_session *session, uint64_t offset, uint64_t length)
+{
+    if (copy_engine == ENGINE_URING)
+    {
+        return uring_copy_range(session, offset, length);
+    }
+    if (copy_engine == ENGINE_STRIPED)
+    {
+        return striped_copy_range(session, offset, length);
+    }
+    if (copy_engine == ENGINE_PIPELINE)
+    {
+        return pipeline_copy_range(session, offset, length);
+    }
+    if (copy_engine == ENGINE_ZEROCOPY && !session->sparse && session->hasher == NULL)
+    {
+        return zerocopy_copy_range(session, offset, length);
+    }
+    return native_copy_range(session, offset, length);
+}
+
+/**
+ * @brief Progress journal of a resumable copy, kept next to the image as <image>.journal.
+ *
+ * The journal records which source the image belongs to and the offset below which the image
+ * is known to be on stable storage. It is rewritten atomically (temporary file, fsync, rename)
+ * after each fdatasync of the image, so after a crash it never claims more than was durable.
+ */
+struct copy_journal
+{
+    char path[MAX_PATH];
+    char source[MAX_PATH];
+    uint64_t source_size;
+    char serial[128];
+    uint64_t durable;
+    uint64_t committed_at;
+    double sync_seconds;
+};
+
+/**
+ * @brief Sets up the journal of target_path and returns the offset to resume from.
+ *
+ * A journal left by an interrupted copy of the same source (path, size and disk serial) gives
+ * its durable offset; anything else starts from zero.
+ */
+uint64_t open_copy_journal(struct copy_journal *journal, const char *source_path, const char *target_path)
+{
+    memset(journal, 0, sizeof(*journal));
+    snprintf(journal->path, sizeof(journal->path), "%s.journal", target_path);
+    snprintf(journal->source, sizeof(journal->source), "%s", source_path);
+    struct device_identity identity;
+    get_device_identity(source_path, &identity);
+    snprintf(journal->serial, sizeof(journal->serial), "%s", identity.serial[0] ? identity.serial : "-");
+    for (char *p = journal->serial; *p; ++p)
+    {
+        *p = *p == ' ' ? '_' : *p;
+    }
+    int fd = open(source_path, O_RDONLY);
+    if (fd >= 0)
+    {
+        journal->source_size = get_device_size(fd);
+        close(fd);
+    }
+
+    FILE *file = fopen(journal->path, "r");
+    struct stat st;
+    if (file == NULL || stat(target_path, &st) != 0)
+    {
+        if (file != NULL)
+        {
+            fclose(file);
+        }
+        return 0;
+    }
+    char source[MAX_PATH];
+    char serial[128];
+    unsigned long long size = 0;
+    unsigned long long durable = 0;
+    int valid = fscanf(file, "dddarth journal 1 source %2047s size %llu serial %127s durable %llu", source, &size, serial, &durable) == 4;
+    fclose(file);
+    if (!valid || strcmp(source, journal->source) != 0 || size != journal->source_size || strcmp(serial, journal->serial) != 0)
+    {
+        print_colored("\033[1;33m", "Warning: %s belongs to a different source, starting over.\n", journal->path);
+        return 0;
+    }
+    // A sparse image may end in a hole that was never written; the journal is what counts.
+    journal->durable = durable <= size ? durable : 0;
+    journal->committed_at = journal->durable;
+    return journal->durable;
+}
+
+/**
+ * @brief Makes a rename into the directory of path durable.
+ */
+void sync_parent_directory(const char *path)
+{
+    char directory[MAX_PATH];
+    snprintf(directory, sizeof(directory), "%s", path);
+    int directory_fd = open(dirname(directory), O_RDONLY | O_DIRECTORY);
+    if (directory_fd >= 0)
+    {
+        fsync(directory_fd);
+        close(directory_fd);
+    }
+}
+
+/**
+ * @brief Makes everything below durable stable (fdatasync of the image), then records it.
+ */
+void commit_copy_journal(struct copy_journal *journal, struct copy_session *session, uint64_t durable)
+{
+    double start = monotonic_seconds();
+    if (fdatasync(session->target_fd) != 0 && errno != EINVAL)
+    {
+        fprintf(stderr, "\nError: fdatasync on %s failed: %s\n", session->target_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    char temporary[MAX_PATH + 8];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", journal->path);
+    FILE *file = fopen(temporary, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "\nError: Could not write %s: %s\n", temporary, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fprintf(file, "dddarth journal 1\nsource %s\nsize %llu\nserial %s\ndurable %llu\n", journal->source, (unsigned long long)journal->source_size, journal->serial,
+            (unsigned long long)durable);
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0 || fclose(file) != 0 || rename(temporary, journal->path) != 0)
+    {
+        fprintf(stderr, "\nError: Could not update %s: %s\n", journal->path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    sync_parent_directory(journal->path);
+    journal->durable = durable;
+    journal->committed_at = durable;
+    journal->sync_seconds += monotonic_seconds() - start;
+}
+
+/**
+ * @brief Commits the journal once journal_interval bytes were copied since the last commit.
+ */
+void update_copy_journal(struct copy_journal *journal, struct copy_session *session, uint64_t offset)
+{
+    if (journal != NULL && offset - journal->committed_at >= journal_interval_bytes)
+    {
+        commit_copy_journal(journal, session, offset);
+    }
+}
+
+/**
+ * @brief Removes the journal of a finished copy; the image is complete and flushed.
+ */
+void close_copy_journal(struct copy_journal *journal)
+{
+    if (unlink(journal->path) != 0 && errno != ENOENT)
+    {
+        fprintf(stderr, "Warning: Could not remove %s: %s\n", journal->path, strerror(errno));
+    }
+    if (journal->sync_seconds > 0)
+    {
+        print_colored("\033[1;35m", "Journal: %.2f s spent making progress durable every %llu bytes\n", journal->sync_seconds,
+                      (unsigned long long)journal_interval_bytes);
+    }
+}
+
+/**
+ * @brief Feeds the part of the image copied by an earlier, interrupted run to the hasher, so
+ * the digests of a resumed copy still cover the whole image. Rescued images, which are written
+ * out of order, are hashed the same way once they are complete.
+ */
+void hash_resumed_prefix(struct copy_session *session, uint64_t length)
+{
+    if (session->hasher == NULL || length == 0)
+    {
+        return;
+    }
+    int fd = open(session->target_path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Could not reopen %s: %s\n", session->target_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    print_colored("\033[1;33m", "Reading back %llu bytes of %s to hash them...\n", (unsigned long long)length, session->target_path);
+    char *buffer = allocate_io_buffer(session->block_size);
+    for (uint64_t offset = 0; offset < length;)
+    {
+        size_t want = length - offset < session->block_size ? length - offset : session->block_size;
+        ssize_t got = read_fully(fd, buffer, want, offset);
+        if (got <= 0)
+        {
+            fprintf(stderr, "Error: Could not read back %s: %s\n", session->target_path, got < 0 ? strerror(errno) : "image is shorter than its journal");
+            exit(EXIT_FAILURE);
+        }
+        hasher_add(session->hasher, offset, buffer, got);
+        offset += got;
+    }
+    if (page_cache_control)
+    {
+        posix_fadvise(fd, 0, length, POSIX_FADV_DONTNEED);
+    }
+    free(buffer);
+    close(fd);
+}
+
+/**
+ * @brief Copies [offset, length) in journal_interval_bytes segments, committing the journal
+ * between segments so an interruption loses at most one segment.
+ */
+int journaled_copy_range(struct copy_session *session, struct copy_journal *journal, uint64_t offset, uint64_t length)
+{
+    uint64_t end = length ? length : session->source_size;
+    while (offset < end)
+    {
+        uint64_t segment = end - offset < journal_interval_bytes ? end - offset : journal_interval_bytes;
+        uint64_t before = session->stats.bytes_copied;
+        if (copy_session_range(session, offset, segment) != 0)
+        {
+            return -1;
+        }
+        uint64_t copied = session->stats.bytes_copied - before;
+        offset += copied;
+        if (copied < segment || offset >= end)
+        {
+            break;
+        }
+        commit_copy_journal(journal, session, offset);
+    }
+    return 0;
+}
+
+/**
+ * @brief Runs a full copy with the selected in-process engine, flushes the target with fdatasync()
+ * and returns the durable transfer rate in MB/s.
+ *
+ * @param source_path Input file or device.
+ * @param target_path Output image path.
+ * @param block_size Size of each read/write in bytes.
+ * @param length Number of bytes to copy, or 0 to copy the whole source.
+ * @param show_progress Print a dd-style progress line once per second.
+ * @param hash_output Hash the copied data inline and write <target>.hashes and <target>.sha256.
+ * @param resumable Journal progress in <target>.journal and continue from an earlier journal.
+ * @param stats Optional output for the exact byte count and phase timings.
+ */
+double engine_copy(const char *source_path, const char *target_path, size_t block_size, uint64_t length, int show_progress, int hash_output,
+                   int resumable, struct copy_stats *stats)
+{
+    struct copy_journal journal;
+    uint64_t resume_offset = resumable ? open_copy_journal(&journal, source_path, target_path) : 0;
+    struct copy_session session;
+    open_copy_session(&session, source_path, target_path, block_size, resume_offset == 0);
+    session.show_progress = show_progress;
+    if (resume_offset > 0)
+    {
+        print_colored("\033[1;33m", "Resuming at byte %llu from %s\n", (unsigned long long)resume_offset, journal.path);
+    }
+    if (hash_output)
+    {
+        attach_image_hasher(&session, length && length < session.source_size ? length : session.source_size);
+        hash_resumed_prefix(&session, resume_offset);
+    }
+
+    struct io_metrics *metrics = start_io_metrics(&session);
+    metrics->expected_bytes = (length && length < session.source_size ? length : session.source_size) - resume_offset;
+    double start = monotonic_seconds();
+    int ret = resumable ? journaled_copy_range(&session, &journal, resume_offset, length) : copy_session_range(&session, 0, length);
+    if (ret != 0)
+    {
+        publish_metrics();
+        fprintf(stderr, "\nError: Copy from %s to %s failed after %llu bytes: %s\n", source_path, target_path,
+                (unsigned long long)(resume_offset + session.stats.bytes_copied), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    stop_io_metrics(metrics);
+    uint64_t end = resume_offset + session.stats.bytes_copied;
+    if (session.hasher != NULL)
+    {
+        finish_image_hasher(session.hasher, end);
+        session.hasher = NULL;
+    }
+    session.stats.elapsed_seconds = monotonic_seconds() - start;
+    report_copy_progress(&session, start, 1);
+    finish_sparse_target(&session, end);
+    flush_copy_session(&session);
+    close_copy_session(&session);
+    if (resumable)
+    {
+        close_copy_journal(&journal);
+    }
+    if (copy_engine == ENGINE_ZEROCOPY && !session.sparse && !hash_output)
+    {
+        print_colored("\033[1;34m", "Kernel-side transfer used %s\n", session.zerocopy_splice ? "splice() through a pipe" : "copy_file_range()");
+    }
+
+    if (stats != NULL)
+    {
+        *stats = session.stats;
+    }
+    return durable_rate(&session.stats);
+}
+
+/**
+ * @brief Error-tolerant copy of a failing source (--rescue), in the spirit of GNU ddrescue.
+ *
+ * The rescue map, kept next to the image as <image>.map in the ddrescue mapfile format, splits
+ * the source into areas: '?' not tried yet, '*' failed as part of a block read, '-' sectors that
+ * stayed unreadable (zero in the image) and '+' copied. Its header records the pass and position
+ * to continue from, so an interrupted rescue picks up where it stopped. The map is rewritten
+ * atomically after an fdatasync of the image, like the progress journal.
+ */
+struct rescue_area
+{
+    uint64_t pos;
+    uint64_t size;
+    char status;
+};
+
+struct rescue_copy
+{
+    struct copy_session session;
+    char map_path[MAX_PATH];
+    struct rescue_area *areas;
+    size_t num_areas;
+    size_t capacity;
+    char current_status;
+    int current_pass;
+    uint64_t current_pos;
+    char *buffer;
+    char *zeros;
+    size_t sector_size;
+    uint64_t min_skip;
+    uint64_t max_skip;
+    uint64_t read_errors;
+    double start;
+    double committed;
+    double sync_seconds;
+};
+
+/**
+ * @brief Returns the index of the area containing offset (which must be below the source size).
+ */
+size_t rescue_find(const struct rescue_copy *copy, uint64_t offset)
+{
+    size_t low = 0;
+    size_t high = copy->num_areas;
+    while (high - low > 1)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (copy->areas[middle].pos <= offset)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void rescue_reserve(struct rescue_copy *copy, size_t count)
+{
+    if (copy->num_areas + count <= copy->capacity)
+    {
+        return;
+    }
+    copy->capacity = copy->capacity ? copy->capacity * 2 : 64;
+    copy->areas = realloc(copy->areas, copy->capacity * sizeof(*copy->areas));
+    if (copy->areas == NULL)
+    {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void rescue_remove(struct rescue_copy *copy, size_t index, size_t count)
+{
+    memmove(&copy->areas[index], &copy->areas[index + count], (copy->num_areas - index - count) * sizeof(*copy->areas));
+    copy->num_areas -= count;
+}
+
+/**
+ * @brief Makes offset the start of an area and returns its index (num_areas at the end).
+ */
+size_t rescue_split(struct rescue_copy *copy, uint64_t offset)
+{
+    if (copy->num_areas == 0 || offset >= copy->session.source_size)
+    {
+        return copy->num_areas;
+    }
+    size_t index = rescue_find(copy, offset);
+    if (copy->areas[index].pos == offset)
+    {
+        return index;
+    }
+    rescue_reserve(copy, 1);
+    struct rescue_area *area = &copy->areas[index];
+    memmove(area + 2, area + 1, (copy->num_areas - index - 1) * sizeof(*area));
+    area[1] = (struct rescue_area){offset, area->pos + area->size - offset, area->status};
+    area->size = offset - area->pos;
+    copy->num_areas++;
+    return index + 1;
+}
+
+/**
+ * @brief Gives [pos, pos + size) the status and merges it with equal neighbours.
+ */
+void rescue_mark(struct rescue_copy *copy, uint64_t pos, uint64_t size, char status)
+{
+    size_t first = rescue_split(copy, pos);
+    size_t last = rescue_split(copy, pos + size);
+    copy->areas[first] = (struct rescue_area){pos, size, status};
+    rescue_remove(copy, first + 1, last - first - 1);
+    if (first + 1 < copy->num_areas && copy->areas[first + 1].status == status)
+    {
+        copy->areas[first].size += copy->areas[first + 1].size;
+        rescue_remove(copy, first + 1, 1);
+    }
+    if (first > 0 && copy->areas[first - 1].status == status)
+    {
+        copy->areas[first - 1].size += copy->areas[first].size;
+        rescue_remove(copy, first, 1);
+    }
+}
+
+void rescue_append(struct rescue_copy *copy, uint64_t pos, uint64_t size, char status)
+{
+    if (copy->num_areas > 0 && copy->areas[copy->num_areas - 1].status == status)
+    {
+        copy->areas[copy->num_areas - 1].size += size;
+        return;
+    }
+    rescue_reserve(copy, 1);
+    copy->areas[copy->num_areas++] = (struct rescue_area){pos, size, status};
+}
+
+uint64_t rescue_bytes(const struct rescue_copy *copy, char status, size_t *num_areas)
+{
+    uint64_t bytes = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < copy->num_areas; ++i)
+    {
+        if (copy->areas[i].status == status)
+        {
+            bytes += copy->areas[i].size;
+            ++count;
+        }
+    }
+    if (num_areas != NULL)
+    {
+        *num_areas = count;
+    }
+    return bytes;
+}
+
+/**
+ * @brief Loads the map of an earlier rescue of the same-sized source; returns 1 if it was
+ * usable. ddrescue's non-scraped areas ('/') are treated like non-trimmed ones ('*').
+ */
+int load_rescue_map(struct rescue_copy *copy)
+{
+    FILE *file = fopen(copy->map_path, "r");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    char line[256];
+    int header = 0;
+    int valid = 1;
+    uint64_t end = 0;
+    while (valid && fgets(line, sizeof(line), file) != NULL)
+    {
+        long long pos = 0;
+        long long size = 0;
+        char status = 0;
+        int pass = 1;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+        {
+            continue;
+        }
+        if (!header)
+        {
+            valid = sscanf(line, "%lli %c %d", &pos, &status, &pass) >= 2 && strchr("?*/-+", status) != NULL && pos >= 0 && pass >= 1;
+            copy->current_pos = pos;
+            copy->current_status = status == '*' ? '/' : status;
+            copy->current_pass = pass;
+            header = 1;
+            continue;
+        }
+        valid = sscanf(line, "%lli %lli %c", &pos, &size, &status) == 3 && (uint64_t)pos == end && size > 0 && strchr("?*/-+", status) != NULL;
+        rescue_append(copy, pos, size, status == '/' ? '*' : status);
+        end += size;
+    }
+    fclose(file);
+    if (!header || !valid || end != copy->session.source_size || copy->current_pos > end)
+    {
+        print_colored("\033[1;33m", "Warning: %s does not describe %s, starting over.\n", copy->map_path, copy->session.source_path);
+        copy->num_areas = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Makes the image stable (fdatasync), then atomically replaces the map with the current state.
+ */
+void commit_rescue_map(struct rescue_copy *copy)
+{
+    double start = monotonic_seconds();
+    if (fdatasync(copy->session.target_fd) != 0 && errno != EINVAL)
+    {
+        fprintf(stderr, "\nError: fdatasync on %s failed: %s\n", copy->session.target_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    char temporary[MAX_PATH + 8];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", copy->map_path);
+    FILE *file = fopen(temporary, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "\nError: Could not write %s: %s\n", temporary, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fprintf(file, "# Rescue map of %s written by dddarth (GNU ddrescue mapfile format)\n# Image: %s\n", copy->session.source_path,
+            copy->session.target_path);
+    fprintf(file, "# current_pos  current_status  current_pass\n0x%08llX     %c               %d\n#      pos        size  status\n",
+            (unsigned long long)copy->current_pos, copy->current_status, copy->current_pass);
+    for (size_t i = 0; i < copy->num_areas; ++i)
+    {
+        fprintf(file, "0x%08llX  0x%08llX  %c\n", (unsigned long long)copy->areas[i].pos, (unsigned long long)copy->areas[i].size, copy->areas[i].status);
+    }
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0 || fclose(file) != 0 || rename(temporary, copy->map_path) != 0)
+    {
+        fprintf(stderr, "\nError: Could not update %s: %s\n", copy->map_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    sync_parent_directory(copy->map_path);
+    copy->committed = monotonic_seconds();
+    copy->sync_seconds += copy->committed - start;
+}
+
+void report_rescue_progress(struct rescue_copy *copy, int final)
+{
+    struct copy_session *session = &copy->session;
+    double now = monotonic_seconds();
+    if (!final && now - session->last_progress < 1.0)
+    {
+        return;
+    }
+    session->last_progress = now;
+    size_t bad_areas = 0;
+    uint64_t bad = rescue_bytes(copy, '-', &bad_areas);
+    uint64_t rescued = rescue_bytes(copy, '+', NULL);
+    fprintf(stderr, "\r%llu bytes (%.1f MB) rescued, %llu read errors, %llu bytes unreadable in %zu area(s), %.0f s%s", (unsigned long long)rescued,
+            rescued / 1e6, (unsigned long long)copy->read_errors, (unsigned long long)bad, bad_areas, now - copy->start, final ? "\n" : "");
+    if (now - copy->committed >= RESCUE_COMMIT_SECONDS)
+    {
+        commit_rescue_map(copy);
+    }
+}
+
+void rescue_write(struct rescue_copy *copy, const void *data, uint64_t pos, size_t length)
+{
+    struct copy_session *session = &copy->session;
+    if (skip_zero_block(session, data, length))
+    {
+        return;
+    }
+    double start = monotonic_seconds();
+    if (write_fully(session->target_fd, data, length, pos) < 0)
+    {
+        count_io_error(session);
+        fprintf(stderr, "\nError: Could not write %s at byte %llu: %s\n", session->target_path, (unsigned long long)pos, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    double end = monotonic_seconds();
+    session->stats.write_seconds += end - start;
+    record_latency(session, 1, start, end);
+}
+
+/**
+ * @brief Reads [pos, pos + length) of the source and writes it to the image; returns 0 and
+ * marks the range copied on success, -1 if the read failed or came back short.
+ */
+int rescue_transfer(struct rescue_copy *copy, uint64_t pos, size_t length)
+{
+    struct copy_session *session = &copy->session;
+    // O_DIRECT needs whole sectors, so the unaligned end of an image file is read rounded up.
+    size_t request = (length + copy->sector_size - 1) / copy->sector_size * copy->sector_size;
+    if (request > session->block_size)
+    {
+        request = length;
+    }
+    throttle_io(session, request);
+    double start = monotonic_seconds();
+    ssize_t got = read_fully(session->source_fd, copy->buffer, request, pos);
+    double end = monotonic_seconds();
+    session->stats.read_seconds += end - start;
+    if (got < (ssize_t)length)
+    {
+        count_io_error(session);
+        copy->read_errors++;
+        return -1;
+    }
+    record_latency(session, 0, start, end);
+    rescue_write(copy, copy->buffer, pos, length);
+    rescue_mark(copy, pos, length, '+');
+    session->stats.bytes_copied += length;
+    return 0;
+}
+
+/**
+ * @brief One copying pass in block_size reads over the areas not tried yet, starting at cursor.
+ *
+ * A failed read marks its block '*'. When skipping, the pass then jumps over a window that
+ * doubles with every consecutive error (64 KiB up to 1 GiB or 1% of the source) and shrinks
+ * back after the next good read, so the healthy part of the source is copied at full speed
+ * before any time is spent near the damage. Pass 1 runs forwards, pass 2 backwards to approach
+ * each damaged region from its other side, and pass 3 forwards without skipping.
+ */
+void rescue_copy_pass(struct rescue_copy *copy, int pass, uint64_t cursor)
+{
+    int backwards = pass == 2;
+    int skipping = pass < 3;
+    uint64_t skip = copy->min_skip;
+    copy->current_status = '?';
+    copy->current_pass = pass;
+    for (;;)
+    {
+        struct rescue_area *area = NULL;
+        if (backwards)
+        {
+            size_t i = cursor > 0 ? rescue_find(copy, cursor - 1) + 1 : 0;
+            while (i > 0 && copy->areas[i - 1].status != '?')
+            {
+                --i;
+            }
+            area = i > 0 ? &copy->areas[i - 1] : NULL;
+        }
+        else
+        {
+            size_t i = cursor < copy->session.source_size ? rescue_find(copy, cursor) : copy->num_areas;
+            while (i < copy->num_areas && copy->areas[i].status != '?')
+            {
+                ++i;
+            }
+            area = i < copy->num_areas ? &copy->areas[i] : NULL;
+        }
+        if (area == NULL)
+        {
+            break;
+        }
+
+        uint64_t pos;
+        uint64_t end;
+        if (backwards)
+        {
+            // Reads stay on the block grid so that they remain sector aligned.
+            end = cursor < area->pos + area->size ? cursor : area->pos + area->size;
+            pos = (end - 1) / copy->session.block_size * copy->session.block_size;
+            pos = pos > area->pos ? pos : area->pos;
+        }
+        else
+        {
+            pos = cursor > area->pos ? cursor : area->pos;
+            end = area->pos + area->size - pos < copy->session.block_size ? area->pos + area->size : pos + copy->session.block_size;
+        }
+        copy->current_pos = pos;
+        if (rescue_transfer(copy, pos, end - pos) == 0)
+        {
+            skip = copy->min_skip;
+            cursor = backwards ? pos : end;
+        }
+        else
+        {
+            rescue_mark(copy, pos, end - pos, '*');
+            cursor = backwards ? pos : end;
+            if (skipping)
+            {
+                cursor = backwards ? (cursor > skip ? cursor - skip : 0) : cursor + skip;
+                skip = skip * 2 < copy->max_skip ? skip * 2 : copy->max_skip;
+            }
+        }
+        report_rescue_progress(copy, 0);
+    }
+}
+
+/**
+ * @brief Goes over the areas of one status sector by sector from cursor. Scraping ('*', shown
+ * as '/' in the map header) zero-fills every sector that fails and marks it '-'; a retry pass
+ * ('-') only has to overwrite the zeros of the sectors that now read back.
+ */
+void rescue_sector_pass(struct rescue_copy *copy, char status, int pass, uint64_t cursor)
+{
+    copy->current_status = status == '*' ? '/' : status;
+    copy->current_pass = pass;
+    for (;;)
+    {
+        size_t i = cursor < copy->session.source_size ? rescue_find(copy, cursor) : copy->num_areas;
+        while (i < copy->num_areas && copy->areas[i].status != status)
+        {
+            ++i;
+        }
+        if (i == copy->num_areas)
+        {
+            break;
+        }
+        struct rescue_area *area = &copy->areas[i];
+        uint64_t pos = cursor > area->pos ? cursor : area->pos;
+        size_t length = area->pos + area->size - pos < copy->sector_size ? area->pos + area->size - pos : copy->sector_size;
+        copy->current_pos = pos;
+        if (status == '-')
+        {
+            count_io_retry(&copy->session);
+        }
+        if (rescue_transfer(copy, pos, length) != 0 && status == '*')
+        {
+            rescue_write(copy, copy->zeros, pos, length);
+            rescue_mark(copy, pos, length, '-');
+        }
+        cursor = pos + length;
+        report_rescue_progress(copy, 0);
+    }
+}
+
+/**
+ * @brief Rescues source_path into target_path: three copying passes over the readable areas,
+ * then sector-sized reads of the failed blocks and rescue_retries retries of the sectors that
+ * stayed bad. Continues from <target>.map when it describes the same source.
+ *
+ * @return The durable transfer rate in MB/s; stats->bytes_unreadable is what is left zero-filled.
+ */
+double rescue_copy(const char *source_path, const char *target_path, size_t block_size, struct copy_stats *stats)
+{
+    struct rescue_copy copy;
+    memset(&copy, 0, sizeof(copy));
+    snprintf(copy.map_path, sizeof(copy.map_path), "%s.map", target_path);
+    struct stat st;
+    int image_exists = stat(target_path, &st) == 0;
+    struct copy_session *session = &copy.session;
+    open_copy_session(session, source_path, target_path, block_size, 0);
+    int resumed = image_exists && load_rescue_map(&copy);
+    if (!resumed)
+    {
+        if (ftruncate(session->target_fd, 0) != 0 && errno != EINVAL)
+        {
+            fprintf(stderr, "Error: Could not truncate %s: %s\n", target_path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        rescue_append(&copy, 0, session->source_size, '?');
+        copy.current_status = '?';
+        copy.current_pass = 1;
+    }
+    // Readahead would drag the sectors around a bad one into every failing request.
+    posix_fadvise(session->source_fd, 0, 0, POSIX_FADV_RANDOM);
+    // Unread areas of a regular image read back as zeros; on a device they are zero-filled.
+    if (fstat(session->target_fd, &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size < session->source_size &&
+        ftruncate(session->target_fd, session->source_size) != 0)
+    {
+        fprintf(stderr, "Error: Could not extend %s to %llu bytes: %s\n", target_path, (unsigned long long)session->source_size, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    int logical = 0;
+    copy.sector_size = ioctl(session->source_fd, BLKSSZGET, &logical) == 0 && logical > 0 ? (size_t)logical : use_direct_io ? IO_ALIGNMENT : 512;
+    if (session->block_size < copy.sector_size)
+    {
+        session->block_size = copy.sector_size;
+    }
+    copy.min_skip = RESCUE_MIN_SKIP > session->block_size ? RESCUE_MIN_SKIP : session->block_size;
+    copy.max_skip = session->source_size / 100 / copy.sector_size * copy.sector_size;
+    copy.max_skip = copy.max_skip > RESCUE_MAX_SKIP ? RESCUE_MAX_SKIP : copy.max_skip < copy.min_skip ? copy.min_skip : copy.max_skip;
+    copy.buffer = allocate_io_buffer(session->block_size);
+    copy.zeros = allocate_io_buffer(copy.sector_size);
+    memset(copy.zeros, 0, copy.sector_size);
+
+    // Phases 0-2 are the copying passes, 3 scrapes the failed blocks, 4 and up are the retries.
+    // A finished map gets another round of retries.
+    int first_phase = 4;
+    if (copy.current_status == '?')
+    {
+        first_phase = copy.current_pass < 3 ? copy.current_pass - 1 : 2;
+    }
+    else if (copy.current_status == '/')
+    {
+        first_phase = 3;
+    }
+    else if (copy.current_status == '-')
+    {
+        first_phase = 3 + copy.current_pass;
+    }
+    if (resumed)
+    {
+        size_t bad_areas = 0;
+        uint64_t bad = rescue_bytes(&copy, '-', &bad_areas);
+        print_colored("\033[1;33m", "Continuing the rescue from %s: %llu bytes rescued, %llu bytes unreadable in %zu area(s)\n", copy.map_path,
+                      (unsigned long long)rescue_bytes(&copy, '+', NULL), (unsigned long long)bad, bad_areas);
+        if (copy.current_status == '+')
+        {
+            copy.current_pos = 0;
+        }
+        else if (first_phase == 1)
+        {
+            // The backwards pass had not finished the block that starts at current_pos.
+            copy.current_pos = session->source_size - copy.current_pos < session->block_size ? session->source_size : copy.current_pos + session->block_size;
+        }
+    }
+
+    struct io_metrics *metrics = start_io_metrics(session);
+    metrics->expected_bytes = session->source_size - rescue_bytes(&copy, '+', NULL);
+    copy.start = monotonic_seconds();
+    copy.committed = copy.start;
+    commit_rescue_map(&copy);
+    static const char *phase_names[] = {"Copying (forwards, skipping errors)", "Copying (backwards, skipping errors)", "Copying (forwards)",
+                                        "Scraping failed blocks sector by sector"};
+    for (int phase = first_phase; phase < 4 + (int)rescue_retries; ++phase)
+    {
+        int continuing = resumed && phase == first_phase;
+        char status = phase < 3 ? '?' : phase == 3 ? '*' : '-';
+        size_t num_areas = 0;
+        uint64_t bytes = rescue_bytes(&copy, status, &num_areas);
+        if (bytes == 0)
+        {
+            continue;
+        }
+        if (phase < 4)
+        {
+            print_colored("\033[1;32m", "\n%s: %llu bytes in %zu area(s)\n", phase_names[phase], (unsigned long long)bytes, num_areas);
+        }
+        else
+        {
+            print_colored("\033[1;32m", "\nRetry %d of %u: %llu unreadable bytes in %zu area(s)\n", phase - 3, rescue_retries, (unsigned long long)bytes, num_areas);
+        }
+        if (phase < 3)
+        {
+            rescue_copy_pass(&copy, phase + 1, continuing ? copy.current_pos : phase == 1 ? session->source_size : 0);
+        }
+        else
+        {
+            rescue_sector_pass(&copy, status, phase < 4 ? 1 : phase - 3, continuing ? copy.current_pos : 0);
+        }
+        commit_rescue_map(&copy);
+    }
+    copy.current_status = '+';
+    copy.current_pass = 1;
+    copy.current_pos = 0;
+    stop_io_metrics(metrics);
+    session->stats.elapsed_seconds = monotonic_seconds() - copy.start;
+    commit_rescue_map(&copy);
+    report_rescue_progress(&copy, 1);
+
+    size_t bad_areas = 0;
+    session->stats.bytes_unreadable = rescue_bytes(&copy, '-', &bad_areas);
+    if (hash_image)
+    {
+        attach_image_hasher(session, session->source_size);
+        hash_resumed_prefix(session, session->source_size);
+        finish_image_hasher(session->hasher, session->source_size);
+        session->hasher = NULL;
+    }
+    flush_copy_session(session);
+    close_copy_session(session);
+    if (session->stats.bytes_unreadable > 0)
+    {
+        print_colored("\033[1;31m", "%llu bytes in %zu area(s) could not be read and are zero in %s; see %s\n",
+                      (unsigned long long)session->stats.bytes_unreadable, bad_areas, target_path, copy.map_path);
+    }
+    else
+    {
+        print_colored("\033[1;32m", "Every sector of %s was rescued; the map is kept in %s\n", source_path, copy.map_path);
+    }
+    print_colored("\033[1;35m", "Map: %.2f s spent making progress durable, %llu read errors in this run\n", copy.sync_seconds,
+                  (unsigned long long)copy.read_errors);
+    free(copy.buffer);
+    free(copy.zeros);
+    free(copy.areas);
+
+    if (stats != NULL)
+    {
+        *stats = session->stats;
+    }
+    return durable_rate(&session->stats);
+}
+
+void format_size(uint64_t bytes, char *buffer, size_t buffer_size)
+{
+    if (bytes >= 1024ULL * 1024 * 1024 && bytes % (1024ULL * 1024 * 1024) == 0)
+    {
+        snprintf(buffer, buffer_size, "%lluG", (unsigned long long)(bytes >> 30));
+    }
+    else if (bytes >= 1024 * 1024 && bytes % (1024 * 1024) == 0)
+    {
+        snprintf(buffer, buffer_size, "%lluM", (unsigned long long)(bytes >> 20));
+    }
+    else if (bytes >= 1024 && bytes % 1024 == 0)
+    {
+        snprintf(buffer, buffer_size, "%lluk", (unsigned long long)(bytes >> 10));
+    }
+    else
+    {
+        snprintf(buffer, buffer_size, "%llu", (unsigned long long)bytes);
+    }
+}
+
+/**
+ * @brief fdatasync()s a file that another process wrote, drops it from the page cache and
+ * returns how long the flush took.
+ */
+double flush_file(const char *path)
+{
+    double start = monotonic_seconds();
+    int fd = open(path, O_WRONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    fdatasync(fd);
+    double seconds = monotonic_seconds() - start;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return seconds;
+}
+
+/**
+ * @brief Runs an external `dd` process for one benchmark transfer and scrapes its transfer rate.
+ *
+ * @param block_size The block size passed to `dd` (e.g., "4M").
+ * @param length Number of bytes to copy (rounded down to whole blocks).
+ * @param output_file_path The image file `dd` writes to.
+ * @param time_str Timestamp used to name the saved `dd` output in RESULT_DIR.
+ * @return The durable (or with --rank-by buffered, the reported) transfer rate in MB/s.
+ */
+double run_dd_process(const char *block_size, uint64_t length, const char *output_file_path, const char *time_str)
+{
+    struct stat st;
+    size_t block_size_bytes = parse_size(block_size);
+    size_t count = length / block_size_bytes;
+
+    char dd_command[MAX_PATH * 2];
+    snprintf(dd_command, sizeof(dd_command), "sudo env LC_ALL=C dd if=%s of=%s bs=%s count=%zu%s%s status=progress 2>&1", input_file, output_file_path, block_size, count,
+             use_direct_io ? " iflag=direct oflag=direct" : "", sparse_output ? " conv=sparse" : "");
+
+    print_colored("\033[1;34m", "Executing: %s\n", dd_command);
+
+    evict_page_cache(input_file, length);
+    double start = monotonic_seconds();
+    FILE *fp = popen(dd_command, "r");
+    if (fp == NULL)
+    {
+        perror("popen");
+        exit(EXIT_FAILURE);
+    }
+
+    char dd_output[20480];
+    FILE *result_file = NULL;
+    char result_file_path[MAX_PATH];
+    snprintf(result_file_path, sizeof(result_file_path), "%s/dd_output_%s_%s.txt", RESULT_DIR, block_size, time_str);
+
+    if (stat(RESULT_DIR, &st) == -1)
+    {
+        if (mkdir(RESULT_DIR, 0777) != 0)
+        { // Ensuring directory is accessible by everyone
+            perror("mkdir");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    result_file = fopen(result_file_path, "w");
+    if (result_file == NULL)
+    {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t dd_output_size;
+    while ((dd_output_size = fread(dd_output, sizeof(char), sizeof(dd_output) - 1, fp)) > 0)
+    {
+        dd_output[dd_output_size] = '\0';
+        fprintf(result_file, "%s", dd_output);
+    }
+
+    fclose(result_file);
+    pclose(fp);
+    double process_seconds = monotonic_seconds() - start;
+
+    change_permissions(result_file_path);
+
+    result_file = fopen(result_file_path, "r");
+    if (result_file == NULL)
+    {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    fseek(result_file, 0, SEEK_END);
+    long file_size = ftell(result_file);
+    fseek(result_file, 0, SEEK_SET);
+
+    char *file_contents = (char *)malloc(file_size + 1);
+    if (file_contents == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    fread(file_contents, 1, file_size, result_file);
+    file_contents[file_size] = '\0';
+    fclose(result_file);
+
+    double transfer_rate_value = parse_transfer_rate(file_contents);
+    free(file_contents);
+
+    // dd returns once the page cache took the data; flush it ourselves to time the durable part.
+    memset(&last_bench_stats, 0, sizeof(last_bench_stats));
+    last_bench_stats.bytes_copied = (uint64_t)count * block_size_bytes;
+    last_bench_stats.elapsed_seconds = transfer_rate_value > 0 ? last_bench_stats.bytes_copied / (transfer_rate_value * 1e6) : process_seconds;
+    last_bench_stats.flush_seconds = flush_file(output_file_path);
+
+    result_file = fopen(result_file_path, "a");
+    if (result_file != NULL)
+    {
+        fprintf(result_file, "fdatasync %.6f s, buffered %.2f MB/s, durable %.2f MB/s\n", last_bench_stats.flush_seconds, buffered_rate(&last_bench_stats),
+                durable_rate(&last_bench_stats));
+        fclose(result_file);
+    }
+
+    // dd reports no per-request timings, so its result carries totals only.
+    snprintf(result_file_path, sizeof(result_file_path), "%s/dd_output_%s_%s.json", RESULT_DIR, block_size, time_str);
+    write_copy_result_json(result_file_path, input_file, output_file_path, block_size, &last_bench_stats, NULL);
+    change_permissions(result_file_path);
+    return bench_rank_buffered ? buffered_rate(&last_bench_stats) : durable_rate(&last_bench_stats);
+}
+
+
+/**
+ * @brief Runs one benchmark transfer with the in-process engine.
+ *
+ * Copies the same number of whole blocks `dd` would (length / block_size), records the exact
+ * byte count and elapsed time in RESULT_DIR, and removes the benchmark image afterwards so the
+ * sweep does not fill the target before the real copy.
+ *
+ * @return The measured transfer rate in MB/s.
+ */
+double run_engine_benchmark(const char *block_size, uint64_t length, const char *output_file_path, const char *time_str)
+{
+    size_t block_size_bytes = parse_size(block_size);
+    length = length / block_size_bytes * block_size_bytes;
+
+    print_colored("\033[1;34m", "Copying %zu bytes from %s to %s with the %s engine%s\n", (size_t)length, input_file, output_file_path,
+                  copy_engine_names[copy_engine], use_direct_io ? " (O_DIRECT)" : "");
+
+    evict_page_cache(input_file, length);
+    struct copy_stats stats;
+    engine_copy(input_file, output_file_path, block_size_bytes, length, 0, 0, 0, &stats);
+    unlink(output_file_path);
+    last_bench_stats = stats;
+    double transfer_rate_value = bench_rank_buffered ? buffered_rate(&stats) : durable_rate(&stats);
+
+    char result_file_path[MAX_PATH];
+    snprintf(result_file_path, sizeof(result_file_path), "%s/%s_output_%s_%s.txt", RESULT_DIR, copy_engine_names[copy_engine], block_size, time_str);
+    FILE *result_file = fopen(result_file_path, "w");
+    if (result_file == NULL)
+    {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(result_file, "%llu bytes copied, %.6f s, %.2f MB/s\n", (unsigned long long)stats.bytes_copied, stats.elapsed_seconds + stats.flush_seconds,
+            transfer_rate_value);
+    fprintf(result_file, "open %.6f s, read %.6f s, write %.6f s, fdatasync %.6f s, buffered %.2f MB/s, durable %.2f MB/s\n", stats.open_seconds,
+            stats.read_seconds, stats.write_seconds, stats.flush_seconds, buffered_rate(&stats), durable_rate(&stats));
+    if (sparse_output)
+    {
+        fprintf(result_file, "%llu zero bytes skipped\n", (unsigned long long)stats.bytes_skipped);
+    }
+    if (copy_engine == ENGINE_PIPELINE)
+    {
+        fprintf(result_file, "reader stalled %.6f s, writer stalled %.6f s\n", stats.reader_stall_seconds, stats.writer_stall_seconds);
+    }
+    fclose(result_file);
+    change_permissions(result_file_path);
+
+    snprintf(result_file_path, sizeof(result_file_path), "%s/%s_output_%s_%s.json", RESULT_DIR, copy_engine_names[copy_engine], block_size, time_str);
+    write_copy_result_json(result_file_path, input_file, output_file_path, block_size, &stats, last_io_metrics);
+    change_permissions(result_file_path);
+
+    return transfer_rate_value;
+}
+
+void print_phase_timings(const struct copy_stats *stats)
+{
+    if (stats->read_seconds > 0 || stats->write_seconds > 0)
+    {
+        print_colored("\033[1;37m", "  open %.3f s, read %.3f s, write %.3f s, fdatasync %.3f s\n", stats->open_seconds, stats->read_seconds,
+                      stats->write_seconds, stats->flush_seconds);
+    }
+    else
+    {
+        print_colored("\033[1;37m", "  open %.3f s, read+write %.3f s (overlapped), fdatasync %.3f s\n", stats->open_seconds, stats->elapsed_seconds,
+                      stats->flush_seconds);
+    }
+}
+
+/**
+ * @brief Runs one benchmark transfer and measures the transfer rate (durable unless --rank-by buffered).
+ *
+ * This function copies length bytes from the input file to an output file on the mounted target
+ * with the specified block size, using either the in-process engine or an external `dd`
+ * (see --engine).
+ *
+ * @param block_size The block size to be used for the transfer. It should be a string representing the size (e.g., "4M").
+ * @param length Number of bytes to copy (copy_size for a full benchmark run).
+ * @return The measured transfer rate in MB/s.
+ */
+double run_dd(const char *block_size, uint64_t length)
+{
+    char timestamp[32];
+    time_t now = time(NULL);
+    snprintf(timestamp, sizeof(timestamp), "%ld", now);
+
+    // Get human-readable date and time
+    char time_str[64];
+    struct tm *time_info = localtime(&now);
+    strftime(time_str, sizeof(time_str), "%Y%m%d_%H%M%S", time_info);
+
+    // Append date and time to the file name
+    char length_str[16];
+    format_size(length, length_str, sizeof(length_str));
+    char output_file_path[MAX_PATH];
+    snprintf(output_file_path, sizeof(output_file_path), "%s/%s_%s_%s_%s.dd", MOUNT_POINT, length_str, block_size, time_str, timestamp);
+
+    ensure_mount_point_exists(MOUNT_POINT); // Ensure the mount point exists
+
+    struct stat st;
+    if (stat(MOUNT_POINT, &st) == -1)
+    {
+        fprintf(stderr, "Error: Mount point %s does not exist.\n", MOUNT_POINT);
+        exit(EXIT_FAILURE);
+    }
+    if (stat(RESULT_DIR, &st) == -1)
+    {
+        if (mkdir(RESULT_DIR, 0777) != 0)
+        {
+            perror("mkdir");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (copy_engine == ENGINE_URING)
+    {
+        print_colored("\033[1;33m", "Running %s with block size %s and queue depth %u...\n", copy_engine_names[copy_engine], block_size, queue_depth);
+    }
+    else if (copy_engine == ENGINE_STRIPED)
+    {
+        print_colored("\033[1;33m", "Running %s with block size %s and %u threads...\n", copy_engine_names[copy_engine], block_size, copy_threads);
+    }
+    else if (copy_engine == ENGINE_PIPELINE)
+    {
+        print_colored("\033[1;33m", "Running %s with block size %s and %u ring buffers...\n", copy_engine_names[copy_engine], block_size, queue_depth);
+    }
+    else if (copy_engine == ENGINE_ZEROCOPY)
+    {
+        print_colored("\033[1;33m", "Running %s with %s per kernel transfer...\n", copy_engine_names[copy_engine], block_size);
+    }
+    else
+    {
+        print_colored("\033[1;33m", "Running %s with block size %s...\n", copy_engine_names[copy_engine], block_size);
+    }
+
+    double transfer_rate_value;
+    if (copy_engine == ENGINE_DD)
+    {
+        transfer_rate_value = run_dd_process(block_size, length, output_file_path, time_str);
+    }
+    else
+    {
+        transfer_rate_value = run_engine_benchmark(block_size, length, output_file_path, time_str);
+    }
+
+    print_colored("\033[1;37m", "Transfer rate with block size %s: \033[1;35m%.2f MB/s\033[1;37m (buffered %.2f MB/s, durable %.2f MB/s)\n", block_size,
+                  transfer_rate_value, buffered_rate(&last_bench_stats), durable_rate(&last_bench_stats));
+    print_phase_timings(&last_bench_stats);
+    return transfer_rate_value;
+}
+
+int engine_uses_queue_depth(enum copy_engine_type engine)
+{
+    return engine == ENGINE_URING || engine == ENGINE_PIPELINE;
+}
+
+/**
+ * @brief Copies the whole source while hill-climbing over block size (and queue depth) per window.
+ *
+ * The copy starts immediately with the current settings. Every adapt_window_bytes the measured
+ * throughput decides the next step: windows alternate between re-measuring the current settings
+ * and probing one neighbour (block size or queue depth doubled or halved), and a probe is kept only
+ * if it beats the window right before it by more than ADAPT_MIN_GAIN. Comparing against the
+ * preceding window rather than an old baseline keeps decisions valid while the device slows down
+ * (SLC cache exhaustion, thermal throttling). When no neighbour helps the tuner settles for
+ * ADAPT_SETTLE_WINDOWS windows and then probes again. A step that would put more than
+ADAPT_MAX_IN_FLIGHT bytes of buffers in flight (block size x queue depth) is never probed; the
+tuner climbs the other way instead. Every decision is logged.
+ */
+double adaptive_copy(const char *source_path, const char *target_path, size_t initial_block_size, struct copy_stats *stats)
+{
+    const double ADAPT_MIN_GAIN = 0.03;
+    const unsigned ADAPT_SETTLE_WINDOWS = 8;
+    const uint64_t ADAPT_MAX_IN_FLIGHT = 256ULL * 1024 * 1024;
+    const size_t min_block = 64 * 1024;
+    const size_t max_block = 64 * 1024 * 1024;
+
+    struct copy_journal journal;
+    uint64_t resume_offset = resume_copy ? open_copy_journal(&journal, source_path, target_path) : 0;
+    struct copy_session session;
+    open_copy_session(&session, source_path, target_path, initial_block_size, resume_offset == 0);
+    session.show_progress = 1;
+    if (resume_offset > 0)
+    {
+        print_colored("\033[1;33m", "Resuming at byte %llu from %s\n", (unsigned long long)resume_offset, journal.path);
+    }
+    if (hash_image)
+    {
+        attach_image_hasher(&session, session.source_size);
+        hash_resumed_prefix(&session, resume_offset);
+    }
+
+    int tune_queue_depth = engine_uses_queue_depth(copy_engine);
+    uint64_t window = (adapt_window_bytes + max_block - 1) / max_block * max_block;
+    uint64_t offset = resume_offset;
+    double start = monotonic_seconds();
+    double reference_rate = 0;
+    size_t saved_block_size = session.block_size;
+    unsigned saved_queue_depth = session.queue_depth;
+    int probing = 0;
+    int dimension = 0; // 0 = block size, 1 = queue depth
+    int direction = 1;
+    unsigned failed_probes = 0;
+    unsigned settle = 0;
+    unsigned window_index = 0;
+    struct io_metrics *metrics = start_io_metrics(&session);
+    metrics->expected_bytes = session.source_size - resume_offset;
+
+    while (offset < session.source_size)
+    {
+        uint64_t before = session.stats.bytes_copied;
+        double window_start = monotonic_seconds();
+        if (copy_session_range(&session, offset, window) != 0)
+        {
+            publish_metrics();
+            fprintf(stderr, "\nError: Copy from %s to %s failed after %llu bytes: %s\n", source_path, target_path,
+                    (unsigned long long)session.stats.bytes_copied, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        uint64_t copied = session.stats.bytes_copied - before;
+        double seconds = monotonic_seconds() - window_start;
+        double rate = seconds > 0 ? copied / seconds / 1e6 : 0;
+        offset += copied;
+        window_index++;
+        if (copied < window)
+        {
+            break;
+        }
+        update_copy_journal(resume_copy ? &journal : NULL, &session, offset);
+
+        char block_str[16];
+        format_size(session.block_size, block_str, sizeof(block_str));
+
+        if (probing)
+        {
+            probing = 0;
+            if (rate > reference_rate * (1 + ADAPT_MIN_GAIN))
+            {
+                fprintf(stderr, "\n");
+                print_colored("\033[1;32m", "Adaptive: window %u keeps bs=%s qd=%u (%.1f MB/s vs %.1f MB/s)\n", window_index, block_str, session.queue_depth, rate, reference_rate);
+                reference_rate = rate;
+                failed_probes = 0;
+                continue;
+            }
+            fprintf(stderr, "\n");
+            print_colored("\033[1;33m", "Adaptive: window %u rejects bs=%s qd=%u (%.1f MB/s vs %.1f MB/s), reverting\n", window_index, block_str, session.queue_depth, rate, reference_rate);
+            session.block_size = saved_block_size;
+            session.queue_depth = saved_queue_depth;
+            direction = -direction;
+            if (++failed_probes % 2 == 0 && tune_queue_depth)
+            {
+                dimension = !dimension;
+            }
+            if (failed_probes >= (tune_queue_depth ? 4u : 2u))
+            {
+                format_size(session.block_size, block_str, sizeof(block_str));
+                print_colored("\033[1;34m", "Adaptive: settled on bs=%s qd=%u for %u windows\n", block_str, session.queue_depth, ADAPT_SETTLE_WINDOWS);
+                settle = ADAPT_SETTLE_WINDOWS;
+                failed_probes = 0;
+            }
+            continue;
+        }
+
+        // This window measured the current settings; it is the reference for the next probe.
+        reference_rate = rate;
+        if (settle > 0)
+        {
+            settle--;
+            continue;
+        }
+
+        saved_block_size = session.block_size;
+        saved_queue_depth = session.queue_depth;
+        if (dimension == 0)
+        {
+            size_t next = direction > 0 ? session.block_size * 2 : session.block_size / 2;
+            uint64_t depth = tune_queue_depth ? session.queue_depth : 1;
+            if (next < min_block || next > max_block || (next > session.block_size && next * depth > ADAPT_MAX_IN_FLIGHT))
+            {
+                direction = -direction;
+                next = direction > 0 ? session.block_size * 2 : session.block_size / 2;
+            }
+            session.block_size = next;
+        }
+        else
+        {
+            unsigned next = direction > 0 ? session.queue_depth * 2 : session.queue_depth / 2;
+            if (next < 1 || next > 256 || (next > session.queue_depth && (uint64_t)session.block_size * next > ADAPT_MAX_IN_FLIGHT))
+            {
+                direction = -direction;
+                next = direction > 0 ? session.queue_depth * 2 : session.queue_depth / 2;
+            }
+            session.queue_depth = next;
+        }
+        probing = 1;
+        format_size(session.block_size, block_str, sizeof(block_str));
+        fprintf(stderr, "\n");
+        print_colored("\033[1;36m", "Adaptive: window %u at %.1f MB/s, probing bs=%s qd=%u\n", window_index, rate, block_str, session.queue_depth);
+    }
+    stop_io_metrics(metrics);
+
+    if (session.hasher != NULL)
+    {
+        finish_image_hasher(session.hasher, offset);
+        session.hasher = NULL;
+    }
+    session.stats.elapsed_seconds = monotonic_seconds() - start;
+    report_copy_progress(&session, start, 1);
+    finish_sparse_target(&session, offset);
+    flush_copy_session(&session);
+    close_copy_session(&session);
+    if (resume_copy)
+    {
+        close_copy_journal(&journal);
+    }
+
+    // Remember where the tuner ended so later steps (systemd unit) start from there.
+    format_size(session.block_size, best_block_size, sizeof(best_block_size));
+    queue_depth = session.queue_depth;
+
+    if (stats != NULL)
+    {
+        *stats = session.stats;
+    }
+    return durable_rate(&session.stats);
+}
+
+/**
+ * @brief One chunk of the hash manifest and whether the image read back differently.
+ */
+struct verify_chunk
+{
+    uint64_t offset;
+    size_t length;
+    char sha256[65];
+    uint64_t xxh64;
+    int mismatch;
+};
+
+struct verify_pass
+{
+    const char *image_path;
+    struct verify_chunk **chunks;
+    size_t num_chunks;
+    size_t next;
+    size_t block_size;
+    int error;
+    uint64_t bytes_read;
+};
+
+/**
+ * @brief Reads <image>.hashes back into memory; returns the chunks (and their size if chunk_size is not NULL) or exits.
+ */
+struct verify_chunk *load_hash_manifest(const char *image_path, size_t *num_chunks, uint64_t *chunk_size)
+{
+    char manifest_path[MAX_PATH + 8];
+    snprintf(manifest_path, sizeof(manifest_path), "%s.hashes", image_path);
+    FILE *manifest = fopen(manifest_path, "r");
+    if (manifest == NULL)
+    {
+        fprintf(stderr, "Error: Cannot verify without the hash manifest %s: %s\n", manifest_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    size_t capacity = 64;
+    struct verify_chunk *chunks = malloc(capacity * sizeof(*chunks));
+    if (chunks == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    *num_chunks = 0;
+
+    char line[256];
+    while (fgets(line, sizeof(line), manifest) != NULL)
+    {
+        unsigned long long index, offset, xxh64;
+        size_t length;
+        char sha256[65];
+        if (chunk_size != NULL && sscanf(line, "# chunk_size: %llu", &offset) == 1)
+        {
+            *chunk_size = offset;
+        }
+        if (line[0] == '#' || sscanf(line, "%llu %llu %zu %64s %llx", &index, &offset, &length, sha256, &xxh64) != 5)
+        {
+            continue;
+        }
+        if (*num_chunks == capacity)
+        {
+            capacity *= 2;
+            chunks = realloc(chunks, capacity * sizeof(*chunks));
+            if (chunks == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        struct verify_chunk *chunk = &chunks[(*num_chunks)++];
+        chunk->offset = offset;
+        chunk->length = length;
+        snprintf(chunk->sha256, sizeof(chunk->sha256), "%s", sha256);
+        chunk->xxh64 = xxh64;
+        chunk->mismatch = 0;
+    }
+    fclose(manifest);
+    return chunks;
+}
+
+void *verify_worker(void *arg)
+{
+    struct verify_pass *pass = arg;
+
+    // Read back cold: O_DIRECT where the filesystem allows it, otherwise evict the image first.
+    int fd = open(pass->image_path, O_RDONLY | O_DIRECT);
+    if (fd < 0)
+    {
+        fd = open(pass->image_path, O_RDONLY);
+    }
+    if (fd < 0)
+    {
+        __atomic_store_n(&pass->error, errno, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    char *buffer = allocate_io_buffer(pass->block_size);
+
+    size_t i;
+    while ((i = __atomic_fetch_add(&pass->next, 1, __ATOMIC_RELAXED)) < pass->num_chunks)
+    {
+        struct verify_chunk *chunk = pass->chunks[i];
+        struct sha256_ctx sha;
+        struct xxh64_ctx xxh;
+        sha256_init(&sha);
+        xxh64_init(&xxh);
+
+        uint64_t done = 0;
+        while (done < chunk->length)
+        {
+            size_t want = chunk->length - done < pass->block_size ? chunk->length - done : pass->block_size;
+            size_t request = (want + IO_ALIGNMENT - 1) / IO_ALIGNMENT * IO_ALIGNMENT;
+            if (request > pass->block_size)
+            {
+                request = want;
+            }
+            ssize_t got = read_fully(fd, buffer, request, chunk->offset + done);
+            if (got < 0 && errno == EINVAL && clear_direct_io_for_tail(fd, request))
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                break;
+            }
+            if ((size_t)got > want)
+            {
+                got = want;
+            }
+            sha256_update(&sha, buffer, got);
+            xxh64_update(&xxh, buffer, got);
+            done += got;
+        }
+        __atomic_fetch_add(&pass->bytes_read, done, __ATOMIC_RELAXED);
+
+        unsigned char digest[32];
+        char hex[65];
+        sha256_final(&sha, digest);
+        format_hex(digest, sizeof(digest), hex);
+        chunk->mismatch = done != chunk->length || strcmp(hex, chunk->sha256) != 0 || xxh64_digest(&xxh) != chunk->xxh64;
+    }
+
+    free(buffer);
+    close(fd);
+    return NULL;
+}
+
+/**
+ * @brief Re-hashes the given chunks of the image with copy_threads readers and marks mismatches.
+ * @return The number of mismatching chunks.
+ */
+size_t run_verify_pass(const char *image_path, struct verify_chunk **chunks, size_t num_chunks)
+{
+    struct verify_pass pass;
+    memset(&pass, 0, sizeof(pass));
+    pass.image_path = image_path;
+    pass.chunks = chunks;
+    pass.num_chunks = num_chunks;
+    pass.block_size = strlen(best_block_size) ? parse_size(best_block_size) : 1024 * 1024;
+
+    evict_page_cache(image_path, 0);
+    unsigned num_threads = copy_threads < num_chunks ? copy_threads : (unsigned)num_chunks;
+    pthread_t *threads = calloc(num_threads ? num_threads : 1, sizeof(pthread_t));
+    if (threads == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    double start = monotonic_seconds();
+    for (unsigned i = 0; i < num_threads; ++i)
+    {
+        if (pthread_create(&threads[i], NULL, verify_worker, &pass) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (unsigned i = 0; i < num_threads; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = monotonic_seconds() - start;
+    free(threads);
+
+    if (pass.error)
+    {
+        fprintf(stderr, "Error: Cannot read %s back: %s\n", image_path, strerror(pass.error));
+        exit(EXIT_FAILURE);
+    }
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < num_chunks; ++i)
+    {
+        mismatches += chunks[i]->mismatch;
+    }
+    print_colored("\033[1;34m", "Verified %zu chunk(s), %.2f GB in %.1f s (%.1f MB/s) with %u thread(s): %zu mismatching\n", num_chunks, pass.bytes_read / 1e9,
+                  seconds, seconds > 0 ? pass.bytes_read / seconds / 1e6 : 0, num_threads, mismatches);
+    return mismatches;
+}
+
+/**
+ * @brief Prints mismatching chunks as merged byte ranges and returns them as a list to re-copy.
+ */
+size_t collect_mismatches(struct verify_chunk *chunks, size_t num_chunks, struct verify_chunk **bad)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < num_chunks; ++i)
+    {
+        if (!chunks[i].mismatch)
+        {
+            continue;
+        }
+        bad[count++] = &chunks[i];
+        size_t j = i;
+        while (j + 1 < num_chunks && chunks[j + 1].mismatch)
+        {
+            bad[count++] = &chunks[++j];
+        }
+        print_colored("\033[1;31m", "Mismatch: bytes %llu-%llu\n", (unsigned long long)chunks[i].offset,
+                      (unsigned long long)(chunks[j].offset + chunks[j].length - 1));
+        i = j;
+    }
+    return count;
+}
+
+/**
+ * @brief Reads the image back after the copy and checks every chunk against the manifest the
+ * copy wrote. Mismatching ranges are copied again from the source and checked once more;
+ * if they still differ the source itself changed or the target is failing, and we exit.
+ */
+void verify_image(const char *source, const char *image_path)
+{
+    size_t num_chunks;
+    struct verify_chunk *chunks = load_hash_manifest(image_path, &num_chunks, NULL);
+    struct verify_chunk **all = malloc((num_chunks ? num_chunks : 1) * sizeof(*all));
+    struct verify_chunk **bad = malloc((num_chunks ? num_chunks : 1) * sizeof(*bad));
+    if (all == NULL || bad == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < num_chunks; ++i)
+    {
+        all[i] = &chunks[i];
+    }
+
+    print_colored("\033[1;33m", "Verifying %s against %s.hashes...\n", image_path, image_path);
+    if (run_verify_pass(image_path, all, num_chunks) == 0)
+    {
+        print_colored("\033[1;32m", "Verification passed: the image matches what was read from %s\n", source);
+        free(bad);
+        free(all);
+        free(chunks);
+        return;
+    }
+
+    size_t num_bad = collect_mismatches(chunks, num_chunks, bad);
+    print_colored("\033[1;33m", "Re-copying %zu chunk(s) from %s...\n", num_bad, source);
+    struct copy_session session;
+    open_copy_session(&session, source, image_path, strlen(best_block_size) ? parse_size(best_block_size) : 1024 * 1024, 0);
+    session.sparse = 0; // the bad data has to be overwritten, zeros included
+    for (size_t i = 0; i < num_bad; ++i)
+    {
+        if (copy_session_range(&session, bad[i]->offset, bad[i]->length) != 0)
+        {
+            fprintf(stderr, "Error: Re-copy of bytes %llu-%llu failed: %s\n", (unsigned long long)bad[i]->offset,
+                    (unsigned long long)(bad[i]->offset + bad[i]->length - 1), strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    flush_copy_session(&session);
+    close_copy_session(&session);
+
+    if (run_verify_pass(image_path, bad, num_bad) != 0)
+    {
+        collect_mismatches(chunks, num_chunks, bad);
+        print_colored("\033[1;31m", "Verification failed: these ranges still differ after a re-copy (source changed or target failing).\n");
+        exit(EXIT_FAILURE);
+    }
+    print_colored("\033[1;32m", "Verification passed after re-copying %zu chunk(s)\n", num_bad);
+    free(bad);
+    free(all);
+    free(chunks);
+}
+
+/**
+ * @brief Parameters of LZ4F_compressFrame(), laid out like LZ4F_preferences_t (frame info flattened).
+ */
+struct lz4f_preferences
+{
+    int block_size_id;
+    int block_mode;
+    int content_checksum;
+    int frame_type;
+    unsigned long long content_size;
+    unsigned dict_id;
+    int block_checksum;
+    int compression_level;
+    unsigned auto_flush;
+    unsigned favor_dec_speed;
+    unsigned reserved[3];
+};
+
+/**
+ * @brief Entry points of libzstd or liblz4, resolved with dlopen() so neither is a build dependency.
+ */
+struct compressor_api
+{
+    void *library;
+    void *(*zstd_create_cctx)(void);
+    size_t (*zstd_free_cctx)(void *cctx);
+    size_t (*zstd_compress_cctx)(void *cctx, void *dst, size_t capacity, const void *src, size_t length, int level);
+    size_t (*zstd_compress_bound)(size_t length);
+    size_t (*zstd_decompress)(void *dst, size_t capacity, const void *src, size_t length);
+    unsigned (*zstd_is_error)(size_t code);
+    const char *(*zstd_error_name)(size_t code);
+    int (*zstd_max_level)(void);
+    size_t (*lz4f_compress_bound)(size_t length, const struct lz4f_preferences *preferences);
+    size_t (*lz4f_compress_frame)(void *dst, size_t capacity, const void *src, size_t length, const struct lz4f_preferences *preferences);
+    unsigned (*lz4f_is_error)(size_t code);
+    const char *(*lz4f_error_name)(size_t code);
+    size_t (*lz4f_create_dctx)(void **dctx, unsigned version);
+    size_t (*lz4f_free_dctx)(void *dctx);
+    size_t (*lz4f_decompress)(void *dctx, void *dst, size_t *dst_length, const void *src, size_t *src_length, const void *options);
+} compressor;
+
+void *load_symbol(const char *library, const char *name)
+{
+    void *symbol = dlsym(compressor.library, name);
+    if (symbol == NULL)
+    {
+        fprintf(stderr, "Error: %s has no %s\n", library, name);
+        exit(EXIT_FAILURE);
+    }
+    return symbol;
+}
+
+/**
+ * @brief Loads the runtime library of the given compressor; exits if it is not installed.
+ */
+void load_compressor(enum compressor_type type)
+{
+    const char *library = type == COMPRESS_ZSTD ? "libzstd.so.1" : "liblz4.so.1";
+    if (compressor.library != NULL)
+    {
+        return;
+    }
+    compressor.library = dlopen(library, RTLD_NOW);
+    if (compressor.library == NULL)
+    {
+        fprintf(stderr, "Error: --compress %s needs %s (%s)\n", compressor_names[type], library, dlerror());
+        exit(EXIT_FAILURE);
+    }
+    if (type == COMPRESS_ZSTD)
+    {
+        *(void **)&compressor.zstd_create_cctx = load_symbol(library, "ZSTD_createCCtx");
+        *(void **)&compressor.zstd_free_cctx = load_symbol(library, "ZSTD_freeCCtx");
+        *(void **)&compressor.zstd_compress_cctx = load_symbol(library, "ZSTD_compressCCtx");
+        *(void **)&compressor.zstd_compress_bound = load_symbol(library, "ZSTD_compressBound");
+        *(void **)&compressor.zstd_decompress = load_symbol(library, "ZSTD_decompress");
+        *(void **)&compressor.zstd_is_error = load_symbol(library, "ZSTD_isError");
+        *(void **)&compressor.zstd_error_name = load_symbol(library, "ZSTD_getErrorName");
+        *(void **)&compressor.zstd_max_level = load_symbol(library, "ZSTD_maxCLevel");
+    }
+    else
+    {
+        *(void **)&compressor.lz4f_compress_bound = load_symbol(library, "LZ4F_compressFrameBound");
+        *(void **)&compressor.lz4f_compress_frame = load_symbol(library, "LZ4F_compressFrame");
+        *(void **)&compressor.lz4f_is_error = load_symbol(library, "LZ4F_isError");
+        *(void **)&compressor.lz4f_error_name = load_symbol(library, "LZ4F_getErrorName");
+        *(void **)&compressor.lz4f_create_dctx = load_symbol(library, "LZ4F_createDecompressionContext");
+        *(void **)&compressor.lz4f_free_dctx = load_symbol(library, "LZ4F_freeDecompressionContext");
+        *(void **)&compressor.lz4f_decompress = load_symbol(library, "LZ4F_decompress");
+    }
+}
+
+int max_compress_level(enum compressor_type type)
+{
+    return type == COMPRESS_ZSTD ? compressor.zstd_max_level() : 12;
+}
+
+size_t compress_bound(enum compressor_type type, size_t length)
+{
+    if (type == COMPRESS_ZSTD)
+    {
+        return compressor.zstd_compress_bound(length);
+    }
+    struct lz4f_preferences preferences = {0};
+    preferences.content_size = length;
+    return compressor.lz4f_compress_bound(length, &preferences);
+}
+
+/**
+ * @brief Compresses one frame into a self-contained zstd or LZ4 frame.
+ * @param context A per-thread zstd context (NULL for lz4).
+ * @return The compressed length, or 0 on error.
+ */
+size_t compress_frame(enum compressor_type type, void *context, void *dst, size_t capacity, const void *src, size_t length, int level)
+{
+    size_t ret;
+    if (type == COMPRESS_ZSTD)
+    {
+        ret = compressor.zstd_compress_cctx(context, dst, capacity, src, length, level);
+        if (compressor.zstd_is_error(ret))
+        {
+            fprintf(stderr, "Error: zstd: %s\n", compressor.zstd_error_name(ret));
+            return 0;
+        }
+        return ret;
+    }
+    struct lz4f_preferences preferences = {0};
+    preferences.content_size = length;
+    preferences.compression_level = level;
+    ret = compressor.lz4f_compress_frame(dst, capacity, src, length, &preferences);
+    if (compressor.lz4f_is_error(ret))
+    {
+        fprintf(stderr, "Error: lz4: %s\n", compressor.lz4f_error_name(ret));
+        return 0;
+    }
+    return ret;
+}
+
+/**
+ * @brief Decompresses one frame that must expand to exactly length bytes; returns 0 on success.
+ */
+int decompress_frame(enum compressor_type type, void *dst, size_t length, const void *src, size_t compressed_length)
+{
+    if (type == COMPRESS_ZSTD)
+    {
+        size_t ret = compressor.zstd_decompress(dst, length, src, compressed_length);
+        return compressor.zstd_is_error(ret) || ret != length ? -1 : 0;
+    }
+    void *dctx;
+    if (compressor.lz4f_is_error(compressor.lz4f_create_dctx(&dctx, 100)))
+    {
+        return -1;
+    }
+    size_t out = length;
+    size_t in = compressed_length;
+    size_t ret = compressor.lz4f_decompress(dctx, dst, &out, src, &in, NULL);
+    compressor.lz4f_free_dctx(dctx);
+    return compressor.lz4f_is_error(ret) || ret != 0 || out != length ? -1 : 0;
+}
+
+unsigned resolve_compress_threads()
+{
+    if (compress_threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        compress_threads = cpus > 0 ? (unsigned)cpus : 1;
+    }
+    return compress_threads;
+}
+
+uint32_t frame_checksum(const void *data, size_t length)
+{
+    struct xxh64_ctx ctx;
+    xxh64_init(&ctx);
+    xxh64_update(&ctx, data, length);
+    return (uint32_t)xxh64_digest(&ctx);
+}
+
+/**
+ * @brief Picks the highest compression level that still keeps up with the copy.
+ *
+ * Reads COMPRESS_SAMPLE bytes from the middle of the source (cold, which also measures the
+ * read rate) and compresses them on one thread at increasing levels. Level L keeps up when
+ * compress_threads x its single-thread rate reaches the rate the rest of the copy can
+ * sustain: min(source read rate, target write rate x compression ratio). The target rate is
+ * the benchmark winner's when there is one, otherwise a timed, flushed write of the sample.
+ */
+int choose_compress_level(const char *source, const char *target_path)
+{
+    static const int zstd_levels[] = {1, 2, 3, 5, 7, 9, 12, 15, 19};
+    static const int lz4_levels[] = {1, 3, 6, 9, 12};
+    const int *levels = compress_output == COMPRESS_ZSTD ? zstd_levels : lz4_levels;
+    size_t num_levels = compress_output == COMPRESS_ZSTD ? sizeof(zstd_levels) / sizeof(zstd_levels[0]) : sizeof(lz4_levels) / sizeof(lz4_levels[0]);
+
+    int fd = open(source, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Could not open %s: %s\n", source, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    uint64_t size = get_device_size(fd);
+    size_t sample_size = size < COMPRESS_SAMPLE ? size : COMPRESS_SAMPLE;
+    uint64_t sample_offset = (size - sample_size) / 2 / IO_ALIGNMENT * IO_ALIGNMENT;
+    char *sample = allocate_io_buffer(sample_size ? sample_size : IO_ALIGNMENT);
+    posix_fadvise(fd, sample_offset, sample_size, POSIX_FADV_DONTNEED);
+    double start = monotonic_seconds();
+    ssize_t got = read_fully(fd, sample, sample_size, sample_offset);
+    double read_seconds = monotonic_seconds() - start;
+    posix_fadvise(fd, sample_offset, sample_size, POSIX_FADV_DONTNEED);
+    close(fd);
+    if (got <= 0)
+    {
+        free(sample);
+        return levels[0];
+    }
+    double read_rate = got / (read_seconds > 0 ? read_seconds : 1e-9);
+
+    double write_rate = best_transfer_rate * 1e6;
+    if (write_rate <= 0)
+    {
+        int target_fd = open(target_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (target_fd >= 0)
+        {
+            start = monotonic_seconds();
+            if (write_fully(target_fd, sample, got, 0) >= 0 && fdatasync(target_fd) == 0)
+            {
+                write_rate = got / (monotonic_seconds() - start);
+            }
+            close(target_fd);
+        }
+        if (write_rate <= 0)
+        {
+            write_rate = read_rate;
+        }
+    }
+
+    unsigned threads = resolve_compress_threads();
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    double parallelism = cpus > 0 && (unsigned)cpus < threads ? (double)cpus : (double)threads;
+    size_t frame = frame_size_bytes < (uint64_t)got ? (size_t)frame_size_bytes : (size_t)got;
+    size_t capacity = compress_bound(compress_output, frame);
+    char *output = malloc(capacity);
+    void *context = compress_output == COMPRESS_ZSTD ? compressor.zstd_create_cctx() : NULL;
+    if (output == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    print_colored("\033[1;34m", "Choosing a %s level: source reads %.1f MB/s, target writes %.1f MB/s, %u compression thread(s)\n",
+                  compressor_names[compress_output], read_rate / 1e6, write_rate / 1e6, threads);
+    int chosen = levels[0];
+    for (size_t i = 0; i < num_levels; ++i)
+    {
+        uint64_t compressed = 0;
+        start = monotonic_seconds();
+        for (size_t offset = 0; offset < (size_t)got; offset += frame)
+        {
+            size_t length = (size_t)got - offset < frame ? (size_t)got - offset : frame;
+            compressed += compress_frame(compress_output, context, output, capacity, sample + offset, length, levels[i]);
+        }
+        double seconds = monotonic_seconds() - start;
+        double cpu_rate = got / (seconds > 0 ? seconds : 1e-9) * parallelism;
+        double ratio = compressed ? (double)got / compressed : 1;
+        double needed = read_rate < write_rate * ratio ? read_rate : write_rate * ratio;
+        print_colored("\033[1;34m", "  level %2d: %8.1f MB/s compressing, ratio %.2f, copy needs %.1f MB/s\n", levels[i], cpu_rate / 1e6, ratio, needed / 1e6);
+        if (cpu_rate < needed)
+        {
+            break;
+        }
+        chosen = levels[i];
+    }
+
+    if (context != NULL)
+    {
+        compressor.zstd_free_cctx(context);
+    }
+    free(output);
+    free(sample);
+    return chosen;
+}
+
+enum compress_slot_state
+{
+    SLOT_FREE,
+    SLOT_READ,
+    SLOT_COMPRESSING,
+    SLOT_COMPRESSED
+};
+
+/**
+ * @brief One frame travelling from the reader through a compression thread to the writer.
+ */
+struct compress_slot
+{
+    uint64_t index;
+    size_t length;
+    size_t compressed_length;
+    uint32_t checksum;
+    enum compress_slot_state state;
+    char *input;
+    char *output;
+};
+
+/**
+ * @brief Frames in flight between the reader (the copying thread), compress_threads workers
+ * and the in-order writer. Frame i always lives in slot i % num_slots.
+ */
+struct compress_pipeline
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct compress_slot *slots;
+    unsigned num_slots;
+    uint64_t frames_read;
+    int reading_done;
+    int error;
+    int level;
+    size_t capacity;
+    struct copy_session *session;
+    uint64_t compressed_bytes;
+    uint32_t *seek_table;
+    size_t seek_capacity;
+    double reader_wait_seconds;
+    double writer_wait_seconds;
+};
+
+void *compress_worker(void *arg)
+{
+    struct compress_pipeline *pipeline = arg;
+    void *context = compress_output == COMPRESS_ZSTD ? compressor.zstd_create_cctx() : NULL;
+
+    pthread_mutex_lock(&pipeline->lock);
+    for (;;)
+    {
+        struct compress_slot *slot = NULL;
+        for (unsigned i = 0; i < pipeline->num_slots && slot == NULL; ++i)
+        {
+            if (pipeline->slots[i].state == SLOT_READ)
+            {
+                slot = &pipeline->slots[i];
+            }
+        }
+        if (slot == NULL)
+        {
+            if (pipeline->reading_done || pipeline->error)
+            {
+                break;
+            }
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+            continue;
+        }
+        slot->state = SLOT_COMPRESSING;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        slot->compressed_length = compress_frame(compress_output, context, slot->output, pipeline->capacity, slot->input, slot->length, pipeline->level);
+        slot->checksum = frame_checksum(slot->input, slot->length);
+
+        pthread_mutex_lock(&pipeline->lock);
+        if (slot->compressed_length == 0)
+        {
+            pipeline->error = EIO;
+        }
+        slot->state = SLOT_COMPRESSED;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    if (context != NULL)
+    {
+        compressor.zstd_free_cctx(context);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts writeback of the container every PAGE_CACHE_WINDOW and drops the window before.
+ *
+ * The container grows at its own offsets, so the source/target pairing of cache_window_flush()
+ * does not apply; the source pages are dropped by the reader as soon as a frame is read.
+ */
+void release_container_cache(int fd, struct cache_window *window, uint64_t end)
+{
+    if (!page_cache_control || end - window->start < PAGE_CACHE_WINDOW)
+    {
+        return;
+    }
+    sync_file_range(fd, window->start, end - window->start, SYNC_FILE_RANGE_WRITE);
+    if (window->written_end > window->written_start)
+    {
+        sync_file_range(fd, window->written_start, window->written_end - window->written_start,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, window->written_start, window->written_end - window->written_start, POSIX_FADV_DONTNEED);
+    }
+    window->written_start = window->start;
+    window->written_end = end;
+    window->start = end;
+}
+
+void *compress_writer(void *arg)
+{
+    struct compress_pipeline *pipeline = arg;
+    struct copy_session *session = pipeline->session;
+    struct cache_window window = {0};
+    uint64_t offset = 0;
+
+    for (uint64_t index = 0;; ++index)
+    {
+        struct compress_slot *slot = &pipeline->slots[index % pipeline->num_slots];
+        pthread_mutex_lock(&pipeline->lock);
+        double wait_start = monotonic_seconds();
+        while (!pipeline->error && !(slot->index == index && slot->state == SLOT_COMPRESSED) && !(pipeline->reading_done && pipeline->frames_read == index))
+        {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        pipeline->writer_wait_seconds += monotonic_seconds() - wait_start;
+        int finished = pipeline->error || slot->index != index || slot->state != SLOT_COMPRESSED;
+        pthread_mutex_unlock(&pipeline->lock);
+        if (finished)
+        {
+            break;
+        }
+
+        double io_start = monotonic_seconds();
+        if (write_fully(session->target_fd, slot->output, slot->compressed_length, offset) < 0)
+        {
+            pthread_mutex_lock(&pipeline->lock);
+            pipeline->error = errno;
+            pthread_cond_broadcast(&pipeline->changed);
+            pthread_mutex_unlock(&pipeline->lock);
+            break;
+        }
+        session->stats.write_seconds += monotonic_seconds() - io_start;
+        offset += slot->compressed_length;
+        release_container_cache(session->target_fd, &window, offset);
+
+        if (3 * (index + 1) > pipeline->seek_capacity)
+        {
+            pipeline->seek_capacity = pipeline->seek_capacity ? pipeline->seek_capacity * 2 : 3 * 1024;
+            pipeline->seek_table = realloc(pipeline->seek_table, pipeline->seek_capacity * sizeof(uint32_t));
+            if (pipeline->seek_table == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        pipeline->seek_table[3 * index] = (uint32_t)slot->compressed_length;
+        pipeline->seek_table[3 * index + 1] = (uint32_t)slot->length;
+        pipeline->seek_table[3 * index + 2] = slot->checksum;
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->compressed_bytes = offset;
+        slot->state = SLOT_FREE;
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+    return NULL;
+}
+
+void put_le32(unsigned char *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * @brief Appends the frame index as a skippable frame in the zstd seekable format: one
+ * (compressed size, decompressed size, XXH64 low 32 bits) entry per frame, then the frame
+ * count, a descriptor with the checksum flag and the seekable magic number.
+ *
+ * Skippable frames are ignored by both `zstd -d` and `lz4 -d`, so the container stays a
+ * plain concatenation of frames for the stock tools.
+ */
+int write_seek_table(int fd, uint64_t offset, const uint32_t *entries, uint64_t num_frames)
+{
+    size_t table_size = 8 + num_frames * 12 + 9;
+    unsigned char *table = malloc(table_size);
+    if (table == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    put_le32(table, SEEK_TABLE_MAGIC);
+    put_le32(table + 4, (uint32_t)(table_size - 8));
+    for (uint64_t i = 0; i < 3 * num_frames; ++i)
+    {
+        put_le32(table + 8 + 4 * i, entries[i]);
+    }
+    put_le32(table + table_size - 9, (uint32_t)num_frames);
+    table[table_size - 5] = 0x80;
+    put_le32(table + table_size - 4, SEEKABLE_MAGIC);
+    int ret = write_fully(fd, table, table_size, offset) < 0 ? -1 : 0;
+    free(table);
+    return ret;
+}
+
+/**
+ * @brief Copies source into a seekable compressed container of independent frame_size_bytes
+ * frames, compressed on compress_threads threads and written in order by one writer.
+ *
+ * With --hash the manifest and .sha256 describe the raw image, so they are named after
+ * image_path (what --extract restores) rather than the container.
+ * @return The durable rate in MB/s of uncompressed data, like engine_copy().
+ */
+double compressed_copy(const char *source_path, const char *image_path, const char *container_path, int level, struct copy_stats *stats)
+{
+    struct copy_session session;
+    open_copy_session(&session, source_path, container_path, frame_size_bytes, 1);
+    session.sparse = 0;
+    session.show_progress = 1;
+    // Compressed frames land at arbitrary offsets.
+    clear_direct_io(session.target_fd);
+    if (hash_image)
+    {
+        session.hasher = start_image_hasher(image_path, session.source_size);
+    }
+
+    struct compress_pipeline pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+    unsigned threads = resolve_compress_threads();
+    pipeline.num_slots = 2 * threads + 2;
+    pipeline.level = level;
+    pipeline.session = &session;
+    pipeline.capacity = compress_bound(compress_output, frame_size_bytes);
+    pipeline.slots = calloc(pipeline.num_slots, sizeof(struct compress_slot));
+    if (pipeline.slots == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < pipeline.num_slots; ++i)
+    {
+        pipeline.slots[i].input = allocate_io_buffer(frame_size_bytes);
+        pipeline.slots[i].output = malloc(pipeline.capacity);
+        if (pipeline.slots[i].output == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    double start = monotonic_seconds();
+    pthread_t writer;
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    if (workers == NULL || pthread_create(&writer, NULL, compress_writer, &pipeline) != 0)
+    {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        if (pthread_create(&workers[i], NULL, compress_worker, &pipeline) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint64_t offset = 0;
+    int read_error = 0;
+    for (uint64_t index = 0;; ++index)
+    {
+        struct compress_slot *slot = &pipeline.slots[index % pipeline.num_slots];
+        pthread_mutex_lock(&pipeline.lock);
+        double wait_start = monotonic_seconds();
+        while (slot->state != SLOT_FREE && !pipeline.error)
+        {
+            pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+        }
+        pipeline.reader_wait_seconds += monotonic_seconds() - wait_start;
+        int failed = pipeline.error;
+        pthread_mutex_unlock(&pipeline.lock);
+        if (failed)
+        {
+            break;
+        }
+
+        // O_DIRECT needs aligned lengths, so a short final frame is read rounded up and trimmed.
+        double io_start = monotonic_seconds();
+        ssize_t got = read_fully(session.source_fd, slot->input, frame_size_bytes, offset);
+        if (got < 0 && errno == EINVAL && clear_direct_io_for_tail(session.source_fd, frame_size_bytes))
+        {
+            got = read_fully(session.source_fd, slot->input, frame_size_bytes, offset);
+        }
+        session.stats.read_seconds += monotonic_seconds() - io_start;
+        if (got < 0)
+        {
+            read_error = errno;
+        }
+        if (got <= 0)
+        {
+            break;
+        }
+        hasher_add(session.hasher, offset, slot->input, got);
+        if (page_cache_control)
+        {
+            posix_fadvise(session.source_fd, offset, got, POSIX_FADV_DONTNEED);
+        }
+
+        pthread_mutex_lock(&pipeline.lock);
+        slot->index = index;
+        slot->length = got;
+        slot->state = SLOT_READ;
+        pipeline.frames_read = index + 1;
+        pthread_cond_broadcast(&pipeline.changed);
+        pthread_mutex_unlock(&pipeline.lock);
+
+        offset += got;
+        session.stats.bytes_copied = offset;
+        report_copy_progress(&session, start, 0);
+        if ((uint64_t)got < frame_size_bytes)
+        {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.reading_done = 1;
+    if (read_error)
+    {
+        pipeline.error = read_error;
+    }
+    pthread_cond_broadcast(&pipeline.changed);
+    pthread_mutex_unlock(&pipeline.lock);
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_join(writer, NULL);
+
+    if (pipeline.error)
+    {
+        fprintf(stderr, "\nError: Compressed copy of %s failed: %s\n", source_path, strerror(pipeline.error));
+        exit(EXIT_FAILURE);
+    }
+    if (write_seek_table(session.target_fd, pipeline.compressed_bytes, pipeline.seek_table, pipeline.frames_read) != 0)
+    {
+        fprintf(stderr, "\nError: Could not write the frame index of %s: %s\n", container_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    session.stats.elapsed_seconds = monotonic_seconds() - start;
+    report_copy_progress(&session, start, 1);
+    flush_copy_session(&session);
+    if (session.hasher != NULL)
+    {
+        finish_image_hasher(session.hasher, session.stats.bytes_copied);
+        session.hasher = NULL;
+    }
+    close_copy_session(&session);
+
+    print_colored("\033[1;35m", "Compressed %llu bytes into %llu (ratio %.2f) as %llu %s frames at level %d\n", (unsigned long long)offset,
+                  (unsigned long long)pipeline.compressed_bytes, pipeline.compressed_bytes ? (double)offset / pipeline.compressed_bytes : 0,
+                  (unsigned long long)pipeline.frames_read, compressor_names[compress_output], level);
+    print_colored("\033[1;35m", "Reader waited %.2f s for free frames (compression or target bound), writer waited %.2f s for compressed frames (compression bound)\n",
+                  pipeline.reader_wait_seconds, pipeline.writer_wait_seconds);
+
+    for (unsigned i = 0; i < pipeline.num_slots; ++i)
+    {
+        free(pipeline.slots[i].input);
+        free(pipeline.slots[i].output);
+    }
+    free(pipeline.slots);
+    free(pipeline.seek_table);
+    free(workers);
+    pthread_mutex_destroy(&pipeline.lock);
+    pthread_cond_destroy(&pipeline.changed);
+
+    *stats = session.stats;
+    return durable_rate(stats);
+}
+
+/**
+ * @brief The container path for output_file_path: the compressor's suffix unless it is already there.
+ */
+void compressed_path(const char *output_file_path, char *path, size_t path_size)
+{
+    const char *suffix = compressor_suffixes[compress_output];
+    size_t length = strlen(output_file_path);
+    size_t suffix_length = strlen(suffix);
+    if (length >= suffix_length && strcmp(output_file_path + length - suffix_length, suffix) == 0)
+    {
+        snprintf(path, path_size, "%s", output_file_path);
+    }
+    else
+    {
+        snprintf(path, path_size, "%s%s", output_file_path, suffix);
+    }
+}
+
+struct extract_job
+{
+    int container_fd;
+    int image_fd;
+    enum compressor_type type;
+    uint32_t *entries;
+    uint64_t *container_offsets;
+    uint64_t *image_offsets;
+    uint64_t num_frames;
+    uint64_t next;
+    int checksums;
+    int error;
+    uint64_t bad_frame;
+};
+
+void *extract_worker(void *arg)
+{
+    struct extract_job *job = arg;
+    size_t input_size = 0;
+    size_t output_size = 0;
+    char *input = NULL;
+    char *output = NULL;
+
+    uint64_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->num_frames && !__atomic_load_n(&job->error, __ATOMIC_RELAXED))
+    {
+        size_t compressed_length = job->entries[3 * i];
+        size_t length = job->entries[3 * i + 1];
+        if (compressed_length > input_size)
+        {
+            input_size = compressed_length;
+            input = realloc(input, input_size);
+        }
+        if (length > output_size)
+        {
+            output_size = length;
+            output = realloc(output, output_size);
+        }
+        if (input == NULL || output == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+
+        int error = 0;
+        if (read_fully(job->container_fd, input, compressed_length, job->container_offsets[i]) != (ssize_t)compressed_length)
+        {
+            error = errno ? errno : EIO;
+        }
+        else if (decompress_frame(job->type, output, length, input, compressed_length) != 0 ||
+                 (job->checksums && frame_checksum(output, length) != job->entries[3 * i + 2]))
+        {
+            error = EBADMSG;
+        }
+        else if (write_fully(job->image_fd, output, length, job->image_offsets[i]) < 0)
+        {
+            error = errno;
+        }
+        if (error && __atomic_exchange_n(&job->error, error, __ATOMIC_RELAXED) == 0)
+        {
+            job->bad_frame = i;
+        }
+    }
+    free(input);
+    free(output);
+    return NULL;
+}
+
+/**
+ * @brief Decompresses a container written with --compress back into a raw image, frames in
+ * parallel straight to their offsets using the frame index, checking every frame checksum.
+ *
+ * The image is written next to the container without its .zst/.lz4 suffix.
+ */
+void extract_image(const char *container_path)
+{
+    int fd = open(container_path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Could not open %s: %s\n", container_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    unsigned char footer[9];
+    unsigned char magic[4];
+    if (fstat(fd, &st) != 0 || st.st_size < 8 + 9 || read_fully(fd, footer, sizeof(footer), st.st_size - sizeof(footer)) != sizeof(footer) ||
+        get_le32(footer + 5) != SEEKABLE_MAGIC || read_fully(fd, magic, sizeof(magic), 0) != sizeof(magic))
+    {
+        fprintf(stderr, "Error: %s is not a seekable dddarth container (no frame index)\n", container_path);
+        exit(EXIT_FAILURE);
+    }
+
+    struct extract_job job;
+    memset(&job, 0, sizeof(job));
+    job.container_fd = fd;
+    job.num_frames = get_le32(footer);
+    job.checksums = (footer[4] & 0x80) != 0;
+    size_t entry_size = job.checksums ? 12 : 8;
+    uint64_t table_size = job.num_frames * entry_size;
+    if ((uint64_t)st.st_size < table_size + 8 + 9)
+    {
+        fprintf(stderr, "Error: The frame index of %s is truncated\n", container_path);
+        exit(EXIT_FAILURE);
+    }
+    uint64_t table_offset = st.st_size - 9 - table_size;
+    unsigned char header[8];
+    unsigned char *table = malloc(table_size ? table_size : 1);
+    job.entries = malloc((job.num_frames ? job.num_frames : 1) * 3 * sizeof(uint32_t));
+    job.container_offsets = malloc((job.num_frames ? job.num_frames : 1) * sizeof(uint64_t));
+    job.image_offsets = malloc((job.num_frames ? job.num_frames : 1) * sizeof(uint64_t));
+    if (table == NULL || job.entries == NULL || job.container_offsets == NULL || job.image_offsets == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (read_fully(fd, header, sizeof(header), table_offset - 8) != sizeof(header) || get_le32(header) != SEEK_TABLE_MAGIC ||
+        get_le32(header + 4) != table_size + 9 || read_fully(fd, table, table_size, table_offset) != (ssize_t)table_size)
+    {
+        fprintf(stderr, "Error: The frame index of %s is damaged\n", container_path);
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t container_offset = 0;
+    uint64_t image_size = 0;
+    for (uint64_t i = 0; i < job.num_frames; ++i)
+    {
+        job.entries[3 * i] = get_le32(table + i * entry_size);
+        job.entries[3 * i + 1] = get_le32(table + i * entry_size + 4);
+        job.entries[3 * i + 2] = job.checksums ? get_le32(table + i * entry_size + 8) : 0;
+        job.container_offsets[i] = container_offset;
+        job.image_offsets[i] = image_size;
+        container_offset += job.entries[3 * i];
+        image_size += job.entries[3 * i + 1];
+    }
+    free(table);
+    if (container_offset != table_offset - 8)
+    {
+        fprintf(stderr, "Error: The frame index of %s does not match its frames\n", container_path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (get_le32(magic) == ZSTD_FRAME_MAGIC)
+    {
+        job.type = COMPRESS_ZSTD;
+    }
+    else if (get_le32(magic) == LZ4_FRAME_MAGIC)
+    {
+        job.type = COMPRESS_LZ4;
+    }
+    else if (job.num_frames > 0)
+    {
+        fprintf(stderr, "Error: %s holds neither zstd nor lz4 frames\n", container_path);
+        exit(EXIT_FAILURE);
+    }
+    load_compressor(job.type == COMPRESS_NONE ? COMPRESS_ZSTD : job.type);
+
+    char image_path[MAX_PATH];
+    snprintf(image_path, sizeof(image_path), "%s", container_path);
+    char *dot = strrchr(image_path, '.');
+    if (dot != NULL && (strcmp(dot, compressor_suffixes[COMPRESS_ZSTD]) == 0 || strcmp(dot, compressor_suffixes[COMPRESS_LZ4]) == 0))
+    {
+        *dot = '\0';
+    }
+    else
+    {
+        snprintf(image_path, sizeof(image_path), "%s.img", container_path);
+    }
+    job.image_fd = open(image_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (job.image_fd < 0 || ftruncate(job.image_fd, image_size) != 0)
+    {
+        fprintf(stderr, "Error: Could not create %s: %s\n", image_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned threads = resolve_compress_threads();
+    print_colored("\033[1;33m", "Extracting %llu %s frame(s) of %s into %s with %u thread(s)...\n", (unsigned long long)job.num_frames,
+                  compressor_names[job.type], container_path, image_path, threads);
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    if (workers == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    double start = monotonic_seconds();
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        if (pthread_create(&workers[i], NULL, extract_worker, &job) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    if (job.error)
+    {
+        fprintf(stderr, "Error: Frame %llu (image bytes %llu-%llu): %s\n", (unsigned long long)job.bad_frame,
+                (unsigned long long)job.image_offsets[job.bad_frame],
+                (unsigned long long)(job.image_offsets[job.bad_frame] + job.entries[3 * job.bad_frame + 1] - 1),
+                job.error == EBADMSG ? "corrupt data or checksum mismatch" : strerror(job.error));
+        exit(EXIT_FAILURE);
+    }
+    if (fdatasync(job.image_fd) != 0 && errno != EINVAL)
+    {
+        fprintf(stderr, "Error: fdatasync on %s failed: %s\n", image_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    double seconds = monotonic_seconds() - start;
+    close(job.image_fd);
+    close(fd);
+    print_colored("\033[1;32m", "Extracted %llu bytes in %.2f s (%.1f MB/s)%s\n", (unsigned long long)image_size, seconds,
+                  seconds > 0 ? image_size / seconds / 1e6 : 0, job.checksums ? ", all frame checksums match" : "");
+
+    free(workers);
+    free(job.entries);
+    free(job.container_offsets);
+    free(job.image_offsets);
+}
+
+/**
+ * @brief Header of a delta file: the chunks of an image that differ from its base.
+ *
+ * It is followed by one delta_record plus the chunk data per changed chunk, in whatever
+ * order the workers finished them. Integers are stored in host (little-endian) order.
+ */
+struct delta_header
+{
+    char magic[8];
+    uint64_t chunk_size;
+    uint64_t image_size;
+    uint64_t num_records;
+    char base[256];
+};
+
+struct delta_record
+{
+    uint64_t index;
+    uint64_t offset;
+    uint64_t length;
+};
+
+/**
+ * @brief Shared state of an incremental copy: the base manifest, the manifest being built
+ * and the cursor of the delta file (or nothing in --patch mode, where chunks go in place).
+ */
+struct incremental_copy
+{
+    struct copy_session *session;
+    struct verify_chunk *base;
+    size_t num_base;
+    struct verify_chunk *chunks;
+    uint64_t num_chunks;
+    uint64_t chunk_size;
+    uint64_t next;
+    int patch;
+    uint64_t delta_end;
+    uint64_t changed_chunks;
+    uint64_t changed_bytes;
+    unsigned active_workers;
+    int error;
+};
+
+/**
+ * @brief Reads and hashes whole chunks of the source; a chunk whose SHA-256 or XXH64 differs
+ * from the base manifest is written into the image (patch) or appended to the delta file.
+ */
+void *incremental_worker(void *arg)
+{
+    struct incremental_copy *copy = arg;
+    struct copy_session *session = copy->session;
+    char *buffer = allocate_io_buffer(copy->chunk_size);
+
+    uint64_t i;
+    while ((i = __atomic_fetch_add(&copy->next, 1, __ATOMIC_RELAXED)) < copy->num_chunks && !__atomic_load_n(&copy->error, __ATOMIC_RELAXED))
+    {
+        uint64_t offset = i * copy->chunk_size;
+        size_t length = session->source_size - offset < copy->chunk_size ? session->source_size - offset : copy->chunk_size;
+        size_t done = 0;
+        int error = 0;
+        while (done < length)
+        {
+            size_t want = length - done < session->block_size ? length - done : session->block_size;
+            // O_DIRECT needs aligned lengths, so a short final piece is read rounded up and trimmed.
+            size_t request = (want + IO_ALIGNMENT - 1) / IO_ALIGNMENT * IO_ALIGNMENT;
+            if (done + request > copy->chunk_size)
+            {
+                request = want;
+            }
+            ssize_t got = read_fully(session->source_fd, buffer + done, request, offset + done);
+            if (got < 0 && errno == EINVAL && clear_direct_io_for_tail(session->source_fd, request))
+            {
+                continue;
+            }
+            if (got < 0)
+            {
+                error = errno;
+                break;
+            }
+            if (got == 0)
+            {
+                error = EIO; // the source shrank under us
+                break;
+            }
+            done += (size_t)got < want ? (size_t)got : want;
+        }
+        if (page_cache_control)
+        {
+            posix_fadvise(session->source_fd, offset, length, POSIX_FADV_DONTNEED);
+        }
+
+        struct verify_chunk *chunk = &copy->chunks[i];
+        struct sha256_ctx sha;
+        struct xxh64_ctx xxh;
+        unsigned char digest[32];
+        sha256_init(&sha);
+        sha256_update(&sha, buffer, length);
+        sha256_final(&sha, digest);
+        format_hex(digest, sizeof(digest), chunk->sha256);
+        xxh64_init(&xxh);
+        xxh64_update(&xxh, buffer, length);
+        chunk->xxh64 = xxh64_digest(&xxh);
+        chunk->offset = offset;
+        chunk->length = length;
+
+        const struct verify_chunk *base = i < copy->num_base ? &copy->base[i] : NULL;
+        chunk->mismatch = base == NULL || base->offset != offset || base->length != length || strcmp(base->sha256, chunk->sha256) != 0 ||
+                          base->xxh64 != chunk->xxh64;
+        if (!error && chunk->mismatch)
+        {
+            if (copy->patch)
+            {
+                if (write_fully(session->target_fd, buffer, length, offset) < 0)
+                {
+                    error = errno;
+                }
+            }
+            else
+            {
+                struct delta_record record = {i, offset, length};
+                uint64_t at = __atomic_fetch_add(&copy->delta_end, sizeof(record) + length, __ATOMIC_RELAXED);
+                if (write_fully(session->target_fd, &record, sizeof(record), at) < 0 || write_fully(session->target_fd, buffer, length, at + sizeof(record)) < 0)
+                {
+                    error = errno;
+                }
+            }
+            __atomic_fetch_add(&copy->changed_chunks, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&copy->changed_bytes, length, __ATOMIC_RELAXED);
+        }
+        if (error)
+        {
+            int expected = 0;
+            __atomic_compare_exchange_n(&copy->error, &expected, error, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            break;
+        }
+        __atomic_fetch_add(&session->stats.bytes_copied, length, __ATOMIC_RELAXED);
+    }
+
+    free(buffer);
+    __atomic_fetch_sub(&copy->active_workers, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * @brief Copies a whole file, sharing its extents (FICLONE) where the filesystem allows it.
+ */
+void clone_file(const char *source_path, const char *target_path)
+{
+    int source_fd = open(source_path, O_RDONLY);
+    int target_fd = source_fd < 0 ? -1 : open(target_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (source_fd < 0 || target_fd < 0)
+    {
+        fprintf(stderr, "Error: Could not copy %s to %s: %s\n", source_path, target_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (ioctl(target_fd, FICLONE, source_fd) != 0)
+    {
+        struct stat st;
+        loff_t offset = 0;
+        if (fstat(source_fd, &st) != 0)
+        {
+            perror("fstat");
+            exit(EXIT_FAILURE);
+        }
+        while (offset < st.st_size)
+        {
+            ssize_t copied = copy_file_range(source_fd, &offset, target_fd, NULL, st.st_size - offset, 0);
+            if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS))
+            {
+                // Older kernels only copy within one filesystem; fall back to plain reads and writes.
+                char buffer[256 * 1024];
+                ssize_t got = read_fully(source_fd, buffer, sizeof(buffer) < (size_t)(st.st_size - offset) ? sizeof(buffer) : (size_t)(st.st_size - offset), offset);
+                copied = got > 0 && write_fully(target_fd, buffer, got, offset) == got ? got : -1;
+                offset += copied > 0 ? copied : 0;
+            }
+            if (copied <= 0)
+            {
+                fprintf(stderr, "Error: Could not copy %s to %s: %s\n", source_path, target_path, copied < 0 ? strerror(errno) : "short copy");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    close(source_fd);
+    if (close(target_fd) != 0)
+    {
+        perror("close");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Writes the chunk manifest of an incremental copy in the format of start_image_hasher().
+ *
+ * Chunks are hashed out of order, so there is no whole-image digest; the manifest still serves
+ * as the base of the next incremental run and for --verify.
+ */
+void write_incremental_manifest(const char *image_path, const char *base_path, const struct incremental_copy *copy)
+{
+    char manifest_path[MAX_PATH + 8];
+    char image_name[MAX_PATH];
+    char base_name[MAX_PATH];
+    snprintf(manifest_path, sizeof(manifest_path), "%s.hashes", image_path);
+    snprintf(image_name, sizeof(image_name), "%s", image_path);
+    snprintf(base_name, sizeof(base_name), "%s", base_path);
+    FILE *manifest = fopen(manifest_path, "w");
+    if (manifest == NULL)
+    {
+        fprintf(stderr, "Error: Could not create %s: %s\n", manifest_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fprintf(manifest, "# dddarth hash manifest\n# image: %s\n# base: %s\n# chunk_size: %llu\n# chunk offset length sha256 xxh64\n", basename(image_name),
+            basename(base_name), (unsigned long long)copy->chunk_size);
+    uint64_t bytes = 0;
+    for (uint64_t i = 0; i < copy->num_chunks; ++i)
+    {
+        const struct verify_chunk *chunk = &copy->chunks[i];
+        fprintf(manifest, "%llu %llu %zu %s %016llx\n", (unsigned long long)i, (unsigned long long)chunk->offset, chunk->length, chunk->sha256,
+                (unsigned long long)chunk->xxh64);
+        bytes += chunk->length;
+    }
+    fprintf(manifest, "# bytes: %llu\n", (unsigned long long)bytes);
+    if (fclose(manifest) != 0)
+    {
+        fprintf(stderr, "Error: Could not write %s: %s\n", manifest_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Images source against the manifest of a previous image (incremental_base) and only
+ * writes the chunks that changed since.
+ *
+ * By default the changed chunks go into <image>.delta, which --materialize later applies on
+ * top of the base. With --patch the base image is cloned to <image> and patched in place.
+ * Either way <image>.hashes describes the new state, so it can serve as the next base.
+ * @return The durable rate in MB/s of source data scanned, like engine_copy().
+ */
+double incremental_copy(const char *source_path, const char *image_path, struct copy_stats *stats)
+{
+    uint64_t chunk_size = 0;
+    size_t num_base;
+    struct verify_chunk *base = load_hash_manifest(incremental_base, &num_base, &chunk_size);
+    if (chunk_size == 0)
+    {
+        fprintf(stderr, "Error: %s.hashes does not record its chunk size\n", incremental_base);
+        exit(EXIT_FAILURE);
+    }
+
+    char target_path[MAX_PATH];
+    if (patch_base)
+    {
+        print_colored("\033[1;33m", "Cloning %s to %s...\n", incremental_base, image_path);
+        clone_file(incremental_base, image_path);
+        snprintf(target_path, sizeof(target_path), "%s", image_path);
+    }
+    else
+    {
+        snprintf(target_path, sizeof(target_path), "%s.delta", image_path);
+    }
+
+    struct copy_session session;
+    size_t block_size = strlen(best_block_size) ? parse_size(best_block_size) : 1024 * 1024;
+    open_copy_session(&session, source_path, target_path, block_size < chunk_size ? block_size : chunk_size, !patch_base);
+    session.show_progress = 1;
+    // Delta records and a short last chunk are not sector aligned.
+    clear_direct_io(session.target_fd);
+
+    struct incremental_copy copy;
+    memset(&copy, 0, sizeof(copy));
+    copy.session = &session;
+    copy.base = base;
+    copy.num_base = num_base;
+    copy.chunk_size = chunk_size;
+    copy.num_chunks = (session.source_size + chunk_size - 1) / chunk_size;
+    copy.patch = patch_base;
+    copy.delta_end = sizeof(struct delta_header);
+    copy.chunks = calloc(copy.num_chunks ? copy.num_chunks : 1, sizeof(*copy.chunks));
+    unsigned num_workers = copy_threads < copy.num_chunks ? copy_threads : (unsigned)copy.num_chunks;
+    pthread_t *threads = calloc(num_workers ? num_workers : 1, sizeof(pthread_t));
+    if (copy.chunks == NULL || threads == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    print_colored("\033[1;33m", "Comparing %llu chunk(s) of %s against %s.hashes with %u thread(s)...\n", (unsigned long long)copy.num_chunks, source_path,
+                  incremental_base, num_workers);
+    double start = monotonic_seconds();
+    copy.active_workers = num_workers;
+    for (unsigned i = 0; i < num_workers; ++i)
+    {
+        if (pthread_create(&threads[i], NULL, incremental_worker, &copy) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    while (__atomic_load_n(&copy.active_workers, __ATOMIC_ACQUIRE) > 0)
+    {
+        usleep(100000);
+        report_copy_progress(&session, start, 0);
+    }
+    for (unsigned i = 0; i < num_workers; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    session.stats.elapsed_seconds = monotonic_seconds() - start;
+    report_copy_progress(&session, start, 1);
+    if (copy.error)
+    {
+        fprintf(stderr, "Error: Incremental copy of %s failed: %s\n", source_path, strerror(copy.error));
+        exit(EXIT_FAILURE);
+    }
+
+    if (patch_base)
+    {
+        // The source may have shrunk since the base was taken.
+        struct stat st;
+        if (fstat(session.target_fd, &st) == 0 && S_ISREG(st.st_mode) && ftruncate(session.target_fd, session.source_size) != 0)
+        {
+            fprintf(stderr, "Error: Could not resize %s: %s\n", image_path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        struct delta_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, DELTA_MAGIC, sizeof(header.magic));
+        header.chunk_size = chunk_size;
+        header.image_size = session.source_size;
+        header.num_records = copy.changed_chunks;
+        char base_name[MAX_PATH];
+        snprintf(base_name, sizeof(base_name), "%s", incremental_base);
+        snprintf(header.base, sizeof(header.base), "%s", basename(base_name));
+        if (write_fully(session.target_fd, &header, sizeof(header), 0) < 0)
+        {
+            fprintf(stderr, "Error: Could not write %s: %s\n", target_path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    flush_copy_session(&session);
+    close_copy_session(&session);
+    write_incremental_manifest(image_path, incremental_base, &copy);
+
+    print_colored("\033[1;35m", "%llu of %llu chunk(s) changed since %s: wrote %llu bytes (%.2f%% of the source) to %s\n",
+                  (unsigned long long)copy.changed_chunks, (unsigned long long)copy.num_chunks, incremental_base, (unsigned long long)copy.changed_bytes,
+                  session.source_size ? 100.0 * copy.changed_bytes / session.source_size : 0, target_path);
+
+    free(threads);
+    free(copy.chunks);
+    free(base);
+    *stats = session.stats;
+    return durable_rate(stats);
+}
+
+/**
+ * @brief Rebuilds a full image from a base image and one or more delta files applied in order.
+ *
+ * The argument is BASE,DELTA[,DELTA...]; the image is written next to the last delta without
+ * its .delta suffix and, when that run's manifest is present, checked against it.
+ */
+void materialize_image(const char *optarg)
+{
+    char *input = strdup(optarg);
+    char *rest = input;
+    char *base_path = strtok_r(rest, ",", &rest);
+    char *deltas[256];
+    size_t num_deltas = 0;
+    char *token;
+    while ((token = strtok_r(rest, ",", &rest)) && num_deltas < sizeof(deltas) / sizeof(deltas[0]))
+    {
+        deltas[num_deltas++] = token;
+    }
+    size_t last_length = num_deltas ? strlen(deltas[num_deltas - 1]) : 0;
+    if (base_path == NULL || num_deltas == 0 || last_length <= 6 || strcmp(deltas[num_deltas - 1] + last_length - 6, ".delta") != 0)
+    {
+        fprintf(stderr, "Invalid materialize list: %s (expected BASE,IMAGE.delta[,IMAGE.delta...])\n", optarg);
+        exit(EXIT_FAILURE);
+    }
+    char image_path[MAX_PATH];
+    snprintf(image_path, sizeof(image_path), "%.*s", (int)(last_length - 6), deltas[num_deltas - 1]);
+
+    print_colored("\033[1;33m", "Materializing %s from %s and %zu delta(s)...\n", image_path, base_path, num_deltas);
+    double start = monotonic_seconds();
+    clone_file(base_path, image_path);
+    int image_fd = open(image_path, O_WRONLY);
+    if (image_fd < 0)
+    {
+        fprintf(stderr, "Error: Could not open %s: %s\n", image_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t written = 0;
+    char *buffer = NULL;
+    size_t buffer_size = 0;
+    for (size_t i = 0; i < num_deltas; ++i)
+    {
+        int delta_fd = open(deltas[i], O_RDONLY);
+        struct delta_header header;
+        if (delta_fd < 0 || read_fully(delta_fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic)) != 0)
+        {
+            fprintf(stderr, "Error: %s is not a dddarth delta file\n", deltas[i]);
+            exit(EXIT_FAILURE);
+        }
+        header.base[sizeof(header.base) - 1] = '\0';
+        uint64_t at = sizeof(header);
+        for (uint64_t r = 0; r < header.num_records; ++r)
+        {
+            struct delta_record record;
+            if (read_fully(delta_fd, &record, sizeof(record), at) != sizeof(record) || record.offset + record.length > header.image_size)
+            {
+                fprintf(stderr, "Error: %s is truncated or damaged at record %llu\n", deltas[i], (unsigned long long)r);
+                exit(EXIT_FAILURE);
+            }
+            if (record.length > buffer_size)
+            {
+                buffer_size = record.length;
+                buffer = realloc(buffer, buffer_size);
+                if (buffer == NULL)
+                {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            if (read_fully(delta_fd, buffer, record.length, at + sizeof(record)) != (ssize_t)record.length ||
+                write_fully(image_fd, buffer, record.length, record.offset) < 0)
+            {
+                fprintf(stderr, "Error: Could not apply chunk %llu of %s: %s\n", (unsigned long long)record.index, deltas[i], strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            at += sizeof(record) + record.length;
+            written += record.length;
+        }
+        if (ftruncate(image_fd, header.image_size) != 0)
+        {
+            fprintf(stderr, "Error: Could not resize %s: %s\n", image_path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        print_colored("\033[1;34m", "Applied %s: %llu chunk(s) on top of %s\n", deltas[i], (unsigned long long)header.num_records, header.base);
+        close(delta_fd);
+    }
+    if (fdatasync(image_fd) != 0 || close(image_fd) != 0)
+    {
+        fprintf(stderr, "Error: Could not write %s: %s\n", image_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    free(buffer);
+    double seconds = monotonic_seconds() - start;
+    print_colored("\033[1;32m", "Materialized %s in %.2f s (%llu bytes from deltas)\n", image_path, seconds, (unsigned long long)written);
+
+    char manifest_path[MAX_PATH + 8];
+    snprintf(manifest_path, sizeof(manifest_path), "%s.hashes", image_path);
+    if (access(manifest_path, R_OK) == 0)
+    {
+        size_t num_chunks;
+        struct verify_chunk *chunks = load_hash_manifest(image_path, &num_chunks, NULL);
+        struct verify_chunk **all = malloc((num_chunks ? num_chunks : 1) * sizeof(*all));
+        if (all == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < num_chunks; ++i)
+        {
+            all[i] = &chunks[i];
+        }
+        if (run_verify_pass(image_path, all, num_chunks) != 0)
+        {
+            print_colored("\033[1;31m", "Error: %s does not match %s; a delta is missing or out of order.\n", image_path, manifest_path);
+            exit(EXIT_FAILURE);
+        }
+        free(all);
+        free(chunks);
+    }
+    free(input);
+}
+
+/**
+ * @brief Byte ranges of the source that --allocated-only copies: everything a filesystem marks
+ * in use, its metadata, and every byte that is not inside a recognized filesystem.
+ */
+struct allocation_extent
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct allocation_map
+{
+    struct allocation_extent *extents;
+    size_t num_extents;
+    size_t capacity;
+    uint64_t allocated;
+};
+
+uint16_t get_le16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+uint64_t get_le64(const unsigned char *p)
+{
+    return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+uint16_t get_be16(const unsigned char *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+uint32_t get_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+uint64_t get_be64(const unsigned char *p)
+{
+    return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+void add_allocated_range(struct allocation_map *map, uint64_t offset, uint64_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+    if (map->num_extents == map->capacity)
+    {
+        map->capacity = map->capacity ? map->capacity * 2 : 256;
+        map->extents = realloc(map->extents, map->capacity * sizeof(*map->extents));
+        if (map->extents == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    map->extents[map->num_extents++] = (struct allocation_extent){offset, length};
+}
+
+/**
+ * @brief Adds the runs of set bits of an allocation bitmap (bit i = unit i, LSB first) starting
+ * at byte offset base.
+ */
+void add_bitmap_runs(struct allocation_map *map, const unsigned char *bitmap, uint64_t bits, uint64_t base, uint64_t unit)
+{
+    uint64_t run = 0;
+    int in_run = 0;
+    for (uint64_t i = 0; i < bits;)
+    {
+        // Whole bytes that continue the current state are skipped without looking at bits.
+        if (i % 8 == 0 && i + 8 <= bits && bitmap[i / 8] == (in_run ? 0xFF : 0x00))
+        {
+            i += 8;
+            continue;
+        }
+        int set = bitmap[i / 8] >> (i % 8) & 1;
+        if (set && !in_run)
+        {
+            run = i;
+        }
+        else if (!set && in_run)
+        {
+            add_allocated_range(map, base + run * unit, (i - run) * unit);
+        }
+        in_run = set;
+        ++i;
+    }
+    if (in_run)
+    {
+        add_allocated_range(map, base + run * unit, (bits - run) * unit);
+    }
+}
+
+/**
+ * @brief With sparse_super only groups 0, 1 and powers of 3, 5 and 7 carry superblock and
+ * descriptor backups.
+ */
+int ext4_group_has_super(uint64_t group, uint32_t ro_compat)
+{
+    if (group <= 1 || !(ro_compat & 0x1))
+    {
+        return 1;
+    }
+    for (uint64_t base = 3; base <= 7; base += 2)
+    {
+        uint64_t power = base;
+        while (power < group)
+        {
+            power *= base;
+        }
+        if (power == group)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Maps the used blocks of an ext2/3/4 filesystem at byte start from its block bitmaps.
+ *
+ * Returns 0 if there is no ext superblock, -1 if the layout is not supported (meta_bg) or does
+ * not add up, and 1 on success with *used set from the free block count. Groups whose bitmap
+ * was never initialized (BLOCK_UNINIT) only contribute their superblock and descriptor backups;
+ * bitmaps and inode tables are added for every group, wherever flex_bg put them.
+ */
+int map_ext4_allocation(int fd, uint64_t start, uint64_t size, struct allocation_map *map, uint64_t *used, const char **name)
+{
+    unsigned char sb[1024];
+    if (read_fully(fd, sb, sizeof(sb), start + 1024) != sizeof(sb) || get_le16(sb + 0x38) != 0xEF53)
+    {
+        return 0;
+    }
+    uint32_t compat = get_le32(sb + 0x5C);
+    uint32_t incompat = get_le32(sb + 0x60);
+    uint32_t ro_compat = get_le32(sb + 0x64);
+    *name = incompat & 0x40 ? "ext4" : compat & 0x4 ? "ext3" : "ext2";
+    uint32_t log_block_size = get_le32(sb + 0x18);
+    if (log_block_size > 6 || incompat & 0x10)
+    {
+        return -1;
+    }
+    uint64_t block_size = 1024ULL << log_block_size;
+    int wide = incompat & 0x80;
+    uint64_t blocks = get_le32(sb + 0x4) | (wide ? (uint64_t)get_le32(sb + 0x150) << 32 : 0);
+    uint64_t free_blocks = get_le32(sb + 0xC) | (wide ? (uint64_t)get_le32(sb + 0x158) << 32 : 0);
+    uint32_t first_data_block = get_le32(sb + 0x14);
+    uint32_t blocks_per_group = get_le32(sb + 0x20);
+    uint32_t inodes_per_group = get_le32(sb + 0x28);
+    uint32_t inode_size = get_le32(sb + 0x4C) ? get_le16(sb + 0x58) : 128;
+    uint32_t desc_size = wide ? get_le16(sb + 0xFE) : 32;
+    uint32_t reserved_gdt = get_le16(sb + 0xCE);
+    if (blocks_per_group == 0 || blocks_per_group > block_size * 8 || desc_size < 32 || desc_size > block_size || blocks <= first_data_block ||
+        blocks > size / block_size || free_blocks > blocks || inode_size < 128 || inode_size > block_size)
+    {
+        return -1;
+    }
+    uint64_t groups = (blocks - first_data_block + blocks_per_group - 1) / blocks_per_group;
+    uint64_t gdt_blocks = (groups * desc_size + block_size - 1) / block_size;
+    uint64_t inode_table_blocks = ((uint64_t)inodes_per_group * inode_size + block_size - 1) / block_size;
+    unsigned char *descriptors = malloc(gdt_blocks * block_size);
+    unsigned char *bitmap = malloc(block_size);
+    if (descriptors == NULL || bitmap == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    int ret = read_fully(fd, descriptors, gdt_blocks * block_size, start + (first_data_block + 1) * block_size) == (ssize_t)(gdt_blocks * block_size);
+    // Boot block, superblock and descriptor table, including the room reserved to grow it.
+    add_allocated_range(map, start, (first_data_block + 1 + gdt_blocks + reserved_gdt) * block_size);
+    for (uint64_t group = 0; ret && group < groups; ++group)
+    {
+        const unsigned char *desc = descriptors + group * desc_size;
+        int high = desc_size >= 64;
+        uint64_t block_bitmap = get_le32(desc) | (high ? (uint64_t)get_le32(desc + 0x20) << 32 : 0);
+        uint64_t inode_bitmap = get_le32(desc + 0x4) | (high ? (uint64_t)get_le32(desc + 0x24) << 32 : 0);
+        uint64_t inode_table = get_le32(desc + 0x8) | (high ? (uint64_t)get_le32(desc + 0x28) << 32 : 0);
+        uint16_t flags = get_le16(desc + 0x12);
+        uint64_t group_start = first_data_block + group * blocks_per_group;
+        uint64_t group_blocks = blocks - group_start < blocks_per_group ? blocks - group_start : blocks_per_group;
+        if (block_bitmap >= blocks || inode_bitmap >= blocks || inode_table + inode_table_blocks > blocks)
+        {
+            ret = 0;
+            break;
+        }
+        add_allocated_range(map, start + block_bitmap * block_size, block_size);
+        add_allocated_range(map, start + inode_bitmap * block_size, block_size);
+        add_allocated_range(map, start + inode_table * block_size, inode_table_blocks * block_size);
+        if (flags & 0x2 && ro_compat & (0x10 | 0x400))
+        {
+            if (ext4_group_has_super(group, ro_compat))
+            {
+                uint64_t backup = 1 + gdt_blocks + reserved_gdt;
+                add_allocated_range(map, start + group_start * block_size, (backup < group_blocks ? backup : group_blocks) * block_size);
+            }
+            continue;
+        }
+        if (read_fully(fd, bitmap, block_size, start + block_bitmap * block_size) != (ssize_t)block_size)
+        {
+            ret = 0;
+            break;
+        }
+        add_bitmap_runs(map, bitmap, group_blocks, start + group_start * block_size, block_size);
+    }
+    free(bitmap);
+    free(descriptors);
+    *used = (blocks - free_blocks) * block_size;
+    return ret ? 1 : -1;
+}
+
+/**
+ * @brief Maps the used blocks of an XFS filesystem at byte start: each allocation group minus
+ * the free extents in its by-block-number free space btree.
+ *
+ * The AG headers, the internal log and the free list count as used because they are not in
+ * that btree. Returns 0 if there is no XFS superblock, -1 if a header or btree block does not
+ * check out, and 1 on success with *used from the free block count.
+ */
+int map_xfs_allocation(int fd, uint64_t start, uint64_t size, struct allocation_map *map, uint64_t *used, const char **name)
+{
+    unsigned char sb[512];
+    if (read_fully(fd, sb, sizeof(sb), start) != sizeof(sb) || get_be32(sb) != 0x58465342)
+    {
+        return 0;
+    }
+    *name = "xfs";
+    uint32_t block_size = get_be32(sb + 4);
+    uint64_t dblocks = get_be64(sb + 8);
+    uint32_t ag_blocks = get_be32(sb + 84);
+    uint32_t ag_count = get_be32(sb + 88);
+    uint16_t version = get_be16(sb + 100) & 0xF;
+    uint16_t sector_size = get_be16(sb + 102);
+    uint64_t free_blocks = get_be64(sb + 144);
+    if (block_size < 512 || block_size > 65536 || (block_size & (block_size - 1)) || sector_size < 512 || sector_size > block_size || ag_blocks == 0 ||
+        ag_count == 0 || dblocks > size / block_size || (uint64_t)ag_blocks * (ag_count - 1) >= dblocks || free_blocks > dblocks)
+    {
+        return -1;
+    }
+    // Short-form btree block header: magic, level, numrecs, siblings; v5 adds blkno, lsn, uuid, owner, crc.
+    size_t header = version == 5 ? 56 : 16;
+    uint32_t magic = version == 5 ? 0x41423342 : 0x41425442;
+    size_t max_records = (block_size - header) / 12;
+    unsigned char *block = malloc(block_size);
+    if (block == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    int ret = 1;
+    for (uint32_t ag = 0; ret && ag < ag_count; ++ag)
+    {
+        uint64_t ag_start = start + (uint64_t)ag * ag_blocks * block_size;
+        unsigned char agf[64];
+        if (read_fully(fd, agf, sizeof(agf), ag_start + sector_size) != sizeof(agf) || get_be32(agf) != 0x58414746)
+        {
+            ret = 0;
+            break;
+        }
+        uint32_t ag_length = get_be32(agf + 12);
+        uint32_t node = get_be32(agf + 16);
+        uint32_t levels = get_be32(agf + 28);
+        if (ag_length > ag_blocks || levels == 0 || levels > 8)
+        {
+            ret = 0;
+            break;
+        }
+        // Down the leftmost edge, then along the leaves through their right siblings.
+        uint64_t cursor = 0;
+        for (uint64_t visited = 0; ret; ++visited)
+        {
+            if (node >= ag_length || visited > ag_length ||
+                read_fully(fd, block, block_size, ag_start + (uint64_t)node * block_size) != (ssize_t)block_size || get_be32(block) != magic)
+            {
+                ret = 0;
+                break;
+            }
+            uint16_t level = get_be16(block + 4);
+            uint16_t records = get_be16(block + 6);
+            if (level > 0)
+            {
+                node = get_be32(block + header + max_records * 8);
+                continue;
+            }
+            for (uint16_t i = 0; i < records && header + (i + 1) * 8U <= block_size; ++i)
+            {
+                uint32_t free_start = get_be32(block + header + i * 8);
+                uint32_t free_length = get_be32(block + header + i * 8 + 4);
+                if (free_start < cursor || (uint64_t)free_start + free_length > ag_length)
+                {
+                    ret = 0;
+                    break;
+                }
+                add_allocated_range(map, ag_start + cursor * block_size, (free_start - cursor) * (uint64_t)block_size);
+                cursor = free_start + free_length;
+            }
+            node = get_be32(block + 12);
+            if (node == 0xFFFFFFFF)
+            {
+                break;
+            }
+        }
+        add_allocated_range(map, ag_start + cursor * block_size, (ag_length - cursor) * (uint64_t)block_size);
+    }
+    free(block);
+    *used = (dblocks - free_blocks) * block_size;
+    return ret ? 1 : -1;
+}
+
+/**
+ * @brief Adds one partition (or the whole source) to the map: the allocated blocks if it holds
+ * ext2/3/4 or XFS, otherwise all of it. Prints a line for the summary table.
+ */
+void map_partition_allocation(int fd, const char *label, uint64_t start, uint64_t size, struct allocation_map *map)
+{
+    const char *name = "-";
+    uint64_t used = 0;
+    size_t first = map->num_extents;
+    int found = map_ext4_allocation(fd, start, size, map, &used, &name);
+    if (found == 0)
+    {
+        found = map_xfs_allocation(fd, start, size, map, &used, &name);
+    }
+    if (found != 1)
+    {
+        map->num_extents = first;
+        add_allocated_range(map, start, size);
+        used = size;
+    }
+    map->allocated += used;
+    printf("  %-20s %-5s %12.1f MB %12.1f MB  %s\n", label, name, size / 1e6, used / 1e6,
+           found == 1 ? "allocated blocks" : found < 0 ? "copied whole (unsupported layout)" : "copied whole (no ext or XFS filesystem)");
+}
+
+int compare_allocation_extents(const void *a, const void *b)
+{
+    const struct allocation_extent *x = a;
+    const struct allocation_extent *y = b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/**
+ * @brief Builds the list of ranges to copy from the GPT and the filesystems in it. Space
+ * outside the partitions (protective MBR, both GPT copies, gaps) is always copied. A source
+ * without a GPT is probed as one filesystem.
+ *
+ * The ranges come back sorted, widened to IO_ALIGNMENT and merged across gaps smaller than
+ * min_gap, since reading a short gap costs less than an extra request.
+ */
+void build_allocation_map(int fd, uint64_t source_size, uint64_t min_gap, struct allocation_map *map)
+{
+    unsigned char header[512];
+    uint64_t sector = 0;
+    for (uint64_t candidate = 512; candidate <= 4096 && !sector; candidate *= 8)
+    {
+        if (read_fully(fd, header, sizeof(header), candidate) == sizeof(header) && memcmp(header, "EFI PART", 8) == 0)
+        {
+            sector = candidate;
+        }
+    }
+    uint64_t entries_lba = sector ? get_le64(header + 72) : 0;
+    uint32_t num_entries = sector ? get_le32(header + 80) : 0;
+    uint32_t entry_size = sector ? get_le32(header + 84) : 0;
+    printf("  %-20s %-5s %15s %15s\n", "Partition", "FS", "Size", "In use");
+    if (!sector || entry_size < 128 || entry_size > 4096 || num_entries == 0 || num_entries > 4096 ||
+        entries_lba * sector + (uint64_t)num_entries * entry_size > source_size)
+    {
+        map_partition_allocation(fd, "(whole source)", 0, source_size, map);
+    }
+    else
+    {
+        unsigned char *entries = malloc((size_t)num_entries * entry_size);
+        if (entries == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        if (read_fully(fd, entries, (size_t)num_entries * entry_size, entries_lba * sector) != (ssize_t)num_entries * entry_size)
+        {
+            fprintf(stderr, "Error: Could not read the GPT partition entries: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        struct allocation_extent *partitions = calloc(num_entries, sizeof(*partitions));
+        unsigned *numbers = calloc(num_entries, sizeof(*numbers));
+        size_t num_partitions = 0;
+        for (uint32_t i = 0; i < num_entries; ++i)
+        {
+            const unsigned char *entry = entries + (size_t)i * entry_size;
+            static const unsigned char unused[16];
+            uint64_t first = get_le64(entry + 32);
+            uint64_t last = get_le64(entry + 40);
+            if (memcmp(entry, unused, sizeof(unused)) == 0 || last < first || (last + 1) * sector > source_size)
+            {
+                continue;
+            }
+            // Insertion sort by start; a GPT rarely has more than a handful of entries in use.
+            size_t j = num_partitions++;
+            for (; j > 0 && partitions[j - 1].offset > first * sector; --j)
+            {
+                partitions[j] = partitions[j - 1];
+                numbers[j] = numbers[j - 1];
+            }
+            partitions[j] = (struct allocation_extent){first * sector, (last - first + 1) * sector};
+            numbers[j] = i;
+        }
+        uint64_t cursor = 0;
+        for (size_t p = 0; p < num_partitions; ++p)
+        {
+            if (partitions[p].offset > cursor)
+            {
+                add_allocated_range(map, cursor, partitions[p].offset - cursor);
+                map->allocated += partitions[p].offset - cursor;
+            }
+            // Partition names are UTF-16LE; anything outside ASCII is shown as '?'.
+            const unsigned char *entry = entries + (size_t)numbers[p] * entry_size;
+            char label[64];
+            int length = snprintf(label, sizeof(label), "%u ", numbers[p] + 1);
+            for (int c = 0; c < 36 && length < 20 && get_le16(entry + 56 + 2 * c); ++c)
+            {
+                uint16_t ch = get_le16(entry + 56 + 2 * c);
+                label[length++] = ch >= 0x20 && ch < 0x7F ? ch : '?';
+            }
+            label[length] = '\0';
+            map_partition_allocation(fd, label, partitions[p].offset, partitions[p].length, map);
+            uint64_t end = partitions[p].offset + partitions[p].length;
+            cursor = end > cursor ? end : cursor;
+        }
+        if (cursor < source_size)
+        {
+            add_allocated_range(map, cursor, source_size - cursor);
+            map->allocated += source_size - cursor;
+        }
+        printf("  GPT with %zu partition(s), %llu-byte sectors; space outside them is copied whole\n", num_partitions, (unsigned long long)sector);
+        free(numbers);
+        free(partitions);
+        free(entries);
+    }
+
+    qsort(map->extents, map->num_extents, sizeof(*map->extents), compare_allocation_extents);
+    size_t merged = 0;
+    for (size_t i = 0; i < map->num_extents; ++i)
+    {
+        uint64_t offset = map->extents[i].offset / IO_ALIGNMENT * IO_ALIGNMENT;
+        uint64_t end = (map->extents[i].offset + map->extents[i].length + IO_ALIGNMENT - 1) / IO_ALIGNMENT * IO_ALIGNMENT;
+        end = end < source_size ? end : source_size;
+        struct allocation_extent *last = merged ? &map->extents[merged - 1] : NULL;
+        if (last != NULL && offset <= last->offset + last->length + min_gap)
+        {
+            last->length = end > last->offset + last->length ? end - last->offset : last->length;
+            continue;
+        }
+        map->extents[merged++] = (struct allocation_extent){offset, end - offset};
+    }
+    map->num_extents = merged;
+}
+
+/**
+ * @brief Copies only the allocated ranges of source_path into a sparse image with the selected
+ * engine and returns the durable transfer rate in MB/s. stats->bytes_unallocated is what was
+ * left as holes.
+ */
+double allocated_copy(const char *source_path, const char *target_path, size_t block_size, struct copy_stats *stats)
+{
+    struct copy_session session;
+    open_copy_session(&session, source_path, target_path, block_size, 1);
+    session.show_progress = 1;
+    struct stat st;
+    if (fstat(session.target_fd, &st) == 0 && !S_ISREG(st.st_mode))
+    {
+        print_colored("\033[1;33m", "Warning: %s is not a regular file; unallocated blocks keep whatever it held before.\n", target_path);
+    }
+
+    struct allocation_map map = {0};
+    double map_start = monotonic_seconds();
+    print_colored("\033[1;32m", "Allocation map of %s:\n", source_path);
+    build_allocation_map(session.source_fd, session.source_size, block_size > ALLOCATION_MIN_GAP ? block_size : ALLOCATION_MIN_GAP, &map);
+    uint64_t to_copy = 0;
+    for (size_t i = 0; i < map.num_extents; ++i)
+    {
+        to_copy += map.extents[i].length;
+    }
+    print_colored("\033[1;35m", "In use: %llu of %llu bytes (%.1f%%); copying %llu bytes in %zu extent(s), mapped in %.2f s\n",
+                  (unsigned long long)map.allocated, (unsigned long long)session.source_size,
+                  session.source_size ? 100.0 * map.allocated / session.source_size : 0, (unsigned long long)to_copy, map.num_extents,
+                  monotonic_seconds() - map_start);
+
+    struct io_metrics *metrics = start_io_metrics(&session);
+    metrics->expected_bytes = to_copy;
+    double start = monotonic_seconds();
+    for (size_t i = 0; i < map.num_extents; ++i)
+    {
+        if (copy_session_range(&session, map.extents[i].offset, map.extents[i].length) != 0)
+        {
+            publish_metrics();
+            fprintf(stderr, "\nError: Copy from %s to %s failed at extent %llu+%llu: %s\n", source_path, target_path,
+                    (unsigned long long)map.extents[i].offset, (unsigned long long)map.extents[i].length, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    stop_io_metrics(metrics);
+    session.stats.elapsed_seconds = monotonic_seconds() - start;
+    report_copy_progress(&session, start, 1);
+    if (fstat(session.target_fd, &st) == 0 && S_ISREG(st.st_mode) && ftruncate(session.target_fd, session.source_size) != 0)
+    {
+        fprintf(stderr, "Error: Could not extend %s to %llu bytes: %s\n", target_path, (unsigned long long)session.source_size, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (hash_image)
+    {
+        attach_image_hasher(&session, session.source_size);
+        hash_resumed_prefix(&session, session.source_size);
+        finish_image_hasher(session.hasher, session.source_size);
+        session.hasher = NULL;
+    }
+    flush_copy_session(&session);
+    close_copy_session(&session);
+    session.stats.bytes_unallocated = session.source_size - session.stats.bytes_copied;
+    print_colored("\033[1;35m", "Allocated %llu bytes, copied %llu bytes (metadata and short gaps included), skipped %llu bytes (%.1f%%) as holes\n",
+                  (unsigned long long)map.allocated, (unsigned long long)session.stats.bytes_copied, (unsigned long long)session.stats.bytes_unallocated,
+                  session.source_size ? 100.0 * session.stats.bytes_unallocated / session.source_size : 0);
+    free(map.extents);
+
+    if (stats != NULL)
+    {
+        *stats = session.stats;
+    }
+    return durable_rate(&session.stats);
+}
+
+/**
+ * @brief One output of a fan-out copy: its own session (target fd, sparse state, page cache
+ * window, stats) and how far its writer has consumed the shared ring.
+ */
+struct fanout_target
+{
+    struct fanout_copy *copy;
+    struct copy_session session;
+    struct cache_window window;
+    uint64_t tail;
+    double starved_seconds;
+    double limiting_seconds;
+    int error;
+};
+
+/**
+ * @brief Ring of source blocks shared by all targets: the reader fills slot head % capacity
+ * once every writer has moved past it, so the slowest target sets the pace and the others
+ * simply wait for data. Each block is read exactly once.
+ */
+struct fanout_copy
+{
+    struct pipeline_slot *slots;
+    unsigned capacity;
+    uint64_t head;
+    int done;
+    int error;
+    struct fanout_target *targets;
+    size_t num_targets;
+};
+
+void *fanout_writer(void *arg)
+{
+    struct fanout_target *target = arg;
+    struct fanout_copy *copy = target->copy;
+    struct copy_session *session = &target->session;
+
+    for (;;)
+    {
+        uint64_t tail = target->tail;
+        if (tail == __atomic_load_n(&copy->head, __ATOMIC_ACQUIRE))
+        {
+            if ((__atomic_load_n(&copy->done, __ATOMIC_ACQUIRE) && tail == __atomic_load_n(&copy->head, __ATOMIC_ACQUIRE)) ||
+                __atomic_load_n(&copy->error, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+            double stall_start = monotonic_seconds();
+            unsigned spins = 0;
+            while (tail == __atomic_load_n(&copy->head, __ATOMIC_ACQUIRE) && !__atomic_load_n(&copy->done, __ATOMIC_ACQUIRE) &&
+                   !__atomic_load_n(&copy->error, __ATOMIC_RELAXED))
+            {
+                pipeline_backoff(&spins);
+            }
+            target->starved_seconds += monotonic_seconds() - stall_start;
+            continue;
+        }
+
+        struct pipeline_slot *slot = &copy->slots[tail % copy->capacity];
+        double write_start = monotonic_seconds();
+        if (!skip_zero_block(session, slot->buffer, slot->length) && write_fully(session->target_fd, slot->buffer, slot->length, slot->offset) < 0)
+        {
+            target->error = errno;
+            __atomic_store_n(&copy->error, errno, __ATOMIC_RELAXED);
+            break;
+        }
+        session->stats.write_seconds += monotonic_seconds() - write_start;
+        session->stats.bytes_copied += slot->length;
+        release_page_cache(session, &target->window, slot->offset, slot->length);
+        __atomic_store_n(&target->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    finish_page_cache(session, &target->window);
+    return NULL;
+}
+
+/**
+ * @brief Index of the target whose writer is furthest behind (the one holding the ring).
+ */
+size_t fanout_slowest(struct fanout_copy *copy, uint64_t *tail)
+{
+    size_t slowest = 0;
+    *tail = UINT64_MAX;
+    for (size_t i = 0; i < copy->num_targets; ++i)
+    {
+        uint64_t t = __atomic_load_n(&copy->targets[i].tail, __ATOMIC_ACQUIRE);
+        if (t < *tail)
+        {
+            *tail = t;
+            slowest = i;
+        }
+    }
+    return slowest;
+}
+
+/**
+ * @brief Copies source to every target with one reader and one writer thread per target.
+ *
+ * The reader blocks only while the slowest target still holds the oldest of queue_depth
+ * buffers; that time is charged to the target as "limiting". Per-target write, starvation and
+ * flush times are printed at the end.
+ * @return The durable rate in MB/s of the whole fan-out (until the last target is flushed).
+ */
+double fanout_copy(const char *source_path, char **target_paths, size_t num_targets, size_t block_size, struct copy_stats *stats)
+{
+    struct fanout_copy copy;
+    memset(&copy, 0, sizeof(copy));
+    copy.num_targets = num_targets;
+    copy.capacity = queue_depth < 2 ? 2 : queue_depth;
+    copy.targets = calloc(num_targets, sizeof(struct fanout_target));
+    copy.slots = calloc(copy.capacity, sizeof(struct pipeline_slot));
+    pthread_t *threads = calloc(num_targets, sizeof(pthread_t));
+    if (copy.targets == NULL || copy.slots == NULL || threads == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < copy.capacity; ++i)
+    {
+        copy.slots[i].buffer = allocate_io_buffer(block_size);
+    }
+
+    // Each target gets a full session so sparse output and page cache control work per target;
+    // only the first session's source descriptor is read from.
+    for (size_t i = 0; i < num_targets; ++i)
+    {
+        copy.targets[i].copy = &copy;
+        open_copy_session(&copy.targets[i].session, source_path, target_paths[i], block_size, 1);
+    }
+    struct copy_session *reader = &copy.targets[0].session;
+    struct copy_session progress;
+    memset(&progress, 0, sizeof(progress));
+    progress.show_progress = 1;
+    if (hash_image)
+    {
+        attach_image_hasher(reader, reader->source_size);
+    }
+
+    double start = monotonic_seconds();
+    for (size_t i = 0; i < num_targets; ++i)
+    {
+        if (pthread_create(&threads[i], NULL, fanout_writer, &copy.targets[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint64_t offset = 0;
+    uint64_t bytes_read = 0;
+    double read_seconds = 0;
+    while (!__atomic_load_n(&copy.error, __ATOMIC_RELAXED))
+    {
+        uint64_t head = copy.head;
+        uint64_t tail;
+        size_t slowest = fanout_slowest(&copy, &tail);
+        if (head - tail >= copy.capacity)
+        {
+            double stall_start = monotonic_seconds();
+            unsigned spins = 0;
+            while (head - __atomic_load_n(&copy.targets[slowest].tail, __ATOMIC_ACQUIRE) >= copy.capacity && !__atomic_load_n(&copy.error, __ATOMIC_RELAXED))
+            {
+                pipeline_backoff(&spins);
+            }
+            copy.targets[slowest].limiting_seconds += monotonic_seconds() - stall_start;
+            continue;
+        }
+
+        struct pipeline_slot *slot = &copy.slots[head % copy.capacity];
+        // O_DIRECT needs aligned lengths, so a short final block is read rounded up and trimmed.
+        double read_start = monotonic_seconds();
+        ssize_t got = read_fully(reader->source_fd, slot->buffer, block_size, offset);
+        if (got < 0 && errno == EINVAL && clear_direct_io_for_tail(reader->source_fd, block_size))
+        {
+            got = read_fully(reader->source_fd, slot->buffer, block_size, offset);
+        }
+        read_seconds += monotonic_seconds() - read_start;
+        if (got < 0)
+        {
+            __atomic_store_n(&copy.error, errno, __ATOMIC_RELAXED);
+            break;
+        }
+        if (got == 0)
+        {
+            break;
+        }
+        hasher_add(reader->hasher, offset, slot->buffer, got);
+        slot->offset = offset;
+        slot->length = got;
+        __atomic_store_n(&copy.head, head + 1, __ATOMIC_RELEASE);
+        offset += got;
+        bytes_read = offset;
+
+        progress.stats.bytes_copied = offset;
+        report_copy_progress(&progress, start, 0);
+        if ((size_t)got < block_size)
+        {
+            break;
+        }
+    }
+    __atomic_store_n(&copy.done, 1, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < num_targets; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = monotonic_seconds() - start;
+    if (copy.error)
+    {
+        for (size_t i = 0; i < num_targets; ++i)
+        {
+            if (copy.targets[i].error)
+            {
+                fprintf(stderr, "\nError: Writing %s failed: %s\n", target_paths[i], strerror(copy.targets[i].error));
+            }
+        }
+        fprintf(stderr, "\nError: Fan-out copy from %s failed after %llu bytes: %s\n", source_path, (unsigned long long)bytes_read, strerror(copy.error));
+        exit(EXIT_FAILURE);
+    }
+    if (reader->hasher != NULL)
+    {
+        finish_image_hasher(reader->hasher, bytes_read);
+        reader->hasher = NULL;
+    }
+    report_copy_progress(&progress, start, 1);
+
+    // Targets are flushed one after another; the copy is durable when the last one is.
+    double flush_seconds = 0;
+    for (size_t i = 0; i < num_targets; ++i)
+    {
+        struct copy_session *session = &copy.targets[i].session;
+        session->stats.elapsed_seconds = elapsed;
+        finish_sparse_target(session, bytes_read);
+        flush_copy_session(session);
+        close_copy_session(session);
+        flush_seconds += session->stats.flush_seconds;
+    }
+
+    print_colored("\033[1;35m", "Read %llu bytes once in %.2f s (%.1f MB/s read rate)\n", (unsigned long long)bytes_read, read_seconds,
+                  read_seconds > 0 ? bytes_read / read_seconds / 1e6 : 0);
+    for (size_t i = 0; i < num_targets; ++i)
+    {
+        struct fanout_target *target = &copy.targets[i];
+        struct copy_stats *s = &target->session.stats;
+        print_colored("\033[1;35m", "  %s: %.1f MB/s buffered, %.1f MB/s durable (%.2f s flush), writes %.2f s, waited %.2f s for data, held the reader %.2f s\n",
+                      target_paths[i], buffered_rate(s), durable_rate(s), s->flush_seconds, s->write_seconds, target->starved_seconds, target->limiting_seconds);
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->bytes_copied = bytes_read;
+    stats->elapsed_seconds = elapsed;
+    stats->flush_seconds = flush_seconds;
+    stats->read_seconds = read_seconds;
+    stats->open_seconds = copy.targets[0].session.stats.open_seconds;
+    for (size_t i = 0; i < num_targets; ++i)
+    {
+        stats->bytes_skipped += copy.targets[i].session.stats.bytes_skipped;
+        stats->write_seconds += copy.targets[i].session.stats.write_seconds;
+    }
+
+    for (unsigned i = 0; i < copy.capacity; ++i)
+    {
+        free(copy.slots[i].buffer);
+    }
+    free(copy.slots);
+    free(copy.targets);
+    free(threads);
+    return durable_rate(stats);
+}
+
+/**
+ * @brief Writes the .hashes and .sha256 files of from_image for the identical to_image, naming
+ * to_image in the "# image:" line and the checksum line so sha256sum -c checks the right file.
+ */
+void copy_hash_files(const char *from_image, const char *to_image)
+{
+    char name[MAX_PATH];
+    snprintf(name, sizeof(name), "%s", to_image);
+    const char *to_name = basename(name);
+    const char *suffixes[] = {".hashes", ".sha256"};
+    for (size_t s = 0; s < sizeof(suffixes) / sizeof(suffixes[0]); ++s)
+    {
+        char from[MAX_PATH + 8];
+        char to[MAX_PATH + 8];
+        snprintf(from, sizeof(from), "%s%s", from_image, suffixes[s]);
+        snprintf(to, sizeof(to), "%s%s", to_image, suffixes[s]);
+        FILE *input = fopen(from, "r");
+        FILE *output = input == NULL ? NULL : fopen(to, "w");
+        if (input == NULL || output == NULL)
+        {
+            fprintf(stderr, "Error: Could not copy %s to %s: %s\n", from, to, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        char *line = NULL;
+        size_t line_size = 0;
+        char digest[65];
+        while (getline(&line, &line_size, input) >= 0)
+        {
+            if (strncmp(line, "# image: ", 9) == 0)
+            {
+                fprintf(output, "# image: %s\n", to_name);
+            }
+            else if (s == 1 && sscanf(line, "%64s", digest) == 1)
+            {
+                fprintf(output, "%s  %s\n", digest, to_name);
+            }
+            else
+            {
+                fputs(line, output);
+            }
+        }
+        free(line);
+        fclose(input);
+        if (fclose(output) != 0)
+        {
+            fprintf(stderr, "Error: Could not write %s: %s\n", to, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * @brief Copies one source to several images at once: the fan-out counterpart of final_copy().
+ *
+ * With --hash the manifest is computed once and written next to every image; --verify then
+ * checks each image against it.
+ */
+void fanout_final_copy(const char *source, char **output_file_paths, size_t num_outputs)
+{
+    if (compress_output != COMPRESS_NONE || incremental_base != NULL || resume_copy || rescue_mode || allocated_only)
+    {
+        print_colored("\033[1;33m", "Warning: --compress, --incremental, --resume, --rescue and --allocated-only are not available with fan-out; writing raw images.\n");
+    }
+    print_colored("\033[1;32m", "Fan-out copy of %s to %zu targets, block size %s%s, %u buffers\n", source, num_outputs, best_block_size,
+                  use_direct_io ? " (O_DIRECT)" : "", queue_depth < 2 ? 2 : queue_depth);
+    struct copy_stats stats;
+    double rate = fanout_copy(source, output_file_paths, num_outputs, parse_size(best_block_size), &stats);
+    print_colored("\033[1;35m", "Copied %llu bytes to %zu targets in %.2f s (%.2f MB/s buffered, %.2f MB/s durable after %.2f s of flushes)\n",
+                  (unsigned long long)stats.bytes_copied, num_outputs, stats.elapsed_seconds + stats.flush_seconds, buffered_rate(&stats), rate,
+                  stats.flush_seconds);
+
+    if (hash_image)
+    {
+        // The first image carries the manifest; the others are byte-identical.
+        for (size_t i = 1; i < num_outputs; ++i)
+        {
+            copy_hash_files(output_file_paths[0], output_file_paths[i]);
+        }
+    }
+    for (size_t i = 0; verify_output && i < num_outputs; ++i)
+    {
+        verify_image(source, output_file_paths[i]);
+    }
+}
+
+/**
+ * @brief Performs the real copy of a source device into an image file with the best block size.
+ *
+ * Uses the in-process engine unless --engine dd was requested, in which case the previous
+ * external `dd` invocation is kept.
+ *
+ * @param source The input file or device (e.g., /dev/nvme0n1).
+ * @param output_file_path The image file to create on the mounted target.
+ */
+void final_copy(const char *source, const char *output_file_path)
+{
+    if (rescue_mode && (incremental_base != NULL || compress_output != COMPRESS_NONE))
+    {
+        print_colored("\033[1;31m", "Error: --rescue writes a raw image and cannot be combined with --compress or --incremental.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (allocated_only && (incremental_base != NULL || compress_output != COMPRESS_NONE || rescue_mode))
+    {
+        print_colored("\033[1;31m", "Error: --allocated-only writes a sparse raw image and cannot be combined with --compress, --incremental or --rescue.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (resume_copy && (incremental_base != NULL || compress_output != COMPRESS_NONE))
+    {
+        print_colored("\033[1;33m", "Warning: --resume applies to raw images; incremental and compressed copies start over.\n");
+    }
+    if (incremental_base != NULL)
+    {
+        if (compress_output != COMPRESS_NONE)
+        {
+            print_colored("\033[1;31m", "Error: --incremental writes raw chunks and cannot be combined with --compress.\n");
+            exit(EXIT_FAILURE);
+        }
+        struct copy_stats stats;
+        double rate = incremental_copy(source, output_file_path, &stats);
+        print_colored("\033[1;35m", "Scanned %llu bytes in %.2f s (%.2f MB/s durable after a %.2f s flush)\n", (unsigned long long)stats.bytes_copied,
+                      stats.elapsed_seconds + stats.flush_seconds, rate, stats.flush_seconds);
+        if (verify_output && patch_base)
+        {
+            verify_image(source, output_file_path);
+        }
+        else if (verify_output)
+        {
+            print_colored("\033[1;33m", "Warning: a delta is not an image; --materialize checks the result against the manifest instead.\n");
+        }
+        return;
+    }
+    if (compress_output != COMPRESS_NONE)
+    {
+        // Compression runs its own reader/compressor/writer pipeline whatever engine won.
+        char container_path[MAX_PATH];
+        compressed_path(output_file_path, container_path, sizeof(container_path));
+        load_compressor(compress_output);
+        if (compress_level > max_compress_level(compress_output))
+        {
+            fprintf(stderr, "Error: %s levels go up to %d\n", compressor_names[compress_output], max_compress_level(compress_output));
+            exit(EXIT_FAILURE);
+        }
+        int level = compress_level ? compress_level : choose_compress_level(source, container_path);
+        print_colored("\033[1;32m", "Compressing %s to %s with %s level %d, %llu-byte frames, %u thread(s)\n", source, container_path,
+                      compressor_names[compress_output], level, (unsigned long long)frame_size_bytes, resolve_compress_threads());
+        if (sparse_output || verify_output)
+        {
+            print_colored("\033[1;33m", "Warning: --sparse and --verify apply to raw images; --extract checks every frame checksum instead.\n");
+        }
+        struct copy_stats stats;
+        char image_path[MAX_PATH];
+        snprintf(image_path, sizeof(image_path), "%.*s", (int)(strlen(container_path) - strlen(compressor_suffixes[compress_output])), container_path);
+        double rate = compressed_copy(source, image_path, container_path, level, &stats);
+        print_colored("\033[1;35m", "Copied %llu bytes in %.2f s (%.2f MB/s buffered, %.2f MB/s durable after a %.2f s flush)\n",
+                      (unsigned long long)stats.bytes_copied, stats.elapsed_seconds + stats.flush_seconds, buffered_rate(&stats), rate, stats.flush_seconds);
+        return;
+    }
+    if (rescue_mode)
+    {
+        // Rescue runs its own pass structure over the map whatever engine won.
+        print_colored("\033[1;32m", "Rescuing %s to %s, block size %s%s, %u retries of unreadable sectors\n", source, output_file_path, best_block_size,
+                      use_direct_io ? " (O_DIRECT)" : "", rescue_retries);
+        struct copy_stats stats;
+        double rate = rescue_copy(source, output_file_path, parse_size(best_block_size), &stats);
+        print_colored("\033[1;35m", "Rescued %llu bytes in %.2f s (%.2f MB/s durable after a %.2f s flush)\n", (unsigned long long)stats.bytes_copied,
+                      stats.elapsed_seconds + stats.flush_seconds, rate, stats.flush_seconds);
+        print_latency_summary(last_io_metrics);
+        char json_path[MAX_PATH];
+        snprintf(json_path, sizeof(json_path), "%s.json", output_file_path);
+        write_copy_result_json(json_path, source, output_file_path, best_block_size, &stats, last_io_metrics);
+        print_colored("\033[1;34m", "Run metrics written to %s\n", json_path);
+        if (verify_output && stats.bytes_unreadable > 0)
+        {
+            print_colored("\033[1;33m", "Warning: the image has zero-filled sectors the source cannot deliver, skipping --verify.\n");
+        }
+        else if (verify_output)
+        {
+            verify_image(source, output_file_path);
+        }
+        return;
+    }
+    if (allocated_only)
+    {
+        if (resume_copy || adaptive_tuning)
+        {
+            print_colored("\033[1;33m", "Warning: --resume and --adaptive work on one contiguous range; copying the allocated extents without them.\n");
+        }
+        if (copy_engine == ENGINE_DD)
+        {
+            print_colored("\033[1;33m", "Warning: dd cannot copy an extent list, copying with the native engine instead.\n");
+            copy_engine = ENGINE_NATIVE;
+        }
+        print_colored("\033[1;32m", "Copying the allocated blocks of %s to %s with the %s engine, block size %s%s\n", source, output_file_path,
+                      copy_engine_names[copy_engine], best_block_size, use_direct_io ? " (O_DIRECT)" : "");
+        struct copy_stats stats;
+        double rate = allocated_copy(source, output_file_path, parse_size(best_block_size), &stats);
+        print_colored("\033[1;35m", "Copied %llu bytes in %.2f s (%.2f MB/s buffered, %.2f MB/s durable after a %.2f s flush)\n",
+                      (unsigned long long)stats.bytes_copied, stats.elapsed_seconds + stats.flush_seconds, buffered_rate(&stats), rate, stats.flush_seconds);
+        print_latency_summary(last_io_metrics);
+        char json_path[MAX_PATH];
+        snprintf(json_path, sizeof(json_path), "%s.json", output_file_path);
+        write_copy_result_json(json_path, source, output_file_path, best_block_size, &stats, last_io_metrics);
+        print_colored("\033[1;34m", "Run metrics written to %s\n", json_path);
+        if (verify_output)
+        {
+            print_colored("\033[1;33m", "Warning: free blocks differ from the source by design, skipping --verify; use --hash to fingerprint the image.\n");
+        }
+        return;
+    }
+    if (copy_engine == ENGINE_DD && resume_copy)
+    {
+        // dd keeps no journal; native issues the same pread/pwrite pattern and does.
+        print_colored("\033[1;33m", "Warning: dd cannot resume, copying with the native engine instead.\n");
+        copy_engine = ENGINE_NATIVE;
+    }
+    if (copy_engine == ENGINE_DD && (metrics_file != NULL || metrics_socket != NULL))
+    {
+        print_colored("\033[1;33m", "Warning: dd exposes no live counters, copying with the native engine instead.\n");
+        copy_engine = ENGINE_NATIVE;
+    }
+    if (copy_engine == ENGINE_DD && (max_rate_bytes || max_iops || latency_target_us))
+    {
+        print_colored("\033[1;33m", "Warning: dd cannot be rate limited, copying with the native engine instead.\n");
+        copy_engine = ENGINE_NATIVE;
+    }
+    if (copy_engine == ENGINE_DD)
+    {
+        char dd_command[MAX_PATH * 2];
+        snprintf(dd_command, sizeof(dd_command), "dd if=%s of=%s bs=%s%s conv=%sfdatasync status=progress", source, output_file_path, best_block_size,
+                 use_direct_io ? " iflag=direct oflag=direct" : "", sparse_output ? "sparse," : "");
+        print_colored("\033[1;32m", "Executing: %s\n", dd_command);
+        if (hash_image)
+        {
+            print_colored("\033[1;33m", "Warning: dd cannot hash inline; use an in-process engine for --hash or --verify.\n");
+        }
+        execute_command(dd_command);
+        return;
+    }
+
+    print_colored("\033[1;32m", "Copying %s to %s with the %s engine, block size %s%s\n", source, output_file_path, copy_engine_names[copy_engine],
+                  best_block_size, use_direct_io ? " (O_DIRECT)" : "");
+    if (copy_engine == ENGINE_URING)
+    {
+        print_colored("\033[1;32m", "Queue depth: %u\n", queue_depth);
+    }
+    else if (copy_engine == ENGINE_STRIPED)
+    {
+        print_colored("\033[1;32m", "Threads: %u, chunk size: %llu bytes\n", copy_threads, (unsigned long long)chunk_size_bytes);
+    }
+    else if (copy_engine == ENGINE_PIPELINE)
+    {
+        print_colored("\033[1;32m", "Ring buffers: %u\n", queue_depth);
+    }
+    struct copy_stats stats;
+    double rate;
+    if (adaptive_tuning)
+    {
+        rate = adaptive_copy(source, output_file_path, parse_size(best_block_size), &stats);
+    }
+    else
+    {
+        rate = engine_copy(source, output_file_path, parse_size(best_block_size), 0, 1, hash_image, resume_copy, &stats);
+    }
+    print_colored("\033[1;35m", "Copied %llu bytes in %.2f s (%.2f MB/s buffered, %.2f MB/s durable after a %.2f s flush)\n",
+                  (unsigned long long)stats.bytes_copied, stats.elapsed_seconds + stats.flush_seconds, buffered_rate(&stats), rate, stats.flush_seconds);
+    print_latency_summary(last_io_metrics);
+    if (throttle.throttled_ns > 0 || throttle.backoffs > 0)
+    {
+        print_colored("\033[1;35m", "Rate limiter delayed requests by %.2f s in total; %u latency backoff(s), limit ended at %.1f MB/s\n", throttle.throttled_ns / 1e9,
+                      throttle.backoffs, throttle.bytes_per_second / 1e6);
+    }
+    char json_path[MAX_PATH];
+    snprintf(json_path, sizeof(json_path), "%s.json", output_file_path);
+    write_copy_result_json(json_path, source, output_file_path, best_block_size, &stats, last_io_metrics);
+    print_colored("\033[1;34m", "Run metrics written to %s\n", json_path);
+    if (sparse_output)
+    {
+        print_colored("\033[1;35m", "Skipped %llu zero bytes (%.1f%%) with the %s zero-block detector\n", (unsigned long long)stats.bytes_skipped,
+                      stats.bytes_copied ? 100.0 * stats.bytes_skipped / stats.bytes_copied : 0, zero_block_kernel);
+    }
+    if (copy_engine == ENGINE_PIPELINE)
+    {
+        print_colored("\033[1;35m", "Reader stalled %.2f s waiting for free buffers (target-bound), writer stalled %.2f s waiting for data (source-bound)\n",
+                      stats.reader_stall_seconds, stats.writer_stall_seconds);
+    }
+    if (verify_output)
+    {
+        verify_image(source, output_file_path);
+    }
+}
+
+
+void change_file_permissions(const char *file_path)
+{
+    if (chmod(file_path, 0666) != 0)
+    {
+        perror("chmod");
+        exit(EXIT_FAILURE);
+    }
+
+    // print_debug("Changed permissions of %s to 0666", file_path);
+}
+
+void change_permissions(const char *path)
+{
+    if (chmod(path, 0777) != 0)
+    {
+        perror("chmod");
+        exit(EXIT_FAILURE);
+    }
+
+    // print_debug("Changed permissions of %s to 0777", path);
+}
+
+struct bench_result
+{
+    struct bench_config config;
+    double *samples;
+    size_t num_samples;
+    double mean;
+    double median;
+    double stddev;
+    double ci_low;
+    double ci_high;
+    int round;
+    uint64_t sample_bytes;
+    uint64_t total_bytes; // over every round and warm-up run, for the benchmark cost
+    struct copy_stats phases;
+};
+
+void apply_bench_config(const struct bench_config *config)
+{
+    copy_engine = config->engine;
+    queue_depth = config->queue_depth;
+    copy_threads = config->threads;
+    use_direct_io = config->direct;
+}
+
+void describe_bench_config(const struct bench_config *config, char *buffer, size_t buffer_size)
+{
+    int len = snprintf(buffer, buffer_size, "%s bs=%s", copy_engine_names[config->engine], config->block_size);
+    if (engine_uses_queue_depth(config->engine) && len > 0 && (size_t)len < buffer_size)
+    {
+        len += snprintf(buffer + len, buffer_size - len, " qd=%u", config->queue_depth);
+    }
+    if (config->engine == ENGINE_STRIPED && len > 0 && (size_t)len < buffer_size)
+    {
+        len += snprintf(buffer + len, buffer_size - len, " threads=%u", config->threads);
+    }
+    if (config->direct && len > 0 && (size_t)len < buffer_size)
+    {
+        snprintf(buffer + len, buffer_size - len, " direct");
+    }
+}
+
+/**
+ * @brief Resource cost of a configuration, used to break ties between results within noise.
+ *
+ * Buffer memory in flight (block size x queue depth x threads) first, then engine complexity.
+ */
+double bench_config_cost(const struct bench_config *config)
+{
+    double cost = (double)parse_size(config->block_size);
+    if (engine_uses_queue_depth(config->engine))
+    {
+        cost *= config->queue_depth;
+    }
+    if (config->engine == ENGINE_STRIPED)
+    {
+        cost *= config->threads;
+    }
+    return cost + config->engine;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Two-sided 97.5% quantile of Student's t distribution for df degrees of freedom.
+ */
+double t_critical_95(double df)
+{
+    static const double table[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                   2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                   2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    if (df < 1)
+    {
+        return table[0];
+    }
+    if (df <= 30)
+    {
+        return table[(int)df - 1];
+    }
+    return 1.96;
+}
+
+void compute_bench_statistics(struct bench_result *result)
+{
+    size_t n = result->num_samples;
+    result->mean = result->median = result->stddev = 0;
+    result->ci_low = result->ci_high = 0;
+    if (n == 0)
+    {
+        return;
+    }
+
+    double sum = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        sum += result->samples[i];
+    }
+    result->mean = sum / n;
+
+    double *sorted = malloc(n * sizeof(double));
+    if (sorted == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(sorted, result->samples, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), compare_doubles);
+    result->median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    free(sorted);
+
+    if (n < 2)
+    {
+        result->ci_low = result->ci_high = result->mean;
+        return;
+    }
+    double squares = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        squares += (result->samples[i] - result->mean) * (result->samples[i] - result->mean);
+    }
+    result->stddev = sqrt(squares / (n - 1));
+    double half_width = t_critical_95(n - 1) * result->stddev / sqrt(n);
+    result->ci_low = result->mean - half_width;
+    result->ci_high = result->mean + half_width;
+}
+
+/**
+ * @brief Welch's t-test at the 95% level: is a's mean really different from b's?
+ *
+ * With fewer than two samples on either side there is no noise estimate, so any difference counts.
+ */
+int significantly_different(const struct bench_result *a, const struct bench_result *b)
+{
+    if (a->num_samples < 2 || b->num_samples < 2)
+    {
+        return a->mean != b->mean;
+    }
+    double va = a->stddev * a->stddev / a->num_samples;
+    double vb = b->stddev * b->stddev / b->num_samples;
+    if (va + vb == 0)
+    {
+        return a->mean != b->mean;
+    }
+    double t = fabs(a->mean - b->mean) / sqrt(va + vb);
+    double df = (va + vb) * (va + vb) / (va * va / (a->num_samples - 1) + vb * vb / (b->num_samples - 1));
+    return t > t_critical_95(df);
+}
+
+/**
+ * @brief Measures one configuration: warmup discarded runs, then bench_repetitions samples of length bytes.
+ *
+ * Samples from an earlier measurement (a smaller successive-halving round) are discarded.
+ */
+void measure_bench_config(struct bench_result *result, uint64_t length, unsigned warmup)
+{
+    free(result->samples);
+    result->samples = NULL;
+    result->num_samples = 0;
+    result->sample_bytes = length;
+    result->total_bytes += length * (warmup + bench_repetitions);
+    memset(&result->phases, 0, sizeof(result->phases));
+
+    apply_bench_config(&result->config);
+    for (unsigned i = 0; i < warmup; ++i)
+    {
+        print_colored("\033[1;34m", "Warm-up run %u/%u (discarded)\n", i + 1, warmup);
+        run_dd(result->config.block_size, length);
+    }
+    for (unsigned i = 0; i < bench_repetitions; ++i)
+    {
+        double rate = run_dd(result->config.block_size, length);
+        double *samples = realloc(result->samples, (result->num_samples + 1) * sizeof(double));
+        if (samples == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        result->samples = samples;
+        result->samples[result->num_samples++] = rate;
+        result->phases.bytes_copied += last_bench_stats.bytes_copied;
+        result->phases.elapsed_seconds += last_bench_stats.elapsed_seconds;
+        result->phases.open_seconds += last_bench_stats.open_seconds;
+        result->phases.read_seconds += last_bench_stats.read_seconds;
+        result->phases.write_seconds += last_bench_stats.write_seconds;
+        result->phases.flush_seconds += last_bench_stats.flush_seconds;
+    }
+    compute_bench_statistics(result);
+}
+
+/**
+ * @brief Picks the winning configuration among the results measured in the given round.
+ *
+ * The configuration with the highest mean only wins outright if it is significantly faster than
+ * every other one. Otherwise the cheapest configuration whose mean is statistically
+ * indistinguishable from the fastest is chosen, so noise never buys a larger buffer footprint.
+ */
+struct bench_result *pick_bench_winner(struct bench_result *results, size_t num_results, int round)
+{
+    struct bench_result *fastest = NULL;
+    for (size_t i = 0; i < num_results; ++i)
+    {
+        if (results[i].num_samples > 0 && results[i].round == round && (fastest == NULL || results[i].mean > fastest->mean))
+        {
+            fastest = &results[i];
+        }
+    }
+    if (fastest == NULL)
+    {
+        return NULL;
+    }
+
+    struct bench_result *winner = fastest;
+    size_t within_noise = 0;
+    for (size_t i = 0; i < num_results; ++i)
+    {
+        if (&results[i] == fastest || results[i].num_samples == 0 || results[i].round != round || significantly_different(fastest, &results[i]))
+        {
+            continue;
+        }
+        within_noise++;
+        if (bench_config_cost(&results[i].config) < bench_config_cost(&winner->config))
+        {
+            winner = &results[i];
+        }
+    }
+
+    char description[128];
+    describe_bench_config(&fastest->config, description, sizeof(description));
+    if (fastest->num_samples < 2)
+    {
+        print_colored("\033[1;32m", "Fastest configuration: %s (single run, use --repetitions for a significance test)\n", description);
+    }
+    else if (within_noise == 0)
+    {
+        print_colored("\033[1;32m", "Fastest configuration (%s) is significantly faster than all others.\n", description);
+    }
+    else
+    {
+        char winner_description[128];
+        describe_bench_config(&winner->config, winner_description, sizeof(winner_description));
+        print_colored("\033[1;33m", "%zu configuration(s) are within noise of the fastest (%s); choosing the cheapest: %s\n", within_noise, description,
+                      winner_description);
+    }
+    return winner;
+}
+
+void print_bench_results(struct bench_result *results, size_t num_results)
+{
+    print_colored("\033[1;33m", "%-40s %7s %4s %10s %10s %9s %23s\n", "Configuration", "Sample", "n", "Mean MB/s", "Median", "Stddev", "95% CI");
+    for (size_t i = 0; i < num_results; ++i)
+    {
+        if (results[i].num_samples == 0)
+        {
+            continue;
+        }
+        char description[128];
+        char sample_str[16];
+        describe_bench_config(&results[i].config, description, sizeof(description));
+        format_size(results[i].sample_bytes, sample_str, sizeof(sample_str));
+        printf("%-40s %7s %4zu %10.2f %10.2f %9.2f   [%9.2f, %9.2f]\n", description, sample_str, results[i].num_samples, results[i].mean,
+               results[i].median, results[i].stddev, results[i].ci_low, results[i].ci_high);
+    }
+}
+
+int bench_budget_exhausted(double start)
+{
+    return bench_time_budget > 0 && monotonic_seconds() - start >= bench_time_budget;
+}
+
+/**
+ * @brief Measures every candidate with the full copy size (stops early once --time-budget is spent).
+ *
+ * @return The round whose results should decide the winner (always 0).
+ */
+int run_exhaustive_search(struct bench_result *results, size_t num_results, uint64_t length, double start)
+{
+    for (size_t i = 0; i < num_results; ++i)
+    {
+        if (i > 0 && bench_budget_exhausted(start))
+        {
+            print_colored("\033[1;33m", "Time budget of %.0f s spent; skipping the remaining %zu configuration(s).\n", bench_time_budget, num_results - i);
+            break;
+        }
+        results[i].round = 0;
+        measure_bench_config(&results[i], length, bench_warmup);
+    }
+    return 0;
+}
+
+int compare_results_by_mean(const void *a, const void *b)
+{
+    const struct bench_result *x = *(struct bench_result *const *)a;
+    const struct bench_result *y = *(struct bench_result *const *)b;
+    return (x->mean < y->mean) - (x->mean > y->mean);
+}
+
+/**
+ * @brief Successive halving: all candidates run on a small sample, the better half survives and
+ * gets twice the bytes, until two finalists are left.
+ *
+ * With n candidates and rounds = ceil(log2(n)), round r copies copy_size x 2^r / 2^rounds bytes
+ * per candidate (at least HALVING_MIN_SAMPLE), so every round copies at most copy_size and the
+ * whole search about copy_size x log2(n) instead of copy_size x n; the two finalists run with
+ * copy_size / 2 each. If --time-budget runs out mid-round, the round's measured candidates decide
+ * (or the previous round's if none was measured yet).
+ *
+ * @return The round whose results should decide the winner.
+ */
+int run_successive_halving(struct bench_result *results, size_t num_results, uint64_t length, double start)
+{
+    const uint64_t HALVING_MIN_SAMPLE = 64ULL * 1024 * 1024;
+
+    struct bench_result **alive = malloc(num_results * sizeof(*alive));
+    if (alive == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t num_alive = num_results;
+    for (size_t i = 0; i < num_results; ++i)
+    {
+        alive[i] = &results[i];
+    }
+
+    // Halve until two finalists are left; each round's sample is sized so the round copies about copy_size.
+    int rounds = 1;
+    while (((size_t)1 << rounds) < num_results)
+    {
+        rounds++;
+    }
+
+    int round = 0;
+    for (;; ++round)
+    {
+        uint64_t sample = round < rounds ? length >> (rounds - round) : length;
+        if (sample < HALVING_MIN_SAMPLE)
+        {
+            sample = HALVING_MIN_SAMPLE < length ? HALVING_MIN_SAMPLE : length;
+        }
+
+        char sample_str[16];
+        format_size(sample, sample_str, sizeof(sample_str));
+        print_colored("\033[1;36m", "Successive halving round %d: %zu candidate(s), %s each\n", round + 1, num_alive, sample_str);
+
+        size_t measured = 0;
+        for (size_t i = 0; i < num_alive; ++i)
+        {
+            if (bench_budget_exhausted(start))
+            {
+                break;
+            }
+            alive[i]->round = round;
+            measure_bench_config(alive[i], sample, round == 0 ? bench_warmup : 0);
+            measured++;
+        }
+        if (measured < num_alive)
+        {
+            print_colored("\033[1;33m", "Time budget of %.0f s spent during round %d.\n", bench_time_budget, round + 1);
+            if (measured == 0)
+            {
+                round--;
+            }
+            break;
+        }
+        if (num_alive <= 2 || sample >= length)
+        {
+            break;
+        }
+
+        qsort(alive, num_alive, sizeof(*alive), compare_results_by_mean);
+        num_alive = (num_alive + 1) / 2;
+    }
+
+    free(alive);
+    return round;
+}
+
+/**
+ * @brief Builds the benchmark search space: engines x block sizes x queue depths x threads x direct I/O.
+ *
+ * Dimensions an engine ignores are collapsed to a single value so no configuration is measured
+ * twice: queue depth only varies for uring/pipeline, threads only for striped, and zerocopy is
+ * always buffered.
+ */
+struct bench_result *build_bench_candidates(size_t *num_results)
+{
+    unsigned default_queue_depth[] = {queue_depth};
+    unsigned default_threads[] = {copy_threads};
+    int default_direct[] = {use_direct_io};
+    unsigned *depths = bench_queue_depths ? bench_queue_depths : default_queue_depth;
+    size_t num_depths = bench_queue_depths ? num_bench_queue_depths : 1;
+    unsigned *threads = bench_thread_counts ? bench_thread_counts : default_threads;
+    size_t num_threads = bench_thread_counts ? num_bench_thread_counts : 1;
+    int *directs = bench_direct_modes ? bench_direct_modes : default_direct;
+    size_t num_directs = bench_direct_modes ? num_bench_direct_modes : 1;
+
+    size_t capacity = num_selected_engines * num_block_sizes * num_depths * num_threads * num_directs;
+    struct bench_result *results = calloc(capacity, sizeof(struct bench_result));
+    if (results == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t count = 0;
+    for (size_t e = 0; e < num_selected_engines; ++e)
+    {
+        enum copy_engine_type engine = selected_engines[e];
+        size_t engine_depths = engine_uses_queue_depth(engine) ? num_depths : 1;
+        size_t engine_threads = engine == ENGINE_STRIPED ? num_threads : 1;
+        size_t engine_directs = engine == ENGINE_ZEROCOPY ? 1 : num_directs;
+
+        for (size_t b = 0; b < num_block_sizes; ++b)
+        {
+            for (size_t q = 0; q < engine_depths; ++q)
+            {
+                for (size_t t = 0; t < engine_threads; ++t)
+                {
+                    for (size_t d = 0; d < engine_directs; ++d)
+                    {
+                        struct bench_config *config = &results[count++].config;
+                        config->engine = engine;
+                        snprintf(config->block_size, sizeof(config->block_size), "%s", block_sizes[b]);
+                        config->queue_depth = engine_uses_queue_depth(engine) ? depths[q] : queue_depth;
+                        config->threads = engine == ENGINE_STRIPED ? threads[t] : copy_threads;
+                        config->direct = engine == ENGINE_ZEROCOPY ? 0 : directs[d];
+                    }
+                }
+            }
+        }
+    }
+
+    *num_results = count;
+    return results;
+}
+
+/**
+ * @brief Writes every measured configuration to RESULT_DIR as benchmark_grid_<time>.csv and .json.
+ */
+void write_bench_grid(struct bench_result *results, size_t num_results, const struct bench_result *winner)
+{
+    char time_str[64];
+    time_t now = time(NULL);
+    strftime(time_str, sizeof(time_str), "%Y%m%d_%H%M%S", localtime(&now));
+
+    struct stat st;
+    if (stat(RESULT_DIR, &st) == -1 && mkdir(RESULT_DIR, 0777) != 0)
+    {
+        perror("mkdir");
+        exit(EXIT_FAILURE);
+    }
+
+    char csv_path[MAX_PATH];
+    char json_path[MAX_PATH];
+    snprintf(csv_path, sizeof(csv_path), "%s/benchmark_grid_%s.csv", RESULT_DIR, time_str);
+    snprintf(json_path, sizeof(json_path), "%s/benchmark_grid_%s.json", RESULT_DIR, time_str);
+
+    FILE *csv = fopen(csv_path, "w");
+    FILE *json = fopen(json_path, "w");
+    if (csv == NULL || json == NULL)
+    {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(csv, "engine,block_size,queue_depth,threads,direct,sample_bytes,round,samples,mean_mbs,median_mbs,stddev_mbs,ci95_low_mbs,ci95_high_mbs,buffered_mbs,durable_mbs,open_s,read_s,write_s,flush_s,winner\n");
+    fprintf(json, "{\n  \"input_file\": \"%s\",\n  \"copy_size\": \"%s\",\n  \"repetitions\": %u,\n  \"warmup\": %u,\n  \"search\": \"%s\",\n  \"rank_by\": \"%s\",\n  \"results\": [\n",
+            input_file, copy_size, bench_repetitions, bench_warmup, bench_search == SEARCH_HALVING ? "halving" : "exhaustive", bench_rank_buffered ? "buffered" : "durable");
+
+    int first = 1;
+    for (size_t i = 0; i < num_results; ++i)
+    {
+        const struct bench_result *r = &results[i];
+        const struct bench_config *c = &r->config;
+        int is_winner = r == winner;
+        double runs = r->num_samples ? (double)r->num_samples : 1;
+
+        fprintf(csv, "%s,%s,%u,%u,%d,%llu,%d,%zu,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.6f,%.6f,%.6f,%.6f,%d\n", copy_engine_names[c->engine], c->block_size,
+                c->queue_depth, c->threads, c->direct, (unsigned long long)r->sample_bytes, r->num_samples ? r->round : -1, r->num_samples, r->mean, r->median,
+                r->stddev, r->ci_low, r->ci_high, buffered_rate(&r->phases), durable_rate(&r->phases), r->phases.open_seconds / runs,
+                r->phases.read_seconds / runs, r->phases.write_seconds / runs, r->phases.flush_seconds / runs, is_winner);
+
+        fprintf(json, "%s    {\"engine\": \"%s\", \"block_size\": \"%s\", \"queue_depth\": %u, \"threads\": %u, \"direct\": %s, "
+                      "\"sample_bytes\": %llu, \"round\": %d, \"samples_mbs\": [",
+                first ? "" : ",\n", copy_engine_names[c->engine], c->block_size, c->queue_depth, c->threads, c->direct ? "true" : "false",
+                (unsigned long long)r->sample_bytes, r->num_samples ? r->round : -1);
+        for (size_t s = 0; s < r->num_samples; ++s)
+        {
+            fprintf(json, "%s%.2f", s ? ", " : "", r->samples[s]);
+        }
+        fprintf(json, "], \"mean_mbs\": %.2f, \"median_mbs\": %.2f, \"stddev_mbs\": %.2f, \"ci95_mbs\": [%.2f, %.2f], \"buffered_mbs\": %.2f, "
+                      "\"durable_mbs\": %.2f, \"phases_s\": {\"open\": %.6f, \"read\": %.6f, \"write\": %.6f, \"flush\": %.6f}, \"winner\": %s}",
+                r->mean, r->median, r->stddev, r->ci_low, r->ci_high, buffered_rate(&r->phases), durable_rate(&r->phases), r->phases.open_seconds / runs,
+                r->phases.read_seconds / runs, r->phases.write_seconds / runs, r->phases.flush_seconds / runs, is_winner ? "true" : "false");
+        first = 0;
+    }
+    fprintf(json, "\n  ]\n}\n");
+
+    fclose(csv);
+    fclose(json);
+    change_permissions(csv_path);
+    change_permissions(json_path);
+    print_colored("\033[1;34m", "Benchmark grid written to %s and %s\n", csv_path, json_path);
+}
+
+/**
+ * @brief Reads the first line of a sysfs attribute, trimmed, with inner blanks turned into '_'
+ * so the value can be stored as one field of the cache file.
+ */
+int read_sysfs_value(const char *path, char *buffer, size_t buffer_size)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    char line[256];
+    if (fgets(line, sizeof(line), file) == NULL)
+    {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    char *start = line;
+    while (*start == ' ' || *start == '\t')
+    {
+        start++;
+    }
+    size_t len = strcspn(start, "\n");
+    while (len > 0 && (start[len - 1] == ' ' || start[len - 1] == '\t'))
+    {
+        len--;
+    }
+    if (len == 0)
+    {
+        return -1;
+    }
+    if (len >= buffer_size)
+    {
+        len = buffer_size - 1;
+    }
+    for (size_t i = 0; i < len; ++i)
+    {
+        buffer[i] = (start[i] == ' ' || start[i] == '\t') ? '_' : start[i];
+    }
+    buffer[len] = '\0';
+    return 0;
+}
+
+/**
+ * @brief Resolves the whole disk behind a block device or a file on a filesystem and reads its
+ * model, serial, firmware and block sizes from sysfs.
+ *
+ * Virtual devices without model/serial (loop, dm, ...) fall back to the disk name and, for loop
+ * devices, the backing file; paths that map to no block device use the path itself.
+ */
+void get_device_identity(const char *path, struct device_identity *identity)
+{
+    memset(identity, 0, sizeof(*identity));
+    strcpy(identity->model, "-");
+    strcpy(identity->firmware, "-");
+
+    struct stat st;
+    // realpath() needs PATH_MAX bytes; attribute paths need room for the longest suffix after it.
+    char sysfs_path[PATH_MAX + 64];
+    char disk_path[PATH_MAX];
+    if (stat(path, &st) != 0)
+    {
+        snprintf(identity->serial, sizeof(identity->serial), "%s", path);
+        return;
+    }
+    dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+    if (realpath(sysfs_path, disk_path) == NULL)
+    {
+        snprintf(identity->name, sizeof(identity->name), "%u:%u", major(dev), minor(dev));
+        snprintf(identity->serial, sizeof(identity->serial), "%s", path);
+        return;
+    }
+
+    // Partitions share the identity of their disk.
+    snprintf(sysfs_path, sizeof(sysfs_path), "%s/partition", disk_path);
+    if (access(sysfs_path, F_OK) == 0)
+    {
+        *strrchr(disk_path, '/') = '\0';
+    }
+    snprintf(identity->name, sizeof(identity->name), "%s", strrchr(disk_path, '/') + 1);
+
+    char value[256];
+    snprintf(sysfs_path, sizeof(sysfs_path), "%s/device/model", disk_path);
+    if (read_sysfs_value(sysfs_path, identity->model, sizeof(identity->model)) != 0)
+    {
+        snprintf(identity->model, sizeof(identity->model), "%s", identity->name);
+    }
+
+    const char *serial_attributes[] = {"device/serial", "wwid", "device/wwid", "loop/backing_file"};
+    for (size_t i = 0; i < sizeof(serial_attributes) / sizeof(serial_attributes[0]) && identity->serial[0] == '\0'; ++i)
+    {
+        snprintf(sysfs_path, sizeof(sysfs_path), "%s/%s", disk_path, serial_attributes[i]);
+        read_sysfs_value(sysfs_path, identity->serial, sizeof(identity->serial));
+    }
+    if (identity->serial[0] == '\0')
+    {
+        strcpy(identity->serial, "-");
+    }
+
+    const char *firmware_attributes[] = {"device/firmware_rev", "device/rev"};
+    for (size_t i = 0; i < sizeof(firmware_attributes) / sizeof(firmware_attributes[0]); ++i)
+    {
+        snprintf(sysfs_path, sizeof(sysfs_path), "%s/%s", disk_path, firmware_attributes[i]);
+        if (read_sysfs_value(sysfs_path, identity->firmware, sizeof(identity->firmware)) == 0)
+        {
+            break;
+        }
+    }
+
+    snprintf(sysfs_path, sizeof(sysfs_path), "%s/queue/logical_block_size", disk_path);
+    if (read_sysfs_value(sysfs_path, value, sizeof(value)) == 0)
+    {
+        identity->logical_block_size = (unsigned)strtoul(value, NULL, 10);
+    }
+    snprintf(sysfs_path, sizeof(sysfs_path), "%s/queue/physical_block_size", disk_path);
+    if (read_sysfs_value(sysfs_path, value, sizeof(value)) == 0)
+    {
+        identity->physical_block_size = (unsigned)strtoul(value, NULL, 10);
+    }
+}
+
+/**
+ * @brief FNV-1a hash of the benchmark search space, so a cached winner is only reused for the
+ * same engines, block sizes, queue depths, thread counts, I/O modes, sample size, ranking rate
+ * and sparse mode.
+ */
+uint64_t bench_space_hash()
+{
+    char space[MAX_PATH];
+    int len = snprintf(space, sizeof(space), "%s|%s|s%d", copy_size, bench_rank_buffered ? "buffered" : "durable", sparse_output);
+    for (size_t i = 0; i < num_selected_engines && len > 0 && (size_t)len < sizeof(space); ++i)
+    {
+        len += snprintf(space + len, sizeof(space) - len, "|e%s", copy_engine_names[selected_engines[i]]);
+    }
+    for (size_t i = 0; i < num_block_sizes && len > 0 && (size_t)len < sizeof(space); ++i)
+    {
+        len += snprintf(space + len, sizeof(space) - len, "|b%s", block_sizes[i]);
+    }
+    for (size_t i = 0; i < (bench_queue_depths ? num_bench_queue_depths : 1) && len > 0 && (size_t)len < sizeof(space); ++i)
+    {
+        len += snprintf(space + len, sizeof(space) - len, "|q%u", bench_queue_depths ? bench_queue_depths[i] : queue_depth);
+    }
+    for (size_t i = 0; i < (bench_thread_counts ? num_bench_thread_counts : 1) && len > 0 && (size_t)len < sizeof(space); ++i)
+    {
+        len += snprintf(space + len, sizeof(space) - len, "|t%u", bench_thread_counts ? bench_thread_counts[i] : copy_threads);
+    }
+    for (size_t i = 0; i < (bench_direct_modes ? num_bench_direct_modes : 1) && len > 0 && (size_t)len < sizeof(space); ++i)
+    {
+        len += snprintf(space + len, sizeof(space) - len, "|d%d", bench_direct_modes ? bench_direct_modes[i] : use_direct_io);
+    }
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *p = space; *p; ++p)
+    {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Builds the cache key (stable identity of source and target plus the search space) and
+ * the fingerprint that must still match for a cached entry to be valid (firmware, block sizes
+ * and running kernel).
+ */
+void build_bench_cache_key(char *key, size_t key_size, char *fingerprint, size_t fingerprint_size)
+{
+    struct device_identity source;
+    struct device_identity target;
+    struct utsname uts;
+    get_device_identity(input_file, &source);
+    get_device_identity(MOUNT_POINT, &target);
+    if (uname(&uts) != 0)
+    {
+        strcpy(uts.release, "-");
+    }
+
+    snprintf(key, key_size, "%s/%s>%s/%s#%016llx", source.model, source.serial, target.model, target.serial, (unsigned long long)bench_space_hash());
+    snprintf(fingerprint, fingerprint_size, "%s:%u:%u>%s:%u:%u@%s", source.firmware, source.logical_block_size, source.physical_block_size,
+             target.firmware, target.logical_block_size, target.physical_block_size, uts.release);
+}
+
+/**
+ * @brief Looks the current source/target/search space up in the benchmark cache.
+ *
+ * A cache line is "<key> <fingerprint> <saved_at> <engine> <block_size> <queue_depth> <threads>
+ * <direct> <rate>". Entries older than the TTL, or whose firmware, block sizes or kernel changed,
+ * are ignored and get replaced by the next benchmark.
+ *
+ * @return 1 and fills best_config/best_transfer_rate on a hit, 0 otherwise.
+ */
+int load_bench_cache(const char *key, const char *fingerprint)
+{
+    FILE *file = fopen(bench_cache_file, "r");
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    int hit = 0;
+    char line[1024];
+    while (!hit && fgets(line, sizeof(line), file) != NULL)
+    {
+        char entry_key[512], entry_fingerprint[256], engine[16], block_size[10];
+        long long saved_at;
+        unsigned entry_queue_depth, threads;
+        int direct;
+        double rate;
+        if (sscanf(line, "%511s %255s %lld %15s %9s %u %u %d %lf", entry_key, entry_fingerprint, &saved_at, engine, block_size, &entry_queue_depth,
+                   &threads, &direct, &rate) != 9 ||
+            strcmp(entry_key, key) != 0)
+        {
+            continue;
+        }
+
+        double age_hours = difftime(time(NULL), (time_t)saved_at) / 3600.0;
+        enum copy_engine_type cached_engine = ENGINE_NATIVE;
+        int known_engine = 0;
+        for (size_t e = 0; e < num_copy_engines; ++e)
+        {
+            if (strcmp(engine, copy_engine_names[e]) == 0)
+            {
+                cached_engine = (enum copy_engine_type)e;
+                known_engine = 1;
+            }
+        }
+
+        if (strcmp(entry_fingerprint, fingerprint) != 0)
+        {
+            print_colored("\033[1;33m", "Cached benchmark invalidated: firmware, block size or kernel changed (%s -> %s)\n", entry_fingerprint, fingerprint);
+        }
+        else if (age_hours > bench_cache_ttl_hours)
+        {
+            print_colored("\033[1;33m", "Cached benchmark expired (%.0f h old, TTL %u h)\n", age_hours, bench_cache_ttl_hours);
+        }
+        else if (known_engine && is_valid_block_size(block_size))
+        {
+            best_config.engine = cached_engine;
+            snprintf(best_config.block_size, sizeof(best_config.block_size), "%s", block_size);
+            best_config.queue_depth = entry_queue_depth;
+            best_config.threads = threads;
+            best_config.direct = direct;
+            best_transfer_rate = rate;
+            print_colored("\033[1;34m", "Using cached benchmark from %.1f h ago (%s)\n", age_hours, bench_cache_file);
+            hit = 1;
+        }
+    }
+
+    fclose(file);
+    return hit;
+}
+
+/**
+ * @brief Stores the winner under the given key, replacing any previous entry for it. The file
+ * is rewritten into a temporary and renamed so a crash never leaves a truncated cache.
+ */
+void save_bench_cache(const char *key, const char *fingerprint)
+{
+    char directory[MAX_PATH];
+    snprintf(directory, sizeof(directory), "%s", bench_cache_file);
+    char *dir = dirname(directory);
+    struct stat st;
+    if (stat(dir, &st) == -1 && mkdir(dir, 0755) != 0)
+    {
+        fprintf(stderr, "Warning: cannot create cache directory %s: %s\n", dir, strerror(errno));
+        return;
+    }
+
+    char temp_path[MAX_PATH];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", bench_cache_file);
+    FILE *out = fopen(temp_path, "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Warning: cannot write benchmark cache %s: %s\n", temp_path, strerror(errno));
+        return;
+    }
+
+    FILE *in = fopen(bench_cache_file, "r");
+    if (in != NULL)
+    {
+        char line[1024];
+        size_t key_len = strlen(key);
+        while (fgets(line, sizeof(line), in) != NULL)
+        {
+            if (strncmp(line, key, key_len) != 0 || line[key_len] != ' ')
+            {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    }
+
+    fprintf(out, "%s %s %lld %s %s %u %u %d %.2f\n", key, fingerprint, (long long)time(NULL), copy_engine_names[best_config.engine], best_config.block_size,
+            best_config.queue_depth, best_config.threads, best_config.direct, best_transfer_rate);
+    if (fclose(out) != 0 || rename(temp_path, bench_cache_file) != 0)
+    {
+        fprintf(stderr, "Warning: cannot update benchmark cache %s: %s\n", bench_cache_file, strerror(errno));
+        unlink(temp_path);
+    }
+}
+
+void benchmark_and_get_best_block_size()
+{
+    best_transfer_rate = 0.0;
+    best_block_size[0] = '\0';
+    best_engine = copy_engine;
+
+    if (block_sizes == NULL)
+    {
+        block_sizes = (char **)default_block_sizes;
+        num_block_sizes = num_default_block_sizes;
+    }
+
+    if (selected_engines == NULL)
+    {
+        // The benchmark reassigns copy_engine per candidate, so the list holds a copy of it.
+        static enum copy_engine_type single_engine;
+        single_engine = copy_engine;
+        selected_engines = &single_engine;
+        num_selected_engines = 1;
+    }
+
+    // The kernel-side transfer only pays off if it beats the buffered path, so always measure both.
+    int has_zerocopy = 0;
+    int has_buffered = 0;
+    for (size_t e = 0; e < num_selected_engines; ++e)
+    {
+        has_zerocopy |= selected_engines[e] == ENGINE_ZEROCOPY;
+        has_buffered |= selected_engines[e] != ENGINE_ZEROCOPY && selected_engines[e] != ENGINE_DD;
+    }
+    if (has_zerocopy && !has_buffered)
+    {
+        enum copy_engine_type *engines = (enum copy_engine_type *)malloc((num_selected_engines + 1) * sizeof(enum copy_engine_type));
+        if (!engines)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(engines, selected_engines, num_selected_engines * sizeof(enum copy_engine_type));
+        engines[num_selected_engines++] = ENGINE_NATIVE;
+        selected_engines = engines;
+    }
+
+    // Devices that were already measured with the same search space start copying right away.
+    char cache_key[512];
+    char cache_fingerprint[256];
+    if (bench_cache_ttl_hours > 0)
+    {
+        build_bench_cache_key(cache_key, sizeof(cache_key), cache_fingerprint, sizeof(cache_fingerprint));
+        if (!bench_cache_refresh && load_bench_cache(cache_key, cache_fingerprint))
+        {
+            apply_bench_config(&best_config);
+            strcpy(best_block_size, best_config.block_size);
+            best_engine = best_config.engine;
+
+            char description[128];
+            describe_bench_config(&best_config, description, sizeof(description));
+            print_colored("\033[1;35m", "Best configuration: %s\n", description);
+            print_colored("\033[1;35m", "Best transfer rate: %.2f MB/s (cached)\n", best_transfer_rate);
+            return;
+        }
+    }
+
+    // Every point of the parameter space is a candidate; the winning tuple drives the copy.
+    size_t num_results;
+    struct bench_result *results = build_bench_candidates(&num_results);
+    print_colored("\033[1;34m", "Benchmarking %zu configuration(s)\n", num_results);
+
+    uint64_t length = parse_size(copy_size);
+    double start = monotonic_seconds();
+    int final_round;
+    if (bench_search == SEARCH_HALVING && num_results > 1)
+    {
+        final_round = run_successive_halving(results, num_results, length, start);
+    }
+    else
+    {
+        final_round = run_exhaustive_search(results, num_results, length, start);
+    }
+
+    uint64_t bytes_written = 0;
+    for (size_t i = 0; i < num_results; ++i)
+    {
+        bytes_written += results[i].total_bytes;
+    }
+    print_colored("\033[1;34m", "Benchmark took %.1f s and copied %.2f GB\n", monotonic_seconds() - start, bytes_written / 1e9);
+
+    if (bench_repetitions > 1 || bench_search == SEARCH_HALVING)
+    {
+        print_bench_results(results, num_results);
+    }
+    struct bench_result *winner = pick_bench_winner(results, num_results, final_round);
+    if (winner != NULL)
+    {
+        best_config = winner->config;
+        apply_bench_config(&best_config);
+        strcpy(best_block_size, winner->config.block_size);
+        best_transfer_rate = winner->mean;
+        best_engine = winner->config.engine;
+    }
+    write_bench_grid(results, num_results, winner);
+    if (winner != NULL && bench_cache_ttl_hours > 0)
+    {
+        save_bench_cache(cache_key, cache_fingerprint);
+    }
+
+    if (num_selected_engines > 1)
+    {
+        for (size_t e = 0; e < num_selected_engines; ++e)
+        {
+            double engine_best = 0;
+            for (size_t i = 0; i < num_results; ++i)
+            {
+                if (results[i].config.engine == selected_engines[e] && results[i].mean > engine_best)
+                {
+                    engine_best = results[i].mean;
+                }
+            }
+            print_colored("\033[1;37m", "Best rate with %s: %.2f MB/s\n", copy_engine_names[selected_engines[e]], engine_best);
+        }
+    }
+    print_colored("\033[1;35m", "Best engine: %s\n", copy_engine_names[best_engine]);
+    print_colored("\033[1;35m", "Best block size: %s\n", best_block_size);
+    if (winner != NULL)
+    {
+        char description[128];
+        describe_bench_config(&best_config, description, sizeof(description));
+        print_colored("\033[1;35m", "Best configuration: %s\n", description);
+    }
+    print_colored("\033[1;35m", "Best transfer rate: %.2f MB/s\n", best_transfer_rate);
+
+    for (size_t i = 0; i < num_results; ++i)
+    {
+        free(results[i].samples);
+    }
+    free(results);
+}
+
+/**
+ * @brief Picks the settings for a real copy: benchmarks up front, or with --adaptive starts from
+ * the first selected engine and 1M blocks and lets the copy tune itself.
+ */
+void choose_copy_settings()
+{
+    if (!adaptive_tuning)
+    {
+        benchmark_and_get_best_block_size();
+        return;
+    }
+
+    if (copy_engine == ENGINE_DD)
+    {
+        print_colored("\033[1;31m", "Error: Adaptive tuning needs an in-process engine, not dd.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (strlen(best_block_size) == 0)
+    {
+        strcpy(best_block_size, "1M");
+    }
+    print_colored("\033[1;34m", "Adaptive tuning enabled: skipping the benchmark, starting with %s blocks.\n", best_block_size);
+}
+
+void nvme_to_sdb_auto_rip()
+{
+    prepare_disk("/dev/sdb");
+    choose_copy_settings();
+
+    if (strlen(best_block_size) == 0)
+    {
+        print_colored("\033[1;31m", "Error: No valid block size found. Aborting copy.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    time_t now = time(NULL);
+    char output_file_path[MAX_PATH];
+    snprintf(output_file_path, sizeof(output_file_path), "%s/nvme0n1_sdb1_%ld.dd", MOUNT_POINT, now);
+
+    print_colored("\033[1;33m", "Running final copy from nvme0n1 to sdb...\n");
+    final_copy("/dev/nvme0n1", output_file_path);
+}
+
+void nvme_to_sda_auto_rip()
+{
+    prepare_disk("/dev/sda");
+    choose_copy_settings();
+
+    if (strlen(best_block_size) == 0)
+    {
+        print_colored("\033[1;31m", "Error: No valid block size found. Aborting copy.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    time_t now = time(NULL);
+    char output_file_path[MAX_PATH];
+    snprintf(output_file_path, sizeof(output_file_path), "%s/nvme0n1_sda1_%ld.dd", MOUNT_POINT, now);
+
+    print_colored("\033[1;33m", "Running final copy from nvme0n1 to sda...\n");
+    final_copy("/dev/nvme0n1", output_file_path);
+}
+
+/**
+ * @brief Benchmarks against sdb, then reads nvme0n1 once and writes it to both sdb and sda.
+ */
+void nvme_to_sda_sdb_auto_rip()
+{
+    prepare_disk("/dev/sdb");
+    prepare_disk_at("/dev/sda", FANOUT_MOUNT_POINT);
+    choose_copy_settings();
+
+    if (strlen(best_block_size) == 0)
+    {
+        print_colored("\033[1;31m", "Error: No valid block size found. Aborting copy.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    time_t now = time(NULL);
+    char sdb_path[MAX_PATH];
+    char sda_path[MAX_PATH];
+    snprintf(sdb_path, sizeof(sdb_path), "%s/nvme0n1_sdb1_%ld.dd", MOUNT_POINT, now);
+    snprintf(sda_path, sizeof(sda_path), "%s/nvme0n1_sda1_%ld.dd", FANOUT_MOUNT_POINT, now);
+    char *output_file_paths[] = {sdb_path, sda_path};
+
+    print_colored("\033[1;33m", "Running final copy from nvme0n1 to sdb and sda...\n");
+    fanout_final_copy("/dev/nvme0n1", output_file_paths, 2);
+}
+
+/**
+ * @brief Copies input_file into an image with the settings given on the command line, without
+ * benchmarking or preparing the target. This is what the generated systemd unit runs.
+ */
+void copy_to_image(const char *output_file_path)
+{
+    if (strlen(best_block_size) == 0)
+    {
+        snprintf(best_block_size, sizeof(best_block_size), "%s", block_sizes != NULL ? block_sizes[0] : "1M");
+    }
+    print_colored("\033[1;33m", "Copying %s to %s...\n", input_file, output_file_path);
+    final_copy(input_file, output_file_path);
+}
+
+/**
+ * @brief Like copy_to_image(), but reads input_file once and writes every image of the
+ * comma-separated list at the same time.
+ */
+void copy_to_images(const char *optarg)
+{
+    char *input = strdup(optarg);
+    char *rest = input;
+    char *paths[64];
+    size_t num_paths = 0;
+    char *token;
+    while ((token = strtok_r(rest, ",", &rest)) && num_paths < sizeof(paths) / sizeof(paths[0]))
+    {
+        paths[num_paths++] = token;
+    }
+    if (num_paths == 0)
+    {
+        fprintf(stderr, "Invalid fan-out target list: %s\n", optarg);
+        exit(EXIT_FAILURE);
+    }
+    if (strlen(best_block_size) == 0)
+    {
+        snprintf(best_block_size, sizeof(best_block_size), "%s", block_sizes != NULL ? block_sizes[0] : "1M");
+    }
+    print_colored("\033[1;33m", "Copying %s to %zu targets...\n", input_file, num_paths);
+    fanout_final_copy(input_file, paths, num_paths);
+    free(input);
+}
+
+void append_command(char *command, size_t command_size, const char *format, ...)
+{
+    size_t len = strlen(command);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(command + len, command_size - len, format, args);
+    va_end(args);
+}
+
+/**
+ * @brief Argument vector of a child copy; the strings live in storage.
+ */
+struct copy_args
+{
+    char *argv[80];
+    int argc;
+    char storage[MAX_PATH * 4];
+    size_t used;
+};
+
+void add_copy_arg(struct copy_args *args, const char *format, ...)
+{
+    size_t room = sizeof(args->storage) - args->used;
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(args->storage + args->used, room, format, ap);
+    va_end(ap);
+    if (len < 0 || (size_t)len >= room || args->argc + 1 >= (int)(sizeof(args->argv) / sizeof(args->argv[0])))
+    {
+        fprintf(stderr, "Error: Copy command line is too long\n");
+        exit(EXIT_FAILURE);
+    }
+    args->argv[args->argc++] = args->storage + args->used;
+    args->argv[args->argc] = NULL;
+    args->used += len + 1;
+}
+
+/**
+ * @brief Builds the arguments of a child copy with the benchmarked tuple.
+ *
+ * The dd engine keeps a plain dd invocation; every other engine re-invokes program (the installed
+ * dddarth, or this binary for --batch) with the winning engine, block size, queue depth, thread
+ * count and I/O mode.
+ */
+void build_copy_args(struct copy_args *args, const char *program, const char *source, const char *output_file_path)
+{
+    memset(args, 0, sizeof(*args));
+    if (best_config.engine == ENGINE_DD && compress_output == COMPRESS_NONE && incremental_base == NULL && !resume_copy && metrics_file == NULL &&
+        metrics_socket == NULL && !max_rate_bytes && !max_iops && !latency_target_us && !rescue_mode &&
+        !allocated_only)
+    {
+        add_copy_arg(args, "dd");
+        add_copy_arg(args, "if=%s", source);
+        add_copy_arg(args, "of=%s", output_file_path);
+        add_copy_arg(args, "bs=%s", best_block_size);
+        if (best_config.direct)
+        {
+            add_copy_arg(args, "iflag=direct");
+            add_copy_arg(args, "oflag=direct");
+        }
+        add_copy_arg(args, "conv=%sfdatasync", sparse_output ? "sparse," : "");
+        add_copy_arg(args, "status=progress");
+        return;
+    }
+    add_copy_arg(args, "%s", program);
+    add_copy_arg(args, "-i");
+    add_copy_arg(args, "%s", source);
+    add_copy_arg(args, "-e");
+    add_copy_arg(args, "%s", copy_engine_names[best_config.engine]);
+    add_copy_arg(args, "-b");
+    add_copy_arg(args, "%s", best_block_size);
+    add_copy_arg(args, "-q");
+    add_copy_arg(args, "%u", best_config.queue_depth);
+    add_copy_arg(args, "-t");
+    add_copy_arg(args, "%u", best_config.threads);
+    add_copy_arg(args, "--chunk-size");
+    add_copy_arg(args, "%llu", (unsigned long long)chunk_size_bytes);
+    if (best_config.direct)
+    {
+        add_copy_arg(args, "--direct");
+    }
+    if (adaptive_tuning)
+    {
+        add_copy_arg(args, "--adaptive");
+    }
+    if (sparse_output)
+    {
+        add_copy_arg(args, "--sparse");
+    }
+    if (hash_image)
+    {
+        add_copy_arg(args, "--hash");
+        add_copy_arg(args, "--hash-threads");
+        add_copy_arg(args, "%u", hash_threads);
+    }
+    if (verify_output)
+    {
+        add_copy_arg(args, "--verify");
+    }
+    if (compress_output != COMPRESS_NONE)
+    {
+        add_copy_arg(args, "--compress");
+        add_copy_arg(args, "%s", compressor_names[compress_output]);
+        add_copy_arg(args, "--frame-size");
+        add_copy_arg(args, "%llu", (unsigned long long)frame_size_bytes);
+        if (compress_level)
+        {
+            add_copy_arg(args, "--compress-level");
+            add_copy_arg(args, "%d", compress_level);
+        }
+        if (compress_threads)
+        {
+            add_copy_arg(args, "--compress-threads");
+            add_copy_arg(args, "%u", compress_threads);
+        }
+    }
+    if (incremental_base != NULL)
+    {
+        add_copy_arg(args, "--incremental");
+        add_copy_arg(args, "%s", incremental_base);
+        if (patch_base)
+        {
+            add_copy_arg(args, "--patch");
+        }
+    }
+    if (resume_copy)
+    {
+        add_copy_arg(args, "--resume");
+        add_copy_arg(args, "--journal-interval");
+        add_copy_arg(args, "%llu", (unsigned long long)journal_interval_bytes);
+    }
+    if (rescue_mode)
+    {
+        add_copy_arg(args, "--rescue");
+        add_copy_arg(args, "--rescue-retries");
+        add_copy_arg(args, "%u", rescue_retries);
+    }
+    if (allocated_only)
+    {
+        add_copy_arg(args, "--allocated-only");
+    }
+    if (stats_window_seconds != 1.0)
+    {
+        add_copy_arg(args, "--stats-window");
+        add_copy_arg(args, "%.0f", stats_window_seconds * 1000);
+    }
+    if (metrics_file != NULL)
+    {
+        add_copy_arg(args, "--metrics-file");
+        add_copy_arg(args, "%s", metrics_file);
+    }
+    if (metrics_socket != NULL)
+    {
+        add_copy_arg(args, "--metrics-socket");
+        add_copy_arg(args, "%s", metrics_socket);
+    }
+    if ((metrics_file != NULL || metrics_socket != NULL) && metrics_interval_seconds != 1.0)
+    {
+        add_copy_arg(args, "--metrics-interval");
+        add_copy_arg(args, "%.0f", metrics_interval_seconds);
+    }
+    if (max_rate_bytes)
+    {
+        add_copy_arg(args, "--max-rate");
+        add_copy_arg(args, "%lluk", (unsigned long long)(max_rate_bytes / 1024));
+    }
+    if (max_iops)
+    {
+        add_copy_arg(args, "--max-iops");
+        add_copy_arg(args, "%u", max_iops);
+    }
+    if (latency_target_us)
+    {
+        add_copy_arg(args, "--latency-target");
+        add_copy_arg(args, "%u", latency_target_us);
+    }
+    if (io_priority != NULL)
+    {
+        add_copy_arg(args, "--ioprio");
+        add_copy_arg(args, "%s", io_priority);
+    }
+    if (io_cgroup != NULL)
+    {
+        add_copy_arg(args, "--cgroup");
+        add_copy_arg(args, "%s", io_cgroup);
+    }
+    add_copy_arg(args, "--copy-to");
+    add_copy_arg(args, "%s", output_file_path);
+}
+
+/**
+ * @brief Builds the shell command the systemd unit uses to copy with the benchmarked tuple.
+ *
+ * The arguments are joined unquoted so output_file_path can be a shell expansion such as
+ * ${output_file}.
+ */
+void build_copy_command(char *command, size_t command_size, const char *program, const char *source, const char *output_file_path)
+{
+    struct copy_args args;
+    build_copy_args(&args, program, source, output_file_path);
+    command[0] = '\0';
+    for (int i = 0; i < args.argc; ++i)
+    {
+        append_command(command, command_size, "%s%s", i ? " " : "", args.argv[i]);
+    }
+}
+
+/**
+ * @brief Names the host controller behind a block device or a file on a filesystem: the PCIe
+ * function of the NVMe drive, AHCI/SAS HBA or USB host controller its sysfs path hangs off.
+ *
+ * Loop devices resolve through their backing file and dm/md devices through their first slave.
+ * Paths that map to no block device (tmpfs, ...) get an empty key and are never throttled.
+ */
+void get_controller_key(const char *path, char *key, size_t key_size)
+{
+    key[0] = '\0';
+    struct stat st;
+    // realpath() needs PATH_MAX bytes; attribute paths need room for the longest suffix after it.
+    char sysfs_path[PATH_MAX + 64];
+    char disk_path[PATH_MAX];
+    if (stat(path, &st) != 0)
+    {
+        // An image that does not exist yet lives on the filesystem of its directory.
+        snprintf(sysfs_path, sizeof(sysfs_path), "%s", path);
+        if (stat(dirname(sysfs_path), &st) != 0)
+        {
+            return;
+        }
+    }
+    dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+    if (realpath(sysfs_path, disk_path) == NULL)
+    {
+        return;
+    }
+
+    for (int depth = 0; depth < 8; ++depth)
+    {
+        snprintf(sysfs_path, sizeof(sysfs_path), "%s/partition", disk_path);
+        if (access(sysfs_path, F_OK) == 0)
+        {
+            *strrchr(disk_path, '/') = '\0';
+        }
+        if (strstr(disk_path, "/virtual/") == NULL)
+        {
+            break;
+        }
+
+        char value[256];
+        snprintf(sysfs_path, sizeof(sysfs_path), "%s/loop/backing_file", disk_path);
+        if (read_sysfs_value(sysfs_path, value, sizeof(value)) == 0)
+        {
+            get_controller_key(value, key, key_size);
+            return;
+        }
+
+        snprintf(sysfs_path, sizeof(sysfs_path), "%s/slaves", disk_path);
+        DIR *slaves = opendir(sysfs_path);
+        struct dirent *entry = NULL;
+        while (slaves != NULL && (entry = readdir(slaves)) != NULL && entry->d_name[0] == '.')
+        {
+        }
+        if (entry == NULL)
+        {
+            if (slaves != NULL)
+            {
+                closedir(slaves);
+            }
+            break;
+        }
+        snprintf(sysfs_path, sizeof(sysfs_path), "/sys/class/block/%s", entry->d_name);
+        closedir(slaves);
+        if (realpath(sysfs_path, disk_path) == NULL)
+        {
+            return;
+        }
+    }
+
+    // The deepest PCI address on the path is the controller; everything below it shares its link.
+    const char *controller = NULL;
+    size_t controller_len = 0;
+    for (const char *component = disk_path; component != NULL; component = strchr(component + 1, '/'))
+    {
+        const char *name = component[0] == '/' ? component + 1 : component;
+        unsigned domain, bus, slot, function;
+        int consumed = 0;
+        if (sscanf(name, "%4x:%2x:%2x.%1x%n", &domain, &bus, &slot, &function, &consumed) == 4 && consumed == 12 &&
+            (name[consumed] == '/' || name[consumed] == '\0'))
+        {
+            controller = name;
+            controller_len = consumed;
+        }
+    }
+    const char *bus_type = strstr(disk_path, "/usb") ? "usb"
+                           : strstr(disk_path, "/nvme") ? "nvme"
+                           : strstr(disk_path, "/ata") ? "sata"
+                           : strstr(disk_path, "/host") ? "scsi"
+                           : strstr(disk_path, "/virtio") ? "virtio"
+                                                           : "block";
+    if (controller != NULL)
+    {
+        snprintf(key, key_size, "%s %.*s", bus_type, (int)controller_len, controller);
+    }
+    else
+    {
+        snprintf(key, key_size, "%s %s", bus_type, strrchr(disk_path, '/') + 1);
+    }
+}
+
+/**
+ * @brief One line of a --batch job file: a source, the image it is copied to and the host
+ * controllers both sit behind.
+ */
+struct batch_job
+{
+    char source[MAX_PATH];
+    char target[MAX_PATH];
+    char controllers[2][64];
+    int state; // 0 = pending, 1 = running, 2 = done
+    int exit_status;
+    uint64_t bytes;
+    double start_seconds;
+    double end_seconds;
+};
+
+struct batch_controller
+{
+    char key[64];
+    unsigned active;
+};
+
+struct batch_run
+{
+    struct batch_job *jobs;
+    size_t num_jobs;
+    struct batch_controller *controllers;
+    size_t num_controllers;
+    char program[MAX_PATH];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+struct batch_controller *find_batch_controller(struct batch_run *run, const char *key)
+{
+    for (size_t i = 0; i < run->num_controllers; ++i)
+    {
+        if (strcmp(run->controllers[i].key, key) == 0)
+        {
+            return &run->controllers[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Whether every controller the job touches has a free slot. A job whose source and
+ * target share a controller takes one slot of it, not two.
+ */
+int batch_job_can_start(struct batch_run *run, const struct batch_job *job)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        if (job->controllers[i][0] == '\0' || (i == 1 && strcmp(job->controllers[0], job->controllers[1]) == 0))
+        {
+            continue;
+        }
+        if (find_batch_controller(run, job->controllers[i])->active >= batch_jobs_per_controller)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void batch_job_claim(struct batch_run *run, const struct batch_job *job, int delta)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        if (job->controllers[i][0] == '\0' || (i == 1 && strcmp(job->controllers[0], job->controllers[1]) == 0))
+        {
+            continue;
+        }
+        find_batch_controller(run, job->controllers[i])->active += delta;
+    }
+}
+
+/**
+ * @brief Takes the first pending job whose controllers have room, runs it as a child dddarth
+ * with its output in <image>.log, and repeats until no job is left.
+ */
+void *batch_worker(void *arg)
+{
+    struct batch_run *run = arg;
+    pthread_mutex_lock(&run->lock);
+    for (;;)
+    {
+        struct batch_job *job = NULL;
+        int pending = 0;
+        for (size_t i = 0; i < run->num_jobs; ++i)
+        {
+            if (run->jobs[i].state != 0)
+            {
+                continue;
+            }
+            pending = 1;
+            if (batch_job_can_start(run, &run->jobs[i]))
+            {
+                job = &run->jobs[i];
+                break;
+            }
+        }
+        if (!pending)
+        {
+            break;
+        }
+        if (job == NULL)
+        {
+            pthread_cond_wait(&run->changed, &run->lock);
+            continue;
+        }
+        job->state = 1;
+        batch_job_claim(run, job, 1);
+        pthread_mutex_unlock(&run->lock);
+
+        // Paths go to the child as plain arguments; no shell ever parses them.
+        struct copy_args args;
+        build_copy_args(&args, run->program, job->source, job->target);
+        char log_path[MAX_PATH + 8];
+        snprintf(log_path, sizeof(log_path), "%s.log", job->target);
+        print_colored("\033[1;34m", "Starting %s -> %s\n", job->source, job->target);
+        job->start_seconds = monotonic_seconds();
+        int ret = -1;
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            int log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (log_fd < 0 || dup2(log_fd, STDOUT_FILENO) < 0 || dup2(log_fd, STDERR_FILENO) < 0)
+            {
+                _exit(127);
+            }
+            execvp(args.argv[0], args.argv);
+            _exit(127);
+        }
+        if (pid < 0)
+        {
+            perror("fork");
+        }
+        else
+        {
+            pid_t waited;
+            do
+            {
+                waited = waitpid(pid, &ret, 0);
+            } while (waited < 0 && errno == EINTR);
+        }
+        job->end_seconds = monotonic_seconds();
+        job->exit_status = ret == -1 ? -1 : WIFEXITED(ret) ? WEXITSTATUS(ret) : 128 + WTERMSIG(ret);
+        double seconds = job->end_seconds - job->start_seconds;
+        if (job->exit_status == 0)
+        {
+            print_colored("\033[1;32m", "Finished %s -> %s: %.2f MB in %.2f s (%.2f MB/s)\n", job->source, job->target, job->bytes / 1e6, seconds,
+                          seconds > 0 ? job->bytes / seconds / 1e6 : 0);
+        }
+        else
+        {
+            print_colored("\033[1;31m", "Failed %s -> %s with status %d, see %s.log\n", job->source, job->target, job->exit_status, job->target);
+        }
+
+        pthread_mutex_lock(&run->lock);
+        job->state = 2;
+        batch_job_claim(run, job, -1);
+        pthread_cond_broadcast(&run->changed);
+    }
+    pthread_mutex_unlock(&run->lock);
+    return NULL;
+}
+
+/**
+ * @brief Runs every "SOURCE IMAGE" line of a job file with the settings given on the command
+ * line, as many at once as the host controllers allow.
+ *
+ * Jobs whose source or target sits behind the same controller (NVMe function, HBA, USB host)
+ * run at most --jobs-per-controller at a time, so they do not split one link between them,
+ * while jobs on independent controllers run in parallel.
+ */
+void run_batch(const char *job_file)
+{
+    FILE *file = fopen(job_file, "r");
+    if (file == NULL)
+    {
+        perror(job_file);
+        exit(EXIT_FAILURE);
+    }
+
+    struct batch_run run;
+    memset(&run, 0, sizeof(run));
+    size_t capacity = 0;
+    char line[MAX_PATH * 2 + 16];
+    unsigned line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+        char source[MAX_PATH];
+        char target[MAX_PATH];
+        char extra[2];
+        if (line[strspn(line, " \t")] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+        {
+            continue;
+        }
+        if (sscanf(line, "%2047s %2047s %1s", source, target, extra) != 2)
+        {
+            fprintf(stderr, "%s:%u: expected \"SOURCE IMAGE\"\n", job_file, line_number);
+            exit(EXIT_FAILURE);
+        }
+        if (run.num_jobs == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            run.jobs = realloc(run.jobs, capacity * sizeof(*run.jobs));
+            if (run.jobs == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        struct batch_job *job = &run.jobs[run.num_jobs++];
+        memset(job, 0, sizeof(*job));
+        snprintf(job->source, sizeof(job->source), "%s", source);
+        snprintf(job->target, sizeof(job->target), "%s", target);
+    }
+    fclose(file);
+    if (run.num_jobs == 0)
+    {
+        fprintf(stderr, "No jobs in %s\n", job_file);
+        exit(EXIT_FAILURE);
+    }
+
+    ssize_t len = readlink("/proc/self/exe", run.program, sizeof(run.program) - 1);
+    if (len <= 0)
+    {
+        perror("readlink /proc/self/exe");
+        exit(EXIT_FAILURE);
+    }
+    run.program[len] = '\0';
+
+    if (metrics_file != NULL || metrics_socket != NULL)
+    {
+        // Every job is its own process; they would overwrite each other's textfile and socket.
+        print_colored("\033[1;33m", "Warning: live metrics are per copy and not available for batch jobs; each job still writes IMAGE.json.\n");
+        metrics_file = NULL;
+        metrics_socket = NULL;
+    }
+
+    // The children copy with exactly what was given on the command line; nothing is benchmarked.
+    best_config.engine = copy_engine;
+    best_config.queue_depth = queue_depth;
+    best_config.threads = copy_threads;
+    best_config.direct = use_direct_io;
+    if (strlen(best_block_size) == 0)
+    {
+        snprintf(best_block_size, sizeof(best_block_size), "%s", block_sizes != NULL ? block_sizes[0] : "1M");
+    }
+
+    run.controllers = calloc(run.num_jobs * 2, sizeof(*run.controllers));
+    print_colored("\033[1;33m", "Batch of %zu jobs, at most %u per controller:\n", run.num_jobs, batch_jobs_per_controller);
+    for (size_t i = 0; i < run.num_jobs; ++i)
+    {
+        struct batch_job *job = &run.jobs[i];
+        int fd = open(job->source, O_RDONLY);
+        if (fd < 0)
+        {
+            perror(job->source);
+            exit(EXIT_FAILURE);
+        }
+        job->bytes = get_device_size(fd);
+        close(fd);
+
+        get_controller_key(job->source, job->controllers[0], sizeof(job->controllers[0]));
+        get_controller_key(job->target, job->controllers[1], sizeof(job->controllers[1]));
+        for (int j = 0; j < 2; ++j)
+        {
+            if (job->controllers[j][0] != '\0' && find_batch_controller(&run, job->controllers[j]) == NULL)
+            {
+                snprintf(run.controllers[run.num_controllers++].key, sizeof(run.controllers[0].key), "%s", job->controllers[j]);
+            }
+        }
+        printf("  %s [%s] -> %s [%s]\n", job->source, job->controllers[0][0] ? job->controllers[0] : "-", job->target,
+               job->controllers[1][0] ? job->controllers[1] : "-");
+    }
+
+    size_t num_workers = batch_max_jobs && batch_max_jobs < run.num_jobs ? batch_max_jobs : run.num_jobs;
+    pthread_t *workers = calloc(num_workers, sizeof(*workers));
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.changed, NULL);
+    double start = monotonic_seconds();
+    for (size_t i = 0; i < num_workers; ++i)
+    {
+        pthread_create(&workers[i], NULL, batch_worker, &run);
+    }
+    for (size_t i = 0; i < num_workers; ++i)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    double seconds = monotonic_seconds() - start;
+
+    uint64_t total_bytes = 0;
+    size_t failed = 0;
+    for (size_t i = 0; i < run.num_jobs; ++i)
+    {
+        if (run.jobs[i].exit_status == 0)
+        {
+            total_bytes += run.jobs[i].bytes;
+        }
+        else
+        {
+            failed++;
+        }
+    }
+    print_colored(failed ? "\033[1;31m" : "\033[1;32m", "Batch done: %zu/%zu jobs, %.2f MB in %.2f s (%.2f MB/s aggregate)\n", run.num_jobs - failed,
+                  run.num_jobs, total_bytes / 1e6, seconds, seconds > 0 ? total_bytes / seconds / 1e6 : 0);
+
+    pthread_mutex_destroy(&run.lock);
+    pthread_cond_destroy(&run.changed);
+    free(workers);
+    free(run.controllers);
+    free(run.jobs);
+    if (failed)
+    {
+        exit(EXIT_FAILURE);
+    }
+}
+
+void ensure_mount_point_exists(const char *mount_point)
+{
+    struct stat st;
+    if (stat(mount_point, &st) == -1)
+    {
+        if (mkdir(mount_point, 0700) != 0)
+        {
+            perror("mkdir");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void install_program()
+{
+    char command[MAX_PATH];
+    snprintf(command, sizeof(command), "sudo cp ./dddarth /usr/local/bin/dddarth");
+    execute_command(command);
+    print_colored("\033[1;32m", "Program installed to /usr/local/bin/dddarth\n");
+}
+
+/**
+ * @brief Creates a systemd service for automated data transfer.
+ *
+ * This function benchmarks the input and output drives to determine the best block size
+ * for data transfer. It then creates a systemd service file that will perform the data
+ * transfer from the input drive to the output drive using the best block size.
+ *
+ * @param input_drive The path to the input drive (e.g., /dev/nvme0n1).
+ * @param output_drive The path to the output drive (e.g., /dev/sdb).
+ */
+void create_systemd_service(const char *input_drive, const char *output_drive)
+{
+    // print_debug("Entered create_systemd_service function");
+
+    input_file = strdup(input_drive);
+    output_disk = strdup(output_drive);
+    // print_debug("Input drive: %s, Output drive: %s", input_file, output_disk);
+
+    benchmark_and_get_best_block_size();
+    // print_debug("Best block size: %s, Best transfer rate: %.2f MB/s", best_block_size, best_transfer_rate);
+
+    if (strlen(best_block_size) == 0)
+    {
+        print_colored("\033[1;31m", "Error: No valid block size found. Aborting creation of systemd service.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char command[MAX_PATH];
+    char partuuid_output[MAX_PATH];
+    char partuuid_input[MAX_PATH] = "";
 
     // Get PARTUUID of the output drive
     snprintf(command, sizeof(command), "blkid -s PARTUUID -o value %s1", output_drive);
@@ -589,6 +9665,21 @@ void create_systemd_service(const char *input_drive, const char *output_drive)
         print_debug("PARTUUID of input drive: %s", partuuid_input);
     }
 
+    // A restarted unit picks up the image of an interrupted run through its journal.
+    resume_copy = 1;
+    // Unattended copies are watched through the exporter instead of the journal's progress lines.
+    if (metrics_socket == NULL)
+    {
+        metrics_socket = DEFAULT_METRICS_SOCKET;
+    }
+    struct stat textfile_dir;
+    if (metrics_file == NULL && stat(DEFAULT_METRICS_TEXTFILE_DIR, &textfile_dir) == 0 && S_ISDIR(textfile_dir.st_mode))
+    {
+        metrics_file = DEFAULT_METRICS_TEXTFILE_DIR "/dddarth.prom";
+    }
+    char copy_command[MAX_PATH * 2];
+    build_copy_command(copy_command, sizeof(copy_command), "/usr/local/bin/dddarth", input_file, "${output_file}");
+
     char service_file[MAX_PATH];
     snprintf(service_file, sizeof(service_file), "/etc/systemd/system/dddarth.service");
     print_debug("Service file path: %s", service_file);
@@ -612,14 +9703,16 @@ void create_systemd_service(const char *input_drive, const char *output_drive)
             "    mount_point=\"/mnt/dmx-extraction${timestamp}\"; \\\n"
             "    mkdir -p ${mount_point}; \\\n"
             "    mount PARTUUID=%s ${mount_point}; \\\n"
-            "    output_file=\"${mount_point}/%s_%s_${timestamp}.dd\"; \\\n"
-            "    dd if=%s of=${output_file} bs=%s status=progress' \n"
+            "    output_file=$(ls -t ${mount_point}/%s_%s_*.dd.journal 2>/dev/null | head -n 1); \\\n"
+            "    output_file=${output_file%%.journal}; \\\n"
+            "    [ -n \"${output_file}\" ] || output_file=\"${mount_point}/%s_%s_${timestamp}.dd\"; \\\n"
+            "    %s' \n"
             "Restart=on-failure\n"
             "User=root\n"
             "Group=root\n\n"
             "[Install]\n"
             "WantedBy=multi-user.target\n",
-            partuuid_output, partuuid_input, partuuid_output, input_file, best_block_size);
+            partuuid_output, partuuid_input, partuuid_output, partuuid_input, partuuid_output, copy_command);
 
     fclose(service);
     // print_debug("Finished writing to service file");
@@ -695,14 +9788,170 @@ void usage(const char *program_name)
     printf("  │ \033[1;31m-c --copy-size\033[0m                │ \033[1;37mSize of the data to copy (default: 1G)\033[0m\n");
     printf("  │                               │ Example: %s -c 2G                                                                                  │\n", program_name);
     printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
-    printf("  │ \033[1;31m-b --block-sizes\033[0m              │ \033[1;37mComma-separated list of block sizes to test (default: 32k,64k,128k,256k,512k,1M,4M,16M)\033[0m\n");
-    printf("  │                               │ Example: %s -b 64k,128k,256k                                                                       │\n", program_name);
+    printf("  │ \033[1;31m-b --block-sizes\033[0m              │ \033[1;37mComma-separated list of block sizes to test (default: 32k,64k,128k,256k,512k,1M,4M,16M)\033[0m\n");
+    printf("  │                               │ Example: %s -b 64k,128k,256k                                                                       │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m-i --input-file\033[0m               │ \033[1;37mInput file/device (default: /dev/nvme0n1)\033{0m\n");
+    printf("  │                               │ Example: %s -i /dev/sda                                                                            │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m-o --output-disk\033[0m              │ \033[1;37mOutput disk (default: /dev/sdb)\033[0m\n");
+    printf("  │                               │ Example: %s -o /dev/sdb                                                                            │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m-e --engine\033[0m                   │ \033[1;37mEngine(s): native, uring, striped, pipeline, zerocopy or dd; a list is benchmarked (default: native)\033[0m\n");
+    printf("  │                               │ Example: %s -e native,uring,dd                                                                     │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--direct\033[0m                      │ \033[1;37mUse O_DIRECT for reads and writes, bypassing the page cache\033[0m\n");
+    printf("  │                               │ Example: %s --direct -e native                                                                     │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m-q --queue-depth\033[0m              │ \033[1;37mBlocks in flight for the uring engine / ring buffers for the pipeline engine (default: 32)\033[0m\n");
+    printf("  │                               │ Example: %s -e uring -q 64                                                                         │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m-t --threads\033[0m                  │ \033[1;37mNumber of worker threads used by the striped engine (default: 4)\033[0m\n");
+    printf("  │                               │ Example: %s -e striped -t 8                                                                        │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--chunk-size\033[0m                  │ \033[1;37mUnit of work handed to striped workers (default: 64M)\033[0m\n");
+    printf("  │                               │ Example: %s -e striped --chunk-size 256M                                                           │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--adaptive\033[0m                    │ \033[1;37mSkip the benchmark and tune block size/queue depth during the real copy\033[0m\n");
+    printf("  │                               │ Example: %s --adaptive -e uring --nvme-to-sdb-auto-rip                                             │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--adapt-window\033[0m                │ \033[1;37mBytes copied per adaptive measurement window (default: 1G, minimum 64M)\033[0m\n");
+    printf("  │                               │ Example: %s --adaptive --adapt-window 4G                                                           │\n", program_name);
     printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
-    printf("  │ \033[1;31m-i --input-file\033[0m               │ \033[1;37mInput file/device (default: /dev/nvme0n1)\033{0m\n");
-    printf("  │                               │ Example: %s -i /dev/sda                                                                            │\n", program_name);
+    printf("  │ \033[1;31m--repetitions\033[0m                 │ \033[1;37mMeasured runs per benchmark configuration; >1 reports mean/median/stddev/95%% CI (default: 1)\033[0m\n");
+    printf("  │                               │ Example: %s --repetitions 5 --warmup 1 --benchmark                                                 │\n", program_name);
     printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
-    printf("  │ \033[1;31m-o --output-disk\033[0m              │ \033[1;37mOutput disk (default: /dev/sdb)\033[0m\n");
-    printf("  │                               │ Example: %s -o /dev/sdb                                                                            │\n", program_name);
+    printf("  │ \033[1;31m--warmup\033[0m                      │ \033[1;37mDiscarded warm-up runs before the measured ones (default: 0)\033[0m\n");
+    printf("  │                               │ Example: %s --warmup 1 --repetitions 5                                                             │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--search\033[0m                      │ \033[1;37mBenchmark strategy: exhaustive, or halving (successive halving on growing samples) (default: exhaustive)\033[0m\n");
+    printf("  │                               │ Example: %s --search halving -c 4G --benchmark                                                     │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--time-budget\033[0m                 │ \033[1;37mStop benchmarking after this many seconds and decide with what was measured\033[0m\n");
+    printf("  │                               │ Example: %s --search halving --time-budget 120                                                     │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--queue-depths\033[0m                │ \033[1;37mQueue depths to benchmark for uring/pipeline (default: the -q value)\033[0m\n");
+    printf("  │                               │ Example: %s -e uring --queue-depths 1,8,32,128                                                     │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--thread-counts\033[0m               │ \033[1;37mThread counts to benchmark for the striped engine (default: the -t value)\033[0m\n");
+    printf("  │                               │ Example: %s -e striped --thread-counts 1,2,4,8                                                     │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--io-modes\033[0m                    │ \033[1;37mI/O modes to benchmark: buffered, direct or both; results go to results/benchmark_grid_*\033[0m\n");
+    printf("  │                               │ Example: %s --io-modes buffered,direct                                                             │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--copy-to\033[0m                     │ \033[1;37mCopy the input file to an image with the given settings, no benchmark (used by systemd)\033[0m\n");
+    printf("  │                               │ Example: %s -i /dev/nvme0n1 -e uring -b 4M --copy-to /mnt/x/img.dd                                 │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--cache-file\033[0m                  │ \033[1;37mBenchmark cache keyed by source/target model, serial and search space (default: /var/cache/dddarth/benchmark.cache)\033[0m\n");
+    printf("  │                               │ Example: %s --cache-file /root/dddarth.cache                                                       │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--cache-ttl\033[0m                   │ \033[1;37mHours a cached benchmark stays valid; firmware, block size or kernel changes invalidate it (default: 168, 0 = off)\033[0m\n");
+    printf("  │                               │ Example: %s --cache-ttl 24                                                                         │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--refresh-cache\033[0m               │ \033[1;37mIgnore the cached result, benchmark again and update the cache\033[0m\n");
+    printf("  │                               │ Example: %s --refresh-cache -m                                                                     │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--rank-by\033[0m                     │ \033[1;37mRate that picks the benchmark winner: durable (including fdatasync, default) or buffered (page cache)\033[0m\n");
+    printf("  │                               │ Example: %s --rank-by buffered                                                                     │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--keep-page-cache\033[0m             │ \033[1;37mDo not release the page cache of copied ranges (fadvise/sync_file_range windows) during a copy\033[0m\n");
+    printf("  │                               │ Example: %s --keep-page-cache -e native                                                            │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--sparse\033[0m                      │ \033[1;37mDo not write all-zero blocks (SSE2/AVX2/AVX-512 detection), leave holes in the image and report skipped bytes\033[0m\n");
+    printf("  │                               │ Example: %s --sparse -e uring                                                                      │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--hash\033[0m                        │ \033[1;37mHash the image while copying: whole-image SHA-256/XXH64 and a per-chunk manifest (<image>.hashes, <image>.sha256)\033[0m\n");
+    printf("  │                               │ Example: %s --hash --chunk-size 64M                                                                │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--hash-threads\033[0m                │ \033[1;37mThreads hashing chunks next to the in-order whole-image hash (default: 2)\033[0m\n");
+    printf("  │                               │ Example: %s --hash --hash-threads 4                                                                │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--verify\033[0m                      │ \033[1;37mRead the image back cold in parallel, check every chunk against the manifest and re-copy mismatches\033[0m\n");
+    printf("  │                               │ Example: %s --verify --threads 8                                                                   │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--compress\033[0m                    │ \033[1;37mWrite a seekable compressed image of independent frames: zstd or lz4 (libzstd.so.1/liblz4.so.1 at runtime)\033[0m\n");
+    printf("  │                               │ Example: %s --compress zstd                                                                        │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--compress-level\033[0m              │ \033[1;37mCompression level, or auto to pick the highest level that keeps up with source and target (default: auto)\033[0m\n");
+    printf("  │                               │ Example: %s --compress zstd --compress-level 9                                                     │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--frame-size\033[0m                  │ \033[1;37mUncompressed size of each independently compressed frame (default: 4M)\033[0m\n");
+    printf("  │                               │ Example: %s --compress lz4 --frame-size 16M                                                        │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--compress-threads\033[0m            │ \033[1;37mThreads compressing or extracting frames (default: one per online CPU)\033[0m\n");
+    printf("  │                               │ Example: %s --compress zstd --compress-threads 6                                                   │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--extract\033[0m                     │ \033[1;37mDecompress a --compress image back to a raw image in parallel, checking every frame checksum\033[0m\n");
+    printf("  │                               │ Example: %s --extract /mnt/output_disk/nvme0n1_sdb1_1700000000.dd.zst                              │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--incremental\033[0m                 │ \033[1;37mOnly write chunks that changed since a previous image (its <image>.hashes), into <image>.delta\033[0m\n");
+    printf("  │                               │ Example: %s --incremental /mnt/output_disk/monday.dd                                               │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--patch\033[0m                       │ \033[1;37mWith --incremental: clone the previous image (reflink if possible) and patch the changed chunks in place\033[0m\n");
+    printf("  │                               │ Example: %s --incremental /mnt/output_disk/monday.dd --patch                                       │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--materialize\033[0m                 │ \033[1;37mRebuild a full image from a base image and its deltas, applied in order\033[0m\n");
+    printf("  │                               │ Example: %s --materialize monday.dd,tuesday.dd.delta,wednesday.dd.delta                            │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--resume\033[0m                      │ \033[1;37mKeep a journal of the durable offset in <image>.journal and continue an interrupted copy from it\033[0m\n");
+    printf("  │                               │ Example: %s --resume --copy-to /mnt/output_disk/nvme.dd                                            │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--journal-interval\033[0m            │ \033[1;37mBytes copied between fdatasync + journal commits, the most a crash can lose (default: 1G)\033[0m\n");
+    printf("  │                               │ Example: %s --resume --journal-interval 4G                                                         │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--rescue\033[0m                      │ \033[1;37mError-tolerant copy: skip read errors, retry them per sector, zero-fill and map the rest in IMAGE.map\033[0m\n");
+    printf("  │                               │ Example: %s --rescue --direct -i /dev/sdc --copy-to /mnt/sdc.img                                   │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--rescue-retries\033[0m              │ \033[1;37mExtra passes over sectors that stayed unreadable (default: 2)\033[0m\n");
+    printf("  │                               │ Example: %s --rescue --rescue-retries 5 --copy-to /mnt/sdc.img                                     │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--allocated-only\033[0m              │ \033[1;37mCopy only blocks in use by ext2/3/4 and XFS (from GPT + allocation bitmaps) into a sparse image\033[0m\n");
+    printf("  │                               │ Example: %s --allocated-only -i /dev/nvme0n1 --copy-to /mnt/nvme.img                               │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--fan-out\033[0m                     │ \033[1;37mRead the input once and write it to every image in the comma-separated list, one writer thread per target\033[0m\n");
+    printf("  │                               │ Example: %s -i /dev/nvme0n1 --fan-out /mnt/a/nvme.dd,/mnt/b/nvme.dd                                │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--nvme-to-sda-sdb-auto-rip\033[0m    │ \033[1;37mRun benchmark and copy nvme0n1 to sdb and sda in one pass (sda is mounted at /mnt/output_disk2)\033[0m\n");
+    printf("  │                               │ Example: %s --nvme-to-sda-sdb-auto-rip                                                             │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--batch\033[0m                       │ \033[1;37mCopy every SOURCE IMAGE line of a job file in parallel, serializing jobs that share a host controller\033[0m\n");
+    printf("  │                               │ Example: %s -e uring --batch jobs.txt                                                              │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--jobs-per-controller\033[0m         │ \033[1;37mJobs allowed on one controller (NVMe function, HBA, USB host) at a time for --batch (default 1)\033[0m\n");
+    printf("  │                               │ Example: %s --jobs-per-controller 2 --batch jobs.txt                                               │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--batch-jobs\033[0m                  │ \033[1;37mCap on jobs running at once for --batch (default: as many as the controllers allow)\033[0m\n");
+    printf("  │                               │ Example: %s --batch-jobs 4 --batch jobs.txt                                                        │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--stats-window\033[0m                │ \033[1;37mThroughput window in milliseconds for the per-run JSON metrics (default 1000)\033[0m\n");
+    printf("  │                               │ Example: %s --stats-window 250 --copy-to /mnt/img.dd                                               │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--metrics-file\033[0m                │ \033[1;37mWrite live Prometheus metrics (bytes, rates, ETA, queue occupancy, errors) to this textfile during copies\033[0m\n");
+    printf("  │                               │ Example: %s --metrics-file /var/lib/node_exporter/textfile_collector/dddarth.prom                  │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--metrics-socket\033[0m              │ \033[1;37mServe the same metrics on a Unix socket, one snapshot per connection (unit default: /run/dddarth.sock)\033[0m\n");
+    printf("  │                               │ Example: %s --metrics-socket /run/dddarth.sock --copy-to /mnt/img.dd                               │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--metrics-interval\033[0m            │ \033[1;37mSeconds between textfile updates and rate samples (default 1)\033[0m\n");
+    printf("  │                               │ Example: %s --metrics-interval 5 --metrics-file /tmp/dddarth.prom                                  │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--metrics-query\033[0m               │ \033[1;37mPrint the metrics a running dddarth serves on the given socket\033[0m\n");
+    printf("  │                               │ Example: %s --metrics-query /run/dddarth.sock                                                      │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--max-rate\033[0m                    │ \033[1;37mToken-bucket limit on copy throughput in bytes per second, smoothed over 100 ms\033[0m\n");
+    printf("  │                               │ Example: %s --max-rate 200M --copy-to /mnt/img.dd                                                  │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--max-iops\033[0m                    │ \033[1;37mLimit on read requests per second\033[0m\n");
+    printf("  │                               │ Example: %s --max-iops 2000 -b 64k --copy-to /mnt/img.dd                                           │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--latency-target\033[0m              │ \033[1;37mBack off (-30%%) while the p99 source read latency exceeds this many microseconds, recover +10%%\033[0m\n");
+    printf("  │                               │ Example: %s --latency-target 2000 --max-rate 500M --copy-to /mnt/img.dd                            │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--ioprio\033[0m                      │ \033[1;37mI/O scheduling class of the copy: idle, be[:0-7] or rt[:0-7] (BFQ/mq-deadline)\033[0m\n");
+    printf("  │                               │ Example: %s --ioprio idle --copy-to /mnt/img.dd                                                    │\n", program_name);
+    printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
+    printf("  │ \033[1;31m--cgroup\033[0m                      │ \033[1;37mJoin a cgroup v2 group (created under /sys/fs/cgroup if needed), optionally setting io.weight\033[0m\n");
+    printf("  │                               │ Example: %s --cgroup dddarth:50 --copy-to /mnt/img.dd                                              │\n", program_name);
     printf("  ├───────────────────────────────┼─────────────────────────────────────────────────────────────────────────────────────────────────────────┤\n");
     printf("  │ \033[1;31m--nvme-to-sdb-auto-rip\033[0m        │ \033[1;37mRun benchmark and copy from nvme0n1 to sdb with best performance values.\033[0m\n");
     printf("  │                               │ Example: %s --nvme-to-sdb-auto-rip                                                                 │\n", program_name);
@@ -736,6 +9985,59 @@ void usage(const char *program_name)
  */
 void parse_arguments(int argc, char **argv)
 {
+    enum
+    {
+        OPT_DIRECT = 256,
+        OPT_CHUNK_SIZE,
+        OPT_ADAPTIVE,
+        OPT_ADAPT_WINDOW,
+        OPT_REPETITIONS,
+        OPT_WARMUP,
+        OPT_SEARCH,
+        OPT_TIME_BUDGET,
+        OPT_QUEUE_DEPTHS,
+        OPT_THREAD_COUNTS,
+        OPT_IO_MODES,
+        OPT_COPY_TO,
+        OPT_CACHE_FILE,
+        OPT_CACHE_TTL,
+        OPT_REFRESH_CACHE,
+        OPT_RANK_BY,
+        OPT_KEEP_PAGE_CACHE,
+        OPT_SPARSE,
+        OPT_HASH,
+        OPT_HASH_THREADS,
+        OPT_VERIFY,
+        OPT_COMPRESS,
+        OPT_COMPRESS_LEVEL,
+        OPT_FRAME_SIZE,
+        OPT_COMPRESS_THREADS,
+        OPT_EXTRACT,
+        OPT_INCREMENTAL,
+        OPT_PATCH,
+        OPT_MATERIALIZE,
+        OPT_RESUME,
+        OPT_JOURNAL_INTERVAL,
+        OPT_RESCUE,
+        OPT_RESCUE_RETRIES,
+        OPT_ALLOCATED_ONLY,
+        OPT_FAN_OUT,
+        OPT_NVME_TO_SDA_SDB,
+        OPT_BATCH,
+        OPT_JOBS_PER_CONTROLLER,
+        OPT_BATCH_JOBS,
+        OPT_STATS_WINDOW,
+        OPT_METRICS_FILE,
+        OPT_METRICS_SOCKET,
+        OPT_METRICS_INTERVAL,
+        OPT_METRICS_QUERY,
+        OPT_MAX_RATE,
+        OPT_MAX_IOPS,
+        OPT_LATENCY_TARGET,
+        OPT_IOPRIO,
+        OPT_CGROUP
+    };
+
     static struct option long_options[] = {
         {"copy-size", required_argument, 0, 'c'},
         {"block-sizes", required_argument, 0, 'b'},
@@ -746,6 +10048,58 @@ void parse_arguments(int argc, char **argv)
         {"systemd-auto-rip", required_argument, 0, 'a'},
         {"install", no_argument, 0, 'n'},
         {"benchmark", no_argument, 0, 'm'},
+        {"engine", required_argument, 0, 'e'},
+        {"direct", no_argument, 0, OPT_DIRECT},
+        {"queue-depth", required_argument, 0, 'q'},
+        {"threads", required_argument, 0, 't'},
+        {"chunk-size", required_argument, 0, OPT_CHUNK_SIZE},
+        {"adaptive", no_argument, 0, OPT_ADAPTIVE},
+        {"adapt-window", required_argument, 0, OPT_ADAPT_WINDOW},
+        {"repetitions", required_argument, 0, OPT_REPETITIONS},
+        {"warmup", required_argument, 0, OPT_WARMUP},
+        {"search", required_argument, 0, OPT_SEARCH},
+        {"time-budget", required_argument, 0, OPT_TIME_BUDGET},
+        {"queue-depths", required_argument, 0, OPT_QUEUE_DEPTHS},
+        {"thread-counts", required_argument, 0, OPT_THREAD_COUNTS},
+        {"io-modes", required_argument, 0, OPT_IO_MODES},
+        {"copy-to", required_argument, 0, OPT_COPY_TO},
+        {"cache-file", required_argument, 0, OPT_CACHE_FILE},
+        {"cache-ttl", required_argument, 0, OPT_CACHE_TTL},
+        {"refresh-cache", no_argument, 0, OPT_REFRESH_CACHE},
+        {"rank-by", required_argument, 0, OPT_RANK_BY},
+        {"keep-page-cache", no_argument, 0, OPT_KEEP_PAGE_CACHE},
+        {"sparse", no_argument, 0, OPT_SPARSE},
+        {"hash", no_argument, 0, OPT_HASH},
+        {"hash-threads", required_argument, 0, OPT_HASH_THREADS},
+        {"verify", no_argument, 0, OPT_VERIFY},
+        {"compress", required_argument, 0, OPT_COMPRESS},
+        {"compress-level", required_argument, 0, OPT_COMPRESS_LEVEL},
+        {"frame-size", required_argument, 0, OPT_FRAME_SIZE},
+        {"compress-threads", required_argument, 0, OPT_COMPRESS_THREADS},
+        {"extract", required_argument, 0, OPT_EXTRACT},
+        {"incremental", required_argument, 0, OPT_INCREMENTAL},
+        {"patch", no_argument, 0, OPT_PATCH},
+        {"materialize", required_argument, 0, OPT_MATERIALIZE},
+        {"resume", no_argument, 0, OPT_RESUME},
+        {"journal-interval", required_argument, 0, OPT_JOURNAL_INTERVAL},
+        {"rescue", no_argument, 0, OPT_RESCUE},
+        {"rescue-retries", required_argument, 0, OPT_RESCUE_RETRIES},
+        {"allocated-only", no_argument, 0, OPT_ALLOCATED_ONLY},
+        {"fan-out", required_argument, 0, OPT_FAN_OUT},
+        {"nvme-to-sda-sdb-auto-rip", no_argument, 0, OPT_NVME_TO_SDA_SDB},
+        {"batch", required_argument, 0, OPT_BATCH},
+        {"jobs-per-controller", required_argument, 0, OPT_JOBS_PER_CONTROLLER},
+        {"batch-jobs", required_argument, 0, OPT_BATCH_JOBS},
+        {"stats-window", required_argument, 0, OPT_STATS_WINDOW},
+        {"metrics-file", required_argument, 0, OPT_METRICS_FILE},
+        {"metrics-socket", required_argument, 0, OPT_METRICS_SOCKET},
+        {"metrics-interval", required_argument, 0, OPT_METRICS_INTERVAL},
+        {"metrics-query", required_argument, 0, OPT_METRICS_QUERY},
+        {"max-rate", required_argument, 0, OPT_MAX_RATE},
+        {"max-iops", required_argument, 0, OPT_MAX_IOPS},
+        {"latency-target", required_argument, 0, OPT_LATENCY_TARGET},
+        {"ioprio", required_argument, 0, OPT_IOPRIO},
+        {"cgroup", required_argument, 0, OPT_CGROUP},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}};
 
@@ -756,7 +10110,7 @@ void parse_arguments(int argc, char **argv)
         usage(argv[0]);
     }
 
-    while ((c = getopt_long(argc, argv, "c:b:i:o:rsa:nhm", long_options, &opt_index)) != -1)
+    while ((c = getopt_long(argc, argv, "c:b:i:o:rsa:nhme:q:t:", long_options, &opt_index)) != -1)
     {
         switch (c)
         {
@@ -772,6 +10126,166 @@ void parse_arguments(int argc, char **argv)
         case 'o':
             output_disk = strdup(optarg);
             break;
+        case 'e':
+            parse_engine(optarg);
+            break;
+        case OPT_DIRECT:
+            use_direct_io = 1;
+            break;
+        case 'q':
+            parse_queue_depth(optarg);
+            break;
+        case 't':
+            parse_threads(optarg);
+            break;
+        case OPT_CHUNK_SIZE:
+            parse_chunk_size(optarg);
+            break;
+        case OPT_ADAPTIVE:
+            adaptive_tuning = 1;
+            break;
+        case OPT_ADAPT_WINDOW:
+            parse_adapt_window(optarg);
+            break;
+        case OPT_REPETITIONS:
+            bench_repetitions = parse_count(optarg, "repetition count", 1, 100);
+            break;
+        case OPT_WARMUP:
+            bench_warmup = parse_count(optarg, "warm-up count", 0, 100);
+            break;
+        case OPT_SEARCH:
+            parse_search(optarg);
+            break;
+        case OPT_TIME_BUDGET:
+            bench_time_budget = parse_count(optarg, "time budget", 1, 86400);
+            break;
+        case OPT_QUEUE_DEPTHS:
+            bench_queue_depths = parse_count_list(optarg, "queue depth", 1, 4096, &num_bench_queue_depths);
+            break;
+        case OPT_THREAD_COUNTS:
+            bench_thread_counts = parse_count_list(optarg, "thread count", 1, 256, &num_bench_thread_counts);
+            break;
+        case OPT_IO_MODES:
+            parse_direct_modes(optarg);
+            break;
+        case OPT_CACHE_FILE:
+            bench_cache_file = strdup(optarg);
+            break;
+        case OPT_CACHE_TTL:
+            bench_cache_ttl_hours = parse_count(optarg, "cache TTL in hours", 0, 87600);
+            break;
+        case OPT_REFRESH_CACHE:
+            bench_cache_refresh = 1;
+            break;
+        case OPT_RANK_BY:
+            parse_rank_by(optarg);
+            break;
+        case OPT_KEEP_PAGE_CACHE:
+            page_cache_control = 0;
+            break;
+        case OPT_SPARSE:
+            sparse_output = 1;
+            break;
+        case OPT_HASH:
+            hash_image = 1;
+            break;
+        case OPT_HASH_THREADS:
+            hash_threads = parse_count(optarg, "hash thread count", 1, 64);
+            break;
+        case OPT_VERIFY:
+            // The read-back is checked against the manifest the copy writes.
+            verify_output = 1;
+            hash_image = 1;
+            break;
+        case OPT_COMPRESS:
+            parse_compress(optarg);
+            break;
+        case OPT_COMPRESS_LEVEL:
+            compress_level = strcmp(optarg, "auto") == 0 ? 0 : (int)parse_count(optarg, "compression level", 1, 22);
+            break;
+        case OPT_FRAME_SIZE:
+            parse_frame_size(optarg);
+            break;
+        case OPT_COMPRESS_THREADS:
+            compress_threads = parse_count(optarg, "compression thread count", 1, 256);
+            break;
+        case OPT_EXTRACT:
+            extract_image(optarg);
+            exit(EXIT_SUCCESS);
+        case OPT_INCREMENTAL:
+            incremental_base = optarg;
+            break;
+        case OPT_PATCH:
+            patch_base = 1;
+            break;
+        case OPT_MATERIALIZE:
+            materialize_image(optarg);
+            exit(EXIT_SUCCESS);
+        case OPT_RESUME:
+            resume_copy = 1;
+            break;
+        case OPT_JOURNAL_INTERVAL:
+            parse_journal_interval(optarg);
+            break;
+        case OPT_RESCUE:
+            rescue_mode = 1;
+            break;
+        case OPT_RESCUE_RETRIES:
+            rescue_retries = parse_count(optarg, "rescue retry count", 0, 100);
+            break;
+        case OPT_ALLOCATED_ONLY:
+            allocated_only = 1;
+            break;
+        case OPT_COPY_TO:
+            copy_to_image(optarg);
+            exit(EXIT_SUCCESS);
+        case OPT_FAN_OUT:
+            copy_to_images(optarg);
+            exit(EXIT_SUCCESS);
+        case OPT_NVME_TO_SDA_SDB:
+            nvme_to_sda_sdb_auto_rip();
+            exit(EXIT_SUCCESS);
+        case OPT_JOBS_PER_CONTROLLER:
+            batch_jobs_per_controller = parse_count(optarg, "jobs per controller", 1, 64);
+            break;
+        case OPT_BATCH_JOBS:
+            batch_max_jobs = parse_count(optarg, "batch job count", 1, 1024);
+            break;
+        case OPT_BATCH:
+            run_batch(optarg);
+            exit(EXIT_SUCCESS);
+        case OPT_STATS_WINDOW:
+            stats_window_seconds = parse_count(optarg, "stats window in ms", 10, 3600000) / 1000.0;
+            break;
+        case OPT_METRICS_FILE:
+            metrics_file = optarg;
+            break;
+        case OPT_METRICS_SOCKET:
+            metrics_socket = optarg;
+            break;
+        case OPT_METRICS_INTERVAL:
+            metrics_interval_seconds = parse_count(optarg, "metrics interval in seconds", 1, 3600);
+            break;
+        case OPT_METRICS_QUERY:
+            query_metrics(optarg);
+            exit(EXIT_SUCCESS);
+        case OPT_MAX_RATE:
+            parse_max_rate(optarg);
+            break;
+        case OPT_MAX_IOPS:
+            max_iops = parse_count(optarg, "IOPS limit", 1, 10000000);
+            break;
+        case OPT_LATENCY_TARGET:
+            latency_target_us = parse_count(optarg, "p99 read latency target in microseconds", 10, 10000000);
+            break;
+        case OPT_IOPRIO:
+            set_io_priority(optarg);
+            io_priority = optarg;
+            break;
+        case OPT_CGROUP:
+            join_io_cgroup(optarg);
+            io_cgroup = optarg;
+            break;
         case 'r':
             nvme_to_sdb_auto_rip();
             exit(EXIT_SUCCESS);
@@ -805,6 +10319,14 @@ void parse_arguments(int argc, char **argv)
         block_sizes = (char **)default_block_sizes;
         num_block_sizes = num_default_block_sizes;
     }
+    if (selected_engines == NULL)
+    {
+        // The benchmark reassigns copy_engine per candidate, so the list holds a copy of it.
+        static enum copy_engine_type single_engine;
+        single_engine = copy_engine;
+        selected_engines = &single_engine;
+        num_selected_engines = 1;
+    }
 
     if (input_file == NULL)
     {
@@ -933,6 +10455,248 @@ void parse_copy_size(const char *optarg)
     copy_size = strdup(optarg);
     ////print_debug("Copy size set to: %s", copy_size);
 }
+enum copy_engine_type lookup_engine(const char *name)
+{
+    for (size_t i = 0; i < num_copy_engines; ++i)
+    {
+        if (strcmp(name, copy_engine_names[i]) == 0)
+        {
+            return (enum copy_engine_type)i;
+        }
+    }
+    fprintf(stderr, "Invalid engine: %s\n", name);
+    exit(EXIT_FAILURE);
+}
+
+void parse_engine(const char *optarg)
+{
+    char *token;
+    char *input = strdup(optarg);
+    char *rest = input;
+
+    selected_engines = (enum copy_engine_type *)malloc(num_copy_engines * sizeof(enum copy_engine_type));
+    if (!selected_engines)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    num_selected_engines = 0;
+    while ((token = strtok_r(rest, ",", &rest)) && num_selected_engines < num_copy_engines)
+    {
+        selected_engines[num_selected_engines++] = lookup_engine(token);
+    }
+    if (num_selected_engines == 0)
+    {
+        fprintf(stderr, "Invalid engine: %s\n", optarg);
+        exit(EXIT_FAILURE);
+    }
+    copy_engine = selected_engines[0];
+
+    free(input);
+}
+
+void parse_queue_depth(const char *optarg)
+{
+    char *end;
+    long value = strtol(optarg, &end, 10);
+    if (*end != '\0' || value < 1 || value > 4096)
+    {
+        fprintf(stderr, "Invalid queue depth: %s (expected 1-4096)\n", optarg);
+        exit(EXIT_FAILURE);
+    }
+    queue_depth = (unsigned)value;
+}
+
+void parse_threads(const char *optarg)
+{
+    char *end;
+    long value = strtol(optarg, &end, 10);
+    if (*end != '\0' || value < 1 || value > 256)
+    {
+        fprintf(stderr, "Invalid thread count: %s (expected 1-256)\n", optarg);
+        exit(EXIT_FAILURE);
+    }
+    copy_threads = (unsigned)value;
+}
+
+void parse_chunk_size(const char *optarg)
+{
+    if (!is_valid_size(optarg) || parse_size(optarg) < IO_ALIGNMENT)
+    {
+        fprintf(stderr, "Invalid chunk size: %s\n", optarg);
+        exit(EXIT_FAILURE);
+    }
+    chunk_size_bytes = parse_size(optarg);
+}
+
+unsigned parse_count(const char *optarg, const char *what, unsigned min, unsigned max)
+{
+    char *end;
+    long value = strtol(optarg, &end, 10);
+    if (*end != '\0' || value < (long)min || value > (long)max)
+    {
+        fprintf(stderr, "Invalid %s: %s (expected %u-%u)\n", what, optarg, min, max);
+        exit(EXIT_FAILURE);
+    }
+    return (unsigned)value;
+}
+
+unsigned *parse_count_list(const char *optarg, const char *what, unsigned min, unsigned max, size_t *count)
+{
+    char *token;
+    char *input = strdup(optarg);
+    char *rest = input;
+    size_t capacity = strlen(optarg) / 2 + 1;
+    unsigned *values = (unsigned *)malloc(capacity * sizeof(unsigned));
+    if (!values)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    *count = 0;
+    while ((token = strtok_r(rest, ",", &rest)))
+    {
+        values[(*count)++] = parse_count(token, what, min, max);
+    }
+    if (*count == 0)
+    {
+        fprintf(stderr, "Invalid %s list: %s\n", what, optarg);
+        exit(EXIT_FAILURE);
+    }
+
+    free(input);
+    return values;
+}
+
+void parse_direct_modes(const char *optarg)
+{
+    char *token;
+    char *input = strdup(optarg);
+    char *rest = input;
+
+    bench_direct_modes = (int *)malloc(2 * sizeof(int));
+    if (!bench_direct_modes)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    num_bench_direct_modes = 0;
+    while ((token = strtok_r(rest, ",", &rest)) && num_bench_direct_modes < 2)
+    {
+        if (strcmp(token, "buffered") == 0)
+        {
+            bench_direct_modes[num_bench_direct_modes++] = 0;
+        }
+        else if (strcmp(token, "direct") == 0)
+        {
+            bench_direct_modes[num_bench_direct_modes++] = 1;
+        }
+        else
+        {
+            fprintf(stderr, "Invalid I/O mode: %s (expected buffered or direct)\n", token);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    free(input);
+}
+
+void parse_search(const char *optarg)
+{
+    if (strcmp(optarg, "exhaustive") == 0)
+    {
+        bench_search = SEARCH_EXHAUSTIVE;
+    }
+    else if (strcmp(optarg, "halving") == 0)
+    {
+        bench_search = SEARCH_HALVING;
+    }
+    else
+    {
+        fprintf(stderr, "Invalid search strategy: %s (expected exhaustive or halving)\n", optarg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void parse_rank_by(const char *optarg)
+{
+    if (strcmp(optarg, "durable") == 0)
+    {
+        bench_rank_buffered = 0;
+    }
+    else if (strcmp(optarg, "buffered") == 0)
+    {
+        bench_rank_buffered = 1;
+    }
+    else
+    {
+        fprintf(stderr, "Invalid rate to rank by: %s (expected durable or buffered)\n", optarg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void parse_compress(const char *optarg)
+{
+    if (strcmp(optarg, "zstd") == 0)
+    {
+        compress_output = COMPRESS_ZSTD;
+    }
+    else if (strcmp(optarg, "lz4") == 0)
+    {
+        compress_output = COMPRESS_LZ4;
+    }
+    else
+    {
+        fprintf(stderr, "Invalid compressor: %s (expected zstd or lz4)\n", optarg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void parse_frame_size(const char *optarg)
+{
+    // Frame sizes are stored as 32-bit fields in the seek table.
+    if (!is_valid_size(optarg) || parse_size(optarg) < 64 * 1024 || parse_size(optarg) > 256 * 1024 * 1024 || parse_size(optarg) % IO_ALIGNMENT != 0)
+    {
+        fprintf(stderr, "Invalid frame size: %s (expected a multiple of 4k between 64k and 256M)\n", optarg);
+        exit(EXIT_FAILURE);
+    }
+    frame_size_bytes = parse_size(optarg);
+}
+
+void parse_journal_interval(const char *optarg)
+{
+    if (!is_valid_size(optarg) || parse_size(optarg) < 16 * 1024 * 1024)
+    {
+        fprintf(stderr, "Invalid journal interval: %s (expected at least 16M)\n", optarg);
+        exit(EXIT_FAILURE);
+    }
+    journal_interval_bytes = parse_size(optarg);
+}
+
+void parse_max_rate(const char *optarg)
+{
+    if (!is_valid_size(optarg) || parse_size(optarg) < 1024 * 1024)
+    {
+        fprintf(stderr, "Invalid rate limit: %s (expected bytes per second, at least 1M)\n", optarg);
+        exit(EXIT_FAILURE);
+    }
+    max_rate_bytes = parse_size(optarg);
+    throttle.bytes_per_second = max_rate_bytes;
+}
+
+void parse_adapt_window(const char *optarg)
+{
+    if (!is_valid_size(optarg) || parse_size(optarg) < 64 * 1024 * 1024)
+    {
+        fprintf(stderr, "Invalid adaptive window: %s (minimum 64M)\n", optarg);
+        exit(EXIT_FAILURE);
+    }
+    adapt_window_bytes = parse_size(optarg);
+}
+
 /**
  * @brief The main function of the program.
  *
@@ -952,6 +10716,8 @@ void parse_copy_size(const char *optarg)
 int main(int argc, char **argv)
 {
     check_root();
+    select_zero_block_kernel();
+    select_sha256_kernel();
     parse_arguments(argc, argv);
 
     print_colored("\033[1;34m", "Copy size: %s\n", copy_size);
@@ -963,6 +10729,13 @@ int main(int argc, char **argv)
     printf("\033[0m\n");
     print_colored("\033[1;34m", "Input file: %s\n", input_file);
     print_colored("\033[1;34m", "Output disk: %s\n", output_disk);
+    print_colored("\033[1;34m", "Copy engines: ");
+    for (size_t i = 0; i < num_selected_engines; ++i)
+    {
+        printf("%s ", copy_engine_names[selected_engines[i]]);
+    }
+    printf("%s\033[0m\n", use_direct_io ? "(O_DIRECT)" : "");
+    print_colored("\033[1;34m", "Queue depth: %u, threads: %u\n", queue_depth, copy_threads);
 
     create_results_directory();
     print_colored("\033[1;34m", "Creating Benchmark Directory: Results\n");